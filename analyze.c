@@ -0,0 +1,1179 @@
+#include "analyze.h"
+#include "interp.h"
+#include "stack.h"
+#include "cont.h"
+#include <string.h>
+
+typedef struct node node;
+typedef struct scope scope;
+typedef struct binding_cache binding_cache;
+typedef lispobj *(*node_exec)(node *, environment *);
+
+/* a free variable's binding, good while the symbol is not defined again;
+ * replaced whole, so threads sharing the node see a consistent one */
+struct binding_cache
+{
+   cell *binding;
+   unsigned long version;   /* symbol_version at the lookup */
+   environment *base;       /* looked up from */
+};
+
+struct node
+{
+   node_exec exec;
+   lispobj *exp;               /* source, for eval on a stack segment */
+   /*@null@*/ lispobj *value;  /* constant, variable, syntax, macro, (params . code)
+                                * or the primitive a call was checked for */
+   int depth;                  /* frames skipped by a reference or a flat closure */
+   int n;                      /* also the index of a variable a flat closure keeps */
+   /*@null@*/ node **args;     /* operator and operands, test and branches, ... */
+   /*@null@*/ scope *scope;    /* of a macro call, to analyze the expansion in */
+   /*@null@*/ binding_cache *cache;   /* of a free reference */
+};
+
+/* a body being analyzed, the frame apply_lambda makes for it */
+struct scope
+{
+   list *names;        /* parameters and variables defined in the body */
+   list *params;       /* the tail of names holding the parameters */
+   bool dynamic;       /* the body defines what the analysis does not see */
+   bool flat;          /* the variables a flat closure keeps, in its frame's order */
+   int depth;          /* 1 for the outermost body */
+   /*@null@*/ scope *outer;
+};
+
+static node *analyze(lispobj *exp, scope *sc, environment *base);
+
+/* execution */
+/* the bookkeeping of eval, for every node */
+/*@null@*/
+static lispobj *run(node *n, environment *env)
+{
+   interp *it = current_interp();
+   lispobj *result;
+
+   if(below_stack_limit((char *)__builtin_frame_address(0)))
+   {
+      return eval_on_segment(n->exp, env);
+   }
+
+   it->stats.evals++;
+   if(++it->stats.eval_depth > it->stats.max_eval_depth)
+   {
+      it->stats.max_eval_depth = it->stats.eval_depth;
+   }
+   check_limits(it);
+   result = n->exec(n, env);
+   it->stats.eval_depth--;
+   return result;
+}
+
+static environment *skip_frames(environment *env, int depth)
+{
+   for(; depth > 0; --depth)
+   {
+      env = cdr(env);
+   }
+   return env;
+}
+
+static lispobj *exec_constant(node *n, environment *env)
+{
+   return n->value;
+}
+
+/*@null@*/
+static cell *local_binding(node *n, environment *env)
+{
+   cell *pair;
+
+   env = skip_frames(env, n->depth);
+   current_interp()->stats.lookups++;
+   pair = assoc(n->value, frame_bindings(car(env)));
+   if(pair == NULL)
+   {
+      /* a parameter left without an argument */
+      return lookup_var_val(n->value, cdr(env));
+   }
+   return pair;
+}
+
+static lispobj *exec_local(node *n, environment *env)
+{
+   return cdr(local_binding(n, env));
+}
+
+/* a variable kept by a flat closure, at its index in the frame's array
+ * unless it had no binding when the closure was made */
+static lispobj *exec_captured(node *n, environment *env)
+{
+   lispobj *frame = car(skip_frames(env, n->depth));
+   cell *binding = ((cell **)cdr(frame))[n->n];
+
+   if(binding == NULL)
+   {
+      return exec_local(n, env);
+   }
+   return cdr(binding);
+}
+
+/*@null@*/
+static cell *free_binding(node *n, environment *env)
+{
+   environment *base = skip_frames(env, n->depth);
+   binding_cache *c = __atomic_load_n(&n->cache, __ATOMIC_ACQUIRE);
+   unsigned long version = symbol_version(n->value);
+   cell *binding;
+
+   if(c != NULL && c->version == version && c->base == base)
+   {
+      return c->binding;
+   }
+   binding = lookup_var_val(n->value, base);
+   if(binding != NULL)
+   {
+      c = (binding_cache *)lisp_alloc(CODE, sizeof(binding_cache));
+      c->binding = binding;
+      c->version = version;
+      c->base = base;
+      __atomic_store_n(&n->cache, c, __ATOMIC_RELEASE);
+   }
+   return binding;
+}
+
+/* set! changes the cached binding itself */
+static lispobj *exec_free(node *n, environment *env)
+{
+   return cdr(free_binding(n, env));
+}
+
+static lispobj *exec_lookup(node *n, environment *env)
+{
+   return cdr(lookup_var_val(n->value, env));
+}
+
+static lispobj *exec_if(node *n, environment *env)
+{
+   if(is_true(run(n->args[0], env)))
+   {
+      return run(n->args[1], env);
+   }
+   else if(n->n == 3)
+   {
+      return run(n->args[2], env);
+   }
+   return new_boolean(false);
+}
+
+/* tests and expressions in turn, NULL for else */
+static lispobj *exec_cond(node *n, environment *env)
+{
+   int i;
+
+   for(i = 0; i < n->n; i += 2)
+   {
+      if(n->args[i] == NULL || is_true(run(n->args[i], env)))
+      {
+         return run(n->args[i + 1], env);
+      }
+   }
+   lisp_error("cond error");
+}
+
+static lispobj *exec_sequence(node *n, environment *env)
+{
+   lispobj *result = NULL;
+   int i;
+
+   for(i = 0; i < n->n; ++i)
+   {
+      result = run(n->args[i], env);
+   }
+   return result;
+}
+
+/* a body syntax_begin reports on */
+static lispobj *exec_begin(node *n, environment *env)
+{
+   return syntax_begin(n->exp, env);
+}
+
+static lispobj *exec_define(node *n, environment *env)
+{
+   define_var_val(n->value, run(n->args[0], env), env);
+   return n->value;
+}
+
+static lispobj *exec_set(node *n, environment *env)
+{
+   lispobj *val;
+
+   if(lookup_var_val(n->value, env) == NULL)
+   {
+      lisp_error("set! error: unbound variable %s", sym_to_string(n->value));
+   }
+   val = run(n->args[0], env);
+   set_var_val(n->value, val, env);
+   return val;
+}
+
+static lispobj *exec_lambda(node *n, environment *env)
+{
+   return new_lambda(n->value, env);
+}
+
+/* the bindings themselves are kept, so set! on either side is seen by
+ * the other.  The frame is (bindings . array), the array indexed like
+ * the captured names */
+static lispobj *exec_closure(node *n, environment *env)
+{
+   lispobj *frame;
+   list *bindings = NULL;
+   cell **array;
+   int i;
+
+   if(n->n == 0)
+   {
+      return new_lambda(n->value, skip_frames(env, n->depth));
+   }
+   array = (cell **)lisp_alloc(CODE, n->n * sizeof(cell *));
+   for(i = n->n - 1; i >= 0; --i)
+   {
+      array[i] = local_binding(n->args[i], env);
+      if(array[i] != NULL)
+      {
+         bindings = cons(array[i], bindings);
+      }
+   }
+   frame = alloc_object(CODE);
+   set_car(frame, bindings);
+   set_cdr(frame, array);
+   return new_lambda(n->value, cons(frame, skip_frames(env, n->depth)));
+}
+
+static lispobj *exec_syntax(node *n, environment *env)
+{
+   return eval_syntax(n->value, cdr(n->exp), env);
+}
+
+static lispobj *exec_eval(node *n, environment *env)
+{
+   return eval(n->exp, env);
+}
+
+/* workers running the body at once may each expand the call; the tree
+ * is published whole */
+static lispobj *exec_macro(node *n, environment *env)
+{
+   node *expansion = __atomic_load_n(&n->args[0], __ATOMIC_ACQUIRE);
+
+   if(expansion == NULL)
+   {
+      lispobj *expanded = eval_macro(n->value, cdr(n->exp), env);
+      expansion = analyze(expanded, n->scope, skip_frames(env, n->scope->depth));
+      __atomic_store_n(&n->args[0], expansion, __ATOMIC_RELEASE);
+   }
+   return run(expansion, env);
+}
+
+/* a procedure bound outside the body, the usual operator, is taken
+ * straight from the cache */
+/*@null@*/
+static lispobj *run_operator(node *n, environment *env)
+{
+   if(n->exec == exec_free)
+   {
+      return cdr(free_binding(n, env));
+   }
+   return run(n, env);
+}
+
+static bool is_applicable(lispobj *obj)
+{
+   return obj != NULL && (is_prim_proc(obj) || is_lambda(obj) || is_continuation(obj));
+}
+
+/* the number of arguments is checked once for each primitive a call
+ * meets, the last one kept in the call node */
+/*@null@*/
+static lispobj *apply_values(node *n, lispobj *operator, int argc, lispobj **argv)
+{
+   if(is_prim_proc(operator))
+   {
+      if(operator != __atomic_load_n(&n->value, __ATOMIC_RELAXED))
+      {
+         if(!prim_takes(operator, argc))
+         {
+            /* which reports the error */
+            return apply_prim_proc(operator, argc, argv);
+         }
+         __atomic_store_n(&n->value, operator, __ATOMIC_RELAXED);
+      }
+      return call_prim_proc(operator, argc, argv);
+   }
+   else if(is_lambda(operator))
+   {
+      return apply_lambda(operator, argc, argv);
+   }
+   apply_continuation(operator, argv_to_list(argc, argv));
+   return NULL;
+}
+
+/* syntax and macros bound after the analysis, as eval does */
+/*@null@*/
+static lispobj *apply_source(node *n, lispobj *operator, environment *env)
+{
+   if(operator != NULL && is_syntax(operator))
+   {
+      return eval_syntax(operator, cdr(n->exp), env);
+   }
+   else if(operator != NULL && is_macro(operator))
+   {
+      return eval(eval_macro(operator, cdr(n->exp), env), env);
+   }
+   lisp_error("eval error: not applicable");
+}
+
+/* the arguments go in an array on the C stack */
+static lispobj *exec_call0(node *n, environment *env)
+{
+   lispobj *operator = run_operator(n->args[0], env);
+
+   if(!is_applicable(operator))
+   {
+      return apply_source(n, operator, env);
+   }
+   return apply_values(n, operator, 0, NULL);
+}
+
+static lispobj *exec_call1(node *n, environment *env)
+{
+   lispobj *operator = run_operator(n->args[0], env);
+   lispobj *argv[1];
+
+   if(!is_applicable(operator))
+   {
+      return apply_source(n, operator, env);
+   }
+   argv[0] = run(n->args[1], env);
+   return apply_values(n, operator, 1, argv);
+}
+
+static lispobj *exec_call2(node *n, environment *env)
+{
+   lispobj *operator = run_operator(n->args[0], env);
+   lispobj *argv[2];
+
+   if(!is_applicable(operator))
+   {
+      return apply_source(n, operator, env);
+   }
+   argv[0] = run(n->args[1], env);
+   argv[1] = run(n->args[2], env);
+   return apply_values(n, operator, 2, argv);
+}
+
+static lispobj *exec_call3(node *n, environment *env)
+{
+   lispobj *operator = run_operator(n->args[0], env);
+   lispobj *argv[3];
+
+   if(!is_applicable(operator))
+   {
+      return apply_source(n, operator, env);
+   }
+   argv[0] = run(n->args[1], env);
+   argv[1] = run(n->args[2], env);
+   argv[2] = run(n->args[3], env);
+   return apply_values(n, operator, 3, argv);
+}
+
+static lispobj *exec_call(node *n, environment *env)
+{
+   lispobj *operator = run_operator(n->args[0], env);
+   lispobj *buffer[MAX_STACK_ARGS];
+   lispobj **argv = buffer;
+   int argc = n->n - 1;
+   int i;
+
+   if(!is_applicable(operator))
+   {
+      return apply_source(n, operator, env);
+   }
+   if(argc > MAX_STACK_ARGS)
+   {
+      argv = (lispobj **)lisp_alloc(CELL, argc * sizeof(lispobj *));
+   }
+   for(i = 0; i < argc; ++i)
+   {
+      argv[i] = run(n->args[i + 1], env);
+   }
+   return apply_values(n, operator, argc, argv);
+}
+
+
+/* analysis */
+static lispobj *exec_fold(node *n, environment *env);
+
+/* a folded or inlined call, n->args[0], still calls n->value, and so do
+ * the folded calls among its operands */
+static bool operator_holds(node *n, environment *env)
+{
+   node *call = n->args[0];
+   int i;
+
+   if(cdr(free_binding(call->args[0], env)) != n->value)
+   {
+      return false;
+   }
+   for(i = 1; i < call->n; ++i)
+   {
+      if(call->args[i]->exec == exec_fold && !operator_holds(call->args[i], env))
+      {
+         return false;
+      }
+   }
+   return true;
+}
+
+/* the value computed at analysis, args[1], while the primitive is bound */
+static lispobj *exec_fold(node *n, environment *env)
+{
+   if(operator_holds(n, env))
+   {
+      return n->args[1]->value;
+   }
+   return run(n->args[0], env);
+}
+
+/* the body of the procedure with the operands put in, args[1], while
+ * the procedure is bound */
+static lispobj *exec_inline(node *n, environment *env)
+{
+   if(operator_holds(n, env))
+   {
+      return run(n->args[1], env);
+   }
+   return run(n->args[0], env);
+}
+
+static node *new_node(node_exec exec, lispobj *exp, int n)
+{
+   node *result = (node *)lisp_alloc(CODE, sizeof(node));
+
+   result->exec = exec;
+   result->exp = exp;
+   result->value = NULL;
+   result->depth = 0;
+   result->n = n;
+   result->args = n > 0 ? (node **)lisp_alloc(CODE, n * sizeof(node *)) : NULL;
+   result->scope = NULL;
+   result->cache = NULL;
+   return result;
+}
+
+static node *new_constant(lispobj *exp, lispobj *value)
+{
+   node *result = new_node(exec_constant, exp, 0);
+   result->value = value;
+   return result;
+}
+
+/* the entry of names for s */
+/*@null@*/
+static symbol *find_name(list *names, symbol *s)
+{
+   for(; names != NULL; names = cdr(names))
+   {
+      if(generic_equal(car(names), s))
+      {
+         return car(names);
+      }
+   }
+   return NULL;
+}
+
+static bool has_name(list *names, symbol *s)
+{
+   return find_name(names, s) != NULL;
+}
+
+static int name_index(list *names, symbol *name)
+{
+   int i = 0;
+
+   for(; car(names) != name; names = cdr(names))
+   {
+      ++i;
+   }
+   return i;
+}
+
+/* bound by one of the analyzed bodies */
+static bool is_shadowed(symbol *s, scope *sc)
+{
+   for(; sc != NULL; sc = sc->outer)
+   {
+      if(has_name(sc->names, s))
+      {
+         return true;
+      }
+   }
+   return false;
+}
+
+/* the value of a variable bound outside the analyzed bodies */
+/*@null@*/
+static lispobj *global_value(symbol *s, scope *sc, environment *base)
+{
+   cell *c;
+
+   if(is_shadowed(s, sc))
+   {
+      return NULL;
+   }
+   c = lookup_var_val(s, base);
+   return c == NULL ? NULL : cdr(c);
+}
+
+static bool is_syntax_of(lispobj *obj, void *evaluate)
+{
+   return obj != NULL && is_syntax(obj) && car(obj) == evaluate;
+}
+
+/* finds the variables a body defines; quote and lambda are not entered */
+static void scan_defines(lispobj *exp, scope *sc, environment *base)
+{
+   if(!is_cell(exp))
+   {
+      return;
+   }
+   if(is_symbol(car(exp)))
+   {
+      lispobj *operator = global_value(car(exp), sc, base);
+
+      if(is_syntax_of(operator, syntax_quote) || is_syntax_of(operator, syntax_lambda))
+      {
+         return;
+      }
+      if((is_syntax_of(operator, syntax_define) || is_syntax_of(operator, syntax_defmacro)) &&
+         is_cell(cdr(exp)) && is_symbol(car(cdr(exp))))
+      {
+         sc->names = cons(car(cdr(exp)), sc->names);
+      }
+      if(is_syntax_of(operator, syntax_defmacro) || is_syntax_of(operator, syntax_load) ||
+         (operator != NULL && is_macro(operator)))
+      {
+         sc->dynamic = true;
+      }
+   }
+   for(; is_cell(exp); exp = cdr(exp))
+   {
+      scan_defines(car(exp), sc, base);
+   }
+}
+
+static node *analyze_reference(symbol *s, scope *sc)
+{
+   node *result;
+   int depth = 0;
+
+   for(; sc != NULL; sc = sc->outer, ++depth)
+   {
+      symbol *name = find_name(sc->names, s);
+
+      if(name != NULL)
+      {
+         result = new_node(exec_local, s, 0);
+         result->value = s;
+         result->depth = depth;
+         if(sc->flat)
+         {
+            /* the frame's array holds the bindings of the names */
+            result->exec = exec_captured;
+            result->value = name;
+            result->n = name_index(sc->names, name);
+         }
+         return result;
+      }
+      if(sc->dynamic)
+      {
+         result = new_node(exec_lookup, s, 0);
+         result->value = s;
+         return result;
+      }
+   }
+   result = new_node(exec_free, s, 0);
+   result->value = s;
+   result->depth = depth;
+   return result;
+}
+
+static node *analyze_sequence(list *exps, lispobj *exp, scope *sc, environment *base)
+{
+   node *result = new_node(exec_sequence, exp, list_length(exps));
+   int i;
+
+   for(i = 0; exps != NULL; exps = cdr(exps), ++i)
+   {
+      result->args[i] = analyze(car(exps), sc, base);
+   }
+   return result;
+}
+
+/* (params . body) to (params . code) */
+static list *analyze_body(list *arg_body, scope *outer, environment *base)
+{
+   scope *sc = (scope *)lisp_alloc(CODE, sizeof(scope));
+   lispobj *vars = car(arg_body);
+   list *body = cdr(arg_body);
+   code *c = alloc_object(CODE);
+   list *exps;
+   node *n;
+
+   sc->names = NULL;
+   sc->dynamic = false;
+   sc->flat = false;
+   sc->depth = outer == NULL ? 1 : outer->depth + 1;
+   sc->outer = outer;
+   for(; is_cell(vars); vars = cdr(vars))
+   {
+      sc->names = cons(car(vars), sc->names);
+   }
+   if(vars != NULL && is_symbol(vars))
+   {
+      sc->names = cons(vars, sc->names);
+   }
+   sc->params = sc->names;
+
+   if(body == NULL || !is_list(body))
+   {
+      n = new_node(exec_begin, body, 0);
+   }
+   else
+   {
+      for(exps = body; exps != NULL; exps = cdr(exps))
+      {
+         scan_defines(car(exps), sc, base);
+      }
+      n = analyze_sequence(body, body, sc, base);
+   }
+   set_car(c, n);
+   set_cdr(c, arg_body);
+   return cons(car(arg_body), c);
+}
+
+/* a parameter of the body not defined in it again, as a closure may
+ * keep its binding */
+static bool is_param(scope *sc, symbol *s)
+{
+   list *names;
+
+   for(names = sc->names; names != sc->params; names = cdr(names))
+   {
+      if(generic_equal(car(names), s))
+      {
+         return false;
+      }
+   }
+   return has_name(sc->params, s);
+}
+
+/* adds to *captured the variables of the enclosing bodies exp refers
+ * to; false when one may be defined after the closure is made or exp
+ * may refer to what it does not name */
+static bool find_captured(lispobj *exp, list **captured, scope *sc, environment *base)
+{
+   scope *outer;
+
+   if(exp != NULL && is_symbol(exp))
+   {
+      for(outer = sc; outer != NULL; outer = outer->outer)
+      {
+         symbol *name = find_name(outer->names, exp);
+
+         if(name != NULL)
+         {
+            if(!is_param(outer, exp))
+            {
+               return false;
+            }
+            if(!has_name(*captured, exp))
+            {
+               *captured = cons(name, *captured);
+            }
+            return true;
+         }
+      }
+      return true;
+   }
+   if(!is_cell(exp))
+   {
+      return true;
+   }
+   if(is_symbol(car(exp)))
+   {
+      lispobj *operator = global_value(car(exp), sc, base);
+
+      if(is_syntax_of(operator, syntax_quote))
+      {
+         return true;
+      }
+      if(is_syntax_of(operator, syntax_defmacro) || is_syntax_of(operator, syntax_load) ||
+         (operator != NULL && is_macro(operator)))
+      {
+         return false;
+      }
+   }
+   for(; is_cell(exp); exp = cdr(exp))
+   {
+      if(!find_captured(car(exp), captured, sc, base))
+      {
+         return false;
+      }
+   }
+   return find_captured(exp, captured, sc, base);
+}
+
+/* a lambda in a body is made a flat closure, whose environment is a
+ * frame of the bindings it refers to in front of the one the outermost
+ * body was made in, unless a body it is in is dynamic */
+static node *analyze_closure(lispobj *exp, scope *sc, environment *base)
+{
+   list *captured = NULL;
+   scope *outer;
+   scope *frame;
+   node *result;
+   int i;
+
+   for(outer = sc; outer != NULL; outer = outer->outer)
+   {
+      if(outer->dynamic)
+      {
+         break;
+      }
+   }
+   if(outer != NULL || !find_captured(cdr(cdr(exp)), &captured, sc, base))
+   {
+      result = new_node(exec_lambda, exp, 0);
+      result->value = analyze_body(cdr(exp), sc, base);
+      return result;
+   }
+
+   result = new_node(exec_closure, exp, list_length(captured));
+   result->depth = sc->depth;
+   frame = NULL;
+   if(captured != NULL)
+   {
+      frame = (scope *)lisp_alloc(CODE, sizeof(scope));
+      frame->names = captured;
+      frame->params = captured;
+      frame->dynamic = false;
+      frame->flat = true;
+      frame->depth = 1;
+      frame->outer = NULL;
+   }
+   for(i = 0; captured != NULL; captured = cdr(captured), ++i)
+   {
+      result->args[i] = analyze_reference(car(captured), sc);
+   }
+   result->value = analyze_body(cdr(exp), frame, base);
+   return result;
+}
+
+static bool is_else(lispobj *obj)
+{
+   return obj != NULL && is_symbol(obj) && strcmp(sym_to_string(obj), "else") == 0;
+}
+
+static node *analyze_cond(lispobj *exp, scope *sc, environment *base)
+{
+   list *clauses;
+   node *result;
+   int i;
+
+   for(clauses = cdr(exp); clauses != NULL; clauses = cdr(clauses))
+   {
+      if(!is_cell(car(clauses)) || !is_cell(cdr(car(clauses))))
+      {
+         return NULL;
+      }
+   }
+
+   /* a clause with a constant test is dropped or taken as the else */
+   result = new_node(exec_cond, exp, 2 * list_length(cdr(exp)));
+   result->n = 0;
+   for(clauses = cdr(exp); clauses != NULL; clauses = cdr(clauses))
+   {
+      lispobj *test = car(car(clauses));
+      node *t = is_else(test) ? NULL : analyze(test, sc, base);
+
+      if(t != NULL && t->exec == exec_constant && !is_true(t->value))
+      {
+         continue;
+      }
+      i = result->n;
+      result->args[i] = t != NULL && t->exec == exec_constant ? NULL : t;
+      result->args[i + 1] = analyze(car(cdr(car(clauses))), sc, base);
+      result->n += 2;
+      if(result->args[i] == NULL)
+      {
+         break;
+      }
+   }
+   if(result->n == 2 && result->args[0] == NULL)
+   {
+      return result->args[1];
+   }
+   return result;
+}
+
+/* NULL leaves the syntax to its procedure */
+/*@null@*/
+static node *analyze_syntax(lispobj *exp, syntax *s, scope *sc, environment *base)
+{
+   list *operands = cdr(exp);
+   int length = list_length(operands);
+   node *result = NULL;
+   int i;
+
+   if(is_syntax_of(s, syntax_quote))
+   {
+      result = new_constant(exp, syntax_quote(operands, NULL));
+   }
+   else if(is_syntax_of(s, syntax_if) && (length == 2 || length == 3))
+   {
+      result = new_node(exec_if, exp, length);
+      for(i = 0; i < length; ++i, operands = cdr(operands))
+      {
+         result->args[i] = analyze(car(operands), sc, base);
+      }
+      /* a constant test leaves one branch */
+      if(result->args[0]->exec == exec_constant)
+      {
+         if(is_true(result->args[0]->value))
+         {
+            result = result->args[1];
+         }
+         else
+         {
+            result = length == 3 ? result->args[2] : new_constant(exp, new_boolean(false));
+         }
+      }
+   }
+   else if(is_syntax_of(s, syntax_cond))
+   {
+      result = analyze_cond(exp, sc, base);
+   }
+   else if(is_syntax_of(s, syntax_begin) && length > 0)
+   {
+      result = analyze_sequence(operands, exp, sc, base);
+   }
+   else if(is_syntax_of(s, syntax_define) && length >= 2 && is_symbol(car(operands)))
+   {
+      result = new_node(exec_define, exp, 1);
+      result->value = car(operands);
+      result->args[0] = analyze(car(cdr(operands)), sc, base);
+   }
+   else if(is_syntax_of(s, syntax_set) && length == 2 && is_symbol(car(operands)))
+   {
+      result = new_node(exec_set, exp, 1);
+      result->value = car(operands);
+      result->args[0] = analyze(car(cdr(operands)), sc, base);
+   }
+   else if(is_syntax_of(s, syntax_lambda) && length > 0)
+   {
+      result = analyze_closure(exp, sc, base);
+   }
+   return result;
+}
+
+/* a call of a pure primitive on constants, computed now unless it
+ * raises */
+static node *fold_call(node *call, lispobj *operator, environment *base)
+{
+   eval_limits limits = {0, 0, 0};
+   lispobj *value;
+   node *result;
+   int i;
+
+   if(call->args[0]->exec != exec_free || call->value != operator ||
+      !is_pure_prim(operator))
+   {
+      return call;
+   }
+   for(i = 1; i < call->n; ++i)
+   {
+      if(call->args[i]->exec != exec_constant && call->args[i]->exec != exec_fold)
+      {
+         return call;
+      }
+   }
+   value = eval_limited(call->exp, base, &limits);
+   if(value != NULL && is_error(value))
+   {
+      return call;
+   }
+
+   result = new_node(exec_fold, call->exp, 2);
+   result->value = operator;
+   result->args[0] = call;
+   result->args[1] = new_constant(call->exp, value);
+   return result;
+}
+
+static int param_index(list *params, lispobj *obj)
+{
+   int i;
+
+   for(i = 0; is_cell(params); params = cdr(params), ++i)
+   {
+      if(is_symbol(obj) && equal_symbol(car(params), obj))
+      {
+         return i;
+      }
+   }
+   return -1;
+}
+
+/* whether a body can take the place of a call: constants, parameters,
+ * variables the caller does not shadow, quote, if and calls of
+ * primitives, pure ones when a variable is passed; uses counts the
+ * references to each parameter and size the atoms */
+static bool is_inlinable(lispobj *exp, list *params, int *uses, int *size,
+   bool pure, scope *sc, environment *base)
+{
+   lispobj *operator;
+
+   if(++*size > INLINE_SIZE)
+   {
+      return false;
+   }
+   if(!is_cell(exp))
+   {
+      if(param_index(params, exp) >= 0)
+      {
+         uses[param_index(params, exp)]++;
+      }
+      return !is_symbol(exp) || param_index(params, exp) >= 0 || !is_shadowed(exp, sc);
+   }
+   if(!is_list(exp) || !is_symbol(car(exp)) || param_index(params, car(exp)) >= 0)
+   {
+      return false;
+   }
+   operator = global_value(car(exp), sc, base);
+   if(is_syntax_of(operator, syntax_quote))
+   {
+      return true;
+   }
+   if(!is_syntax_of(operator, syntax_if) &&
+      !(operator != NULL && is_prim_proc(operator) && (!pure || is_pure_prim(operator))))
+   {
+      return false;
+   }
+   for(exp = cdr(exp); exp != NULL; exp = cdr(exp))
+   {
+      if(!is_inlinable(car(exp), params, uses, size, pure, sc, base))
+      {
+         return false;
+      }
+   }
+   return true;
+}
+
+/* exp with the parameters replaced by the operands */
+static lispobj *put_operands(lispobj *exp, list *params, list *operands, scope *sc, environment *base)
+{
+   list *result = NULL;
+   list *tail = NULL;
+   int i;
+
+   if(!is_cell(exp))
+   {
+      i = param_index(params, exp);
+      if(i < 0)
+      {
+         return exp;
+      }
+      for(; i > 0; --i)
+      {
+         operands = cdr(operands);
+      }
+      return car(operands);
+   }
+   if(is_syntax_of(global_value(car(exp), sc, base), syntax_quote))
+   {
+      return exp;
+   }
+   for(; exp != NULL; exp = cdr(exp))
+   {
+      cell *c = cons(put_operands(car(exp), params, operands, sc, base), NULL);
+      if(tail == NULL)
+      {
+         result = c;
+      }
+      else
+      {
+         set_cdr(tail, c);
+      }
+      tail = c;
+   }
+   return result;
+}
+
+/* a call of a small procedure defined at the top level, on constants
+ * and variables, replaced by its body; the body calls no procedure but
+ * primitives, so it does not recur */
+static node *inline_call(node *call, lispobj *operator, scope *sc, environment *base)
+{
+   list *arg_body;
+   list *params;
+   list *operands = cdr(call->exp);
+   int uses[INLINE_SIZE];
+   int size = 0;
+   bool pure = false;
+   node *result;
+   int i;
+
+   if(call->args[0]->exec != exec_free || operator == NULL || !is_lambda(operator) ||
+      cdr(operator) != base || call->n - 1 > INLINE_SIZE)
+   {
+      return call;
+   }
+   arg_body = car(operator);
+   if(is_code(cdr(arg_body)))
+   {
+      arg_body = code_source(cdr(arg_body));
+   }
+   params = car(arg_body);
+   if(!is_list(params) || list_length(params) != call->n - 1 ||
+      !is_cell(cdr(arg_body)) || cdr(cdr(arg_body)) != NULL)
+   {
+      return call;
+   }
+   for(i = 1; i < call->n; ++i)
+   {
+      uses[i - 1] = 0;
+      if(call->args[i]->exec != exec_constant)
+      {
+         if(!is_symbol(call->args[i]->exp))
+         {
+            return call;
+         }
+         pure = true;
+      }
+   }
+   if(!is_inlinable(car(cdr(arg_body)), params, uses, &size, pure, sc, base))
+   {
+      return call;
+   }
+   for(i = 0; i < call->n - 1; ++i)
+   {
+      if(uses[i] == 0)
+      {
+         return call;
+      }
+   }
+
+   result = new_node(exec_inline, call->exp, 2);
+   result->value = operator;
+   result->args[0] = call;
+   result->args[1] = analyze(put_operands(car(cdr(arg_body)), params, operands, sc, base),
+      sc, base);
+   return result;
+}
+
+/* a primitive found to take the arguments is not checked again for
+ * their number when the call runs */
+static node *analyze_call(lispobj *exp, lispobj *operator, scope *sc, environment *base)
+{
+   static node_exec calls[] = {exec_call0, exec_call1, exec_call2, exec_call3};
+   int length = list_length(exp);
+   node *result = new_node(length <= 4 ? calls[length - 1] : exec_call, exp, length);
+   int i;
+
+   if(operator != NULL && is_prim_proc(operator) && prim_takes(operator, length - 1))
+   {
+      result->value = operator;
+   }
+   for(i = 0; exp != NULL; exp = cdr(exp), ++i)
+   {
+      result->args[i] = analyze(car(exp), sc, base);
+   }
+   if(operator != NULL && is_lambda(operator))
+   {
+      return inline_call(result, operator, sc, base);
+   }
+   return fold_call(result, operator, base);
+}
+
+static node *analyze(lispobj *exp, scope *sc, environment *base)
+{
+   lispobj *operator;
+   node *result;
+
+   if(exp == NULL || is_boolean(exp) || is_integer(exp) || is_prim_proc(exp) ||
+      is_lambda(exp) || is_character(exp) || is_string(exp))
+   {
+      return new_constant(exp, exp);
+   }
+   else if(is_symbol(exp))
+   {
+      return analyze_reference(exp, sc);
+   }
+   else if(!is_cell(exp) || !is_list(exp))
+   {
+      return new_node(exec_eval, exp, 0);
+   }
+
+   operator = is_symbol(car(exp)) ? global_value(car(exp), sc, base) : NULL;
+   if(operator != NULL && is_syntax(operator))
+   {
+      result = analyze_syntax(exp, operator, sc, base);
+      if(result == NULL)
+      {
+         result = new_node(exec_syntax, exp, 0);
+         result->value = operator;
+      }
+      return result;
+   }
+   else if(operator != NULL && is_macro(operator))
+   {
+      result = new_node(exec_macro, exp, 1);
+      result->value = operator;
+      result->args[0] = NULL;
+      result->scope = sc;
+      return result;
+   }
+   return analyze_call(exp, operator, sc, base);
+}
+
+list *analyze_lambda(list *arg_body, environment *env)
+{
+   return analyze_body(arg_body, NULL, env);
+}
+
+/*@null@*/
+lispobj *run_code(code *c, environment *env)
+{
+   node *n = car(c);
+   return n->exec(n, env);
+}
+
+/* the alist of a frame; a flat closure's keeps it with an array */
+/*@null@*/
+list *frame_bindings(lispobj *frame)
+{
+   return frame != NULL && is_code(frame) ? car(frame) : frame;
+}
+
+bool is_code(lispobj *obj)
+{
+   return obj->tid == CODE;
+}
+
+/* the (params . body) the code was analyzed from */
+list *code_source(code *c)
+{
+   return cdr(c);
+}
@@ -0,0 +1,61 @@
+#ifndef _ANALYZE_H_
+#define _ANALYZE_H_
+
+#include <stdbool.h>
+#include "lispobj.h"
+
+enum analyze_define
+{
+   INLINE_SIZE = 16     /* atoms in the body of a procedure inlined at its calls */
+};
+
+/*
+ * Lambda bodies are analyzed once into trees of nodes, each executed by
+ * a C function of its own, so running a body again does no syntactic
+ * dispatch: constants, references, if, cond, begin, define, set!,
+ * lambda and calls with up to three arguments have their own nodes.
+ * Other syntax is applied directly, and eval takes what the analysis
+ * does not understand.
+ *
+ * A body is analyzed when its lambda is first applied, which replaces
+ * the source in the lambda by (params . code); lambdas nested in it are
+ * analyzed along with it.  A reference to a parameter or to a variable
+ * defined in an enclosing body skips the frames in between, one to a
+ * free variable skips all of them and keeps the binding it finds until
+ * the variable is defined again, which symbol_version tells; set!
+ * changes the binding itself.  Bodies calling a macro or load are
+ * left to look everything up, as the definitions they make are not
+ * known.  Syntax and macros are taken from the environment the lambda
+ * is first applied in; a macro call is expanded the first time it is
+ * run.  Every node but an operator read from its cache counts as an
+ * eval, for the statistics and the limits.
+ *
+ * Calls of pure primitives on constants are computed during the
+ * analysis, if and cond with constant tests keep the branch taken, and
+ * calls of small procedures defined at the top level are replaced by
+ * their bodies.  Such a call is made as written again once its operator
+ * is bound to something else.
+ *
+ * A lambda in a body keeps a frame of the bindings of the parameters of
+ * the enclosing bodies it refers to, in front of the environment the
+ * outermost body was made in, so it does not hold the frames in
+ * between.  The frame keeps the bindings in an array as well as in its
+ * alist, and the lambda's body reads them by their index; parameters
+ * are still found in their frames by name.  The bindings are shared,
+ * set! on either side is seen by the other.  A lambda referring to a variable
+ * defined in an enclosing body, which may be bound after the lambda is
+ * made, or in a body that is left to look everything up, keeps the
+ * whole environment.
+ */
+typedef lispobj code;
+bool is_code(lispobj *obj);
+/*@null@*/ list *code_source(code *c);
+
+/* returns (params . code) for the (params . body) of a lambda made in
+ * env */
+list *analyze_lambda(list *arg_body, environment *env);
+/*@null@*/ lispobj *run_code(code *c, environment *env);
+/* the (var . val) list of a frame of an environment */
+/*@null@*/ list *frame_bindings(lispobj *frame);
+
+#endif
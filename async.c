@@ -0,0 +1,227 @@
+#define _GNU_SOURCE
+#include "async.h"
+#include "green.h"
+#include "bytevector.h"
+#include "port.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+static int fd_operand(lispobj *obj, char *name)
+{
+   if(!is_integer(obj) || integer_to_long(obj) < 0)
+   {
+      lisp_error("%s error: arg error", name);
+   }
+   return integer_to_int(obj);
+}
+
+static char *path_operand(lispobj *obj, char *name)
+{
+   struct sockaddr_un addr;
+
+   if(!is_string(obj))
+   {
+      lisp_error("%s error: arg error", name);
+   }
+   if(string_length(obj) >= (int)sizeof(addr.sun_path))
+   {
+      lisp_error("%s error: path too long", name);
+   }
+   return string_to_char(obj);
+}
+
+/* descriptors from elsewhere, such as 0, are switched on first use */
+static void set_nonblocking(int fd)
+{
+   int flags = fcntl(fd, F_GETFL);
+
+   if(flags >= 0 && !(flags & O_NONBLOCK))
+   {
+      fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+   }
+}
+
+static lispobj *unix_socket(lispobj *obj, bool listening, char *name)
+{
+   char *path = path_operand(obj, name);
+   struct sockaddr_un addr;
+   int fd;
+   int result;
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strcpy(addr.sun_path, path);
+
+   fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   if(fd < 0)
+   {
+      lisp_error("%s error: %s", name, strerror(errno));
+   }
+   if(listening)
+   {
+      unlink(path);
+      result = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+      if(result == 0)
+      {
+         result = listen(fd, ASYNC_BACKLOG);
+      }
+   }
+   else
+   {
+      /* on a Unix domain socket this does not wait for the peer */
+      result = connect(fd, (struct sockaddr *)&addr, sizeof(addr));
+   }
+   if(result != 0)
+   {
+      int error = errno;
+      close(fd);
+      lisp_error("%s error: %s", name, strerror(error));
+   }
+   set_nonblocking(fd);
+   return new_integer(fd);
+}
+
+
+/* primitive procedures */
+lispobj *prim_async_listen(int argc, lispobj **argv)
+{
+   return unix_socket(argv[0], true, "async-listen");
+}
+
+lispobj *prim_async_connect(int argc, lispobj **argv)
+{
+   return unix_socket(argv[0], false, "async-connect");
+}
+
+lispobj *prim_async_accept(int argc, lispobj **argv)
+{
+   int listener = fd_operand(argv[0], "async-accept");
+   int fd;
+
+   set_nonblocking(listener);
+   while((fd = accept4(listener, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC)) < 0)
+   {
+      if(errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+         wait_fd(listener, EPOLLIN);
+      }
+      else if(errno != EINTR && errno != ECONNABORTED)
+      {
+         lisp_error("async-accept error: %s", strerror(errno));
+      }
+   }
+   return new_integer(fd);
+}
+
+lispobj *prim_async_read(int argc, lispobj **argv)
+{
+   int fd = fd_operand(argv[0], "async-read");
+   long size = ASYNC_READ_SIZE;
+   char *buf;
+   long n;
+
+   if(argc > 1)
+   {
+      if(!is_integer(argv[1]) || integer_to_long(argv[1]) < 1)
+      {
+         lisp_error("async-read error: arg error");
+      }
+      size = integer_to_long(argv[1]);
+   }
+
+   set_nonblocking(fd);
+   buf = (char *)lisp_alloc(STRING, size + 1);
+   while((n = read(fd, buf, size)) < 0)
+   {
+      if(errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+         wait_fd(fd, EPOLLIN | EPOLLRDHUP);
+      }
+      else if(errno != EINTR)
+      {
+         lisp_error("async-read error: %s", strerror(errno));
+      }
+   }
+   if(n == 0)
+   {
+      return eof_object();
+   }
+   buf[n] = '\0';
+   return new_string_length(buf, n);
+}
+
+/*@null@*/
+lispobj *prim_async_write(int argc, lispobj **argv)
+{
+   int fd = fd_operand(argv[0], "async-write");
+   lispobj *data = argv[1];
+   char *p;
+   long length;
+   long done = 0;
+
+   if(is_string(data))
+   {
+      p = string_to_char(data);
+      length = string_length(data);
+   }
+   else if(is_bytevector(data))
+   {
+      p = (char *)bytevector_bytes(data);
+      length = bytevector_length(data);
+   }
+   else
+   {
+      lisp_error("async-write error: not a string or bytevector");
+   }
+
+   set_nonblocking(fd);
+   while(done < length)
+   {
+      long n = write(fd, p + done, length - done);
+      if(n >= 0)
+      {
+         done += n;
+      }
+      else if(errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+         wait_fd(fd, EPOLLOUT);
+      }
+      else if(errno != EINTR)
+      {
+         lisp_error("async-write error: %s", strerror(errno));
+      }
+   }
+   return NULL;
+}
+
+/*@null@*/
+lispobj *prim_close_fd(int argc, lispobj **argv)
+{
+   if(close(fd_operand(argv[0], "close-fd")) != 0)
+   {
+      lisp_error("close-fd error: %s", strerror(errno));
+   }
+   return NULL;
+}
+
+static const prim_spec async_prims[] =
+{
+   {"async-listen", prim_async_listen, 1, 1, {NULL}, false},
+   {"async-connect", prim_async_connect, 1, 1, {NULL}, false},
+   {"async-accept", prim_async_accept, 1, 1, {NULL}, false},
+   {"async-read", prim_async_read, 1, 2, {NULL}, false},
+   {"async-write", prim_async_write, 2, 2, {NULL}, false},
+   {"close-fd", prim_close_fd, 1, 1, {NULL}, false},
+   {NULL}
+};
+
+environment *define_async_procs(environment *env)
+{
+   return define_prims(env, async_prims);
+}
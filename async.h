@@ -0,0 +1,36 @@
+#ifndef _ASYNC_H_
+#define _ASYNC_H_
+
+#include "lispobj.h"
+
+enum async_define
+{
+   ASYNC_READ_SIZE = 64 * 1024,   /* default most bytes per async-read */
+   ASYNC_BACKLOG = 128
+};
+
+/*
+ * Non-blocking I/O on descriptors, given as integers.  When a call
+ * would block, the current green thread waits in the scheduler's event
+ * loop (see wait_fd in green.h) and the others run meanwhile; (sleep
+ * msec) is the timer.  The descriptors these make are non-blocking and
+ * close-on-exec.
+ *
+ *   (async-listen path)       listening Unix domain socket
+ *   (async-connect path)      connected one
+ *   (async-accept fd)         next connection
+ *   (async-read fd [max])     string of what came, or the eof object
+ *   (async-write fd data)     all of a string or bytevector
+ *   (close-fd fd)
+ */
+
+/* primitive procedures */
+lispobj *prim_async_listen(int argc, lispobj **argv);
+lispobj *prim_async_connect(int argc, lispobj **argv);
+lispobj *prim_async_accept(int argc, lispobj **argv);
+lispobj *prim_async_read(int argc, lispobj **argv);
+lispobj *prim_async_write(int argc, lispobj **argv);
+lispobj *prim_close_fd(int argc, lispobj **argv);
+environment *define_async_procs(environment *env);
+
+#endif
@@ -0,0 +1,34 @@
+; closures: counters with captured mutable state, composition and
+; higher order procedures
+(define make-counter
+  (lambda ()
+    (define count 0)
+    (lambda ()
+      (set! count (+ count 1))
+      count)))
+
+(define compose
+  (lambda (f g)
+    (lambda (x) (f (g x)))))
+
+(define add
+  (lambda (n)
+    (lambda (x) (+ x n))))
+
+(define repeat
+  (lambda (n f x)
+    (if (= n 0)
+        x
+        (repeat (- n 1) f (f x)))))
+
+(define run
+  (lambda (n counter)
+    (if (= n 0)
+        (counter)
+        (begin
+          (repeat 20 (compose (add 1) (add n)) 0)
+          (counter)
+          (run (- n 1) counter)))))
+
+(display (run 1000 (make-counter)))
+(newline)
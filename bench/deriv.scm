@@ -0,0 +1,38 @@
+; symbolic differentiation from the gabriel benchmarks: list
+; construction, symbol comparison and mapping
+(define map
+  (lambda (f l)
+    (if (null? l)
+        '()
+        (cons (f (car l)) (map f (cdr l))))))
+
+(define deriv
+  (lambda (a)
+    (cond ((not (pair? a))
+           (if (eq? a 'x) 1 0))
+          ((eq? (car a) '+)
+           (cons '+ (map deriv (cdr a))))
+          ((eq? (car a) '-)
+           (cons '- (map deriv (cdr a))))
+          ((eq? (car a) '*)
+           (list '*
+                 a
+                 (cons '+ (map (lambda (a) (list '/ (deriv a) a)) (cdr a)))))
+          ((eq? (car a) '/)
+           (list '-
+                 (list '/ (deriv (car (cdr a))) (car (cdr (cdr a))))
+                 (list '/
+                       (car (cdr a))
+                       (list '* (car (cdr (cdr a))) (car (cdr (cdr a))) (deriv (car (cdr (cdr a))))))))
+          (else
+           (display "deriv: no derivation")
+           (newline)))))
+
+(define run
+  (lambda (n result)
+    (if (= n 0)
+        result
+        (run (- n 1) (deriv '(+ (* 3 x x) (* a x x) (* b x) 5))))))
+
+(display (run 800 '()))
+(newline)
@@ -0,0 +1,51 @@
+; destructive list operations: in place reversal and splicing with
+; set-car! and set-cdr!
+(define iota
+  (lambda (n tail)
+    (if (= n 0)
+        tail
+        (iota (- n 1) (cons n tail)))))
+
+(define reverse!
+  (lambda (l)
+    (define loop
+      (lambda (l prev)
+        (if (null? l)
+            prev
+            (begin
+              (define next (cdr l))
+              (set-cdr! l prev)
+              (loop next l)))))
+    (loop l '())))
+
+(define last-pair
+  (lambda (l)
+    (if (null? (cdr l)) l (last-pair (cdr l)))))
+
+(define append!
+  (lambda (a b)
+    (set-cdr! (last-pair a) b)
+    a))
+
+(define bump!
+  (lambda (l)
+    (if (null? l)
+        l
+        (begin
+          (set-car! l (+ (car l) 1))
+          (bump! (cdr l))))))
+
+(define sum
+  (lambda (l)
+    (if (null? l) 0 (+ (car l) (sum (cdr l))))))
+
+(define run
+  (lambda (n l)
+    (if (= n 0)
+        l
+        (begin
+          (bump! l)
+          (run (- n 1) (reverse! l))))))
+
+(display (sum (run 25 (append! (iota 250 '()) (iota 250 '())))))
+(newline)
@@ -0,0 +1,9 @@
+; doubly recursive fibonacci: procedure calls and integer arithmetic
+(define fib
+  (lambda (n)
+    (if (< n 2)
+        n
+        (+ (fib (- n 1)) (fib (- n 2))))))
+
+(display (fib 20))
+(newline)
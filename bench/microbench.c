@@ -0,0 +1,306 @@
+
+/*
+ * microbenchmarks of interpreter internals
+ *
+ *   make microbench && ./microbench [name]
+ *
+ * Each case is calibrated so that one sample takes at least
+ * SAMPLE_MIN_NS, run WARMUP_SAMPLES times untimed and then NUM_SAMPLES
+ * times.  The median and p99 of the per operation time are reported.
+ * A name argument runs only the cases whose name contains it.
+ */
+
+#include "lispobj.h"
+#include "green.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+enum microbench_define
+{
+   WARMUP_SAMPLES = 5,
+   NUM_SAMPLES = 101,   /* enough for the p99 to be below the maximum */
+   SAMPLE_MIN_NS = 2000000,
+   NAME_SIZE = 64
+};
+
+typedef struct bench_case
+{
+   char name[NAME_SIZE];
+   void (*run)(void *arg, long reps);
+   void *arg;
+   long bytes;   /* input bytes per operation, 0 if not a throughput case */
+} bench_case;
+
+static volatile long sink;
+
+static long now_ns()
+{
+   struct timespec t;
+   clock_gettime(CLOCK_MONOTONIC, &t);
+   return t.tv_sec * 1000000000L + t.tv_nsec;
+}
+
+static long time_reps(bench_case *c, long reps)
+{
+   long start = now_ns();
+   c->run(c->arg, reps);
+   return now_ns() - start;
+}
+
+static int compare_double(const void *l, const void *r)
+{
+   double a = *(const double *)l;
+   double b = *(const double *)r;
+   return (a > b) - (a < b);
+}
+
+static void run_case(bench_case *c)
+{
+   double samples[NUM_SAMPLES];
+   long reps = 1;
+   double median;
+   double p99;
+   int i;
+
+   while(time_reps(c, reps) < SAMPLE_MIN_NS)
+   {
+      reps *= 2;
+   }
+   for(i = 0; i < WARMUP_SAMPLES; ++i)
+   {
+      time_reps(c, reps);
+   }
+   for(i = 0; i < NUM_SAMPLES; ++i)
+   {
+      samples[i] = (double)time_reps(c, reps) / reps;
+   }
+
+   qsort(samples, NUM_SAMPLES, sizeof(double), compare_double);
+   median = samples[NUM_SAMPLES / 2];
+   p99 = samples[(NUM_SAMPLES * 99 + 99) / 100 - 1];
+
+   printf("%-28s %10.1f %10.1f", c->name, median, p99);
+   if(c->bytes > 0)
+   {
+      printf(" %10.1f MB/s", c->bytes / median * 1000.0);
+   }
+   printf("\n");
+}
+
+
+/* tokenize */
+static char *make_source(int copies)
+{
+   char *unit = "(define fact (lambda (n) (cond ((gequal n 0) 1) "
+      "(else (* n (fact (+ n -1))))))) \"a string\" 'quoted `(a ,b ,@c)\n";
+   int length = strlen(unit);
+   char *s = (char *)malloc(length * copies + 1);
+   int i;
+
+   for(i = 0; i < copies; ++i)
+   {
+      memcpy(s + i * length, unit, length);
+   }
+   s[length * copies] = '\0';
+   return s;
+}
+
+static void run_tokenize(void *arg, long reps)
+{
+   long i;
+   for(i = 0; i < reps; ++i)
+   {
+      list *tokens = tokenize(arg);
+      sink += tokens != NULL;
+      delete_tokens(tokens);
+   }
+}
+
+/* read_tokens */
+static list *nested_tokens(int depth, int width)
+{
+   char *s = (char *)malloc(depth * (4 * width + 4) + 1);
+   char *p = s;
+   int d;
+   int w;
+
+   for(d = 0; d < depth; ++d)
+   {
+      *p++ = '(';
+      for(w = 0; w < width; ++w)
+      {
+         p += sprintf(p, "a%d ", w % 10);
+      }
+   }
+   for(d = 0; d < depth; ++d)
+   {
+      *p++ = ')';
+   }
+   *p = '\0';
+   return expand_readmacro(tokenize(s));
+}
+
+static void run_read_tokens(void *arg, long reps)
+{
+   long i;
+   for(i = 0; i < reps; ++i)
+   {
+      sink += read_tokens(arg) != NULL;
+   }
+}
+
+/* lookup_var_val */
+typedef struct lookup_arg
+{
+   environment *env;
+   symbol *var;
+} lookup_arg;
+
+/* the variable looked up is the oldest binding of the frame, and a
+ * copy of the symbol is used as the reader would produce */
+static lookup_arg *frame_of(int size)
+{
+   lookup_arg *a = (lookup_arg *)malloc(sizeof(lookup_arg));
+   char name[NAME_SIZE];
+   int i;
+
+   a->env = extend_env(NULL, NULL, NULL);
+   for(i = 0; i < size; ++i)
+   {
+      sprintf(name, "variable-%d", i);
+      define_var_val(new_symbol(name), new_integer(i), a->env);
+   }
+   a->var = new_symbol("variable-0");
+   return a;
+}
+
+static void run_lookup(void *arg, long reps)
+{
+   lookup_arg *a = arg;
+   long i;
+   for(i = 0; i < reps; ++i)
+   {
+      sink += lookup_var_val(a->var, a->env) != NULL;
+   }
+}
+
+/* cons */
+static void run_cons(void *arg, long reps)
+{
+   list *l = NULL;
+   long i;
+   for(i = 0; i < reps; ++i)
+   {
+      l = cons(arg, l);
+   }
+   sink += l != NULL;
+}
+
+/* yield, to a task yielding back: two switches */
+static lispobj *yield_forever(int argc, lispobj **argv)
+{
+   for(;;)
+   {
+      yield();
+   }
+   return NULL;
+}
+
+static void run_yield(void *arg, long reps)
+{
+   long i;
+   for(i = 0; i < reps; ++i)
+   {
+      yield();
+   }
+}
+
+/* generic_equal */
+typedef struct equal_arg
+{
+   lispobj *l;
+   lispobj *r;
+} equal_arg;
+
+static lispobj *tree(int depth, int leaf)
+{
+   if(depth == 0)
+   {
+      return new_integer(leaf);
+   }
+   return cons(tree(depth - 1, leaf * 2), tree(depth - 1, leaf * 2 + 1));
+}
+
+static lispobj *long_list(int length)
+{
+   list *l = NULL;
+   int i;
+   for(i = 0; i < length; ++i)
+   {
+      l = cons(new_symbol("element"), l);
+   }
+   return l;
+}
+
+static equal_arg *equal_pair(lispobj *l, lispobj *r)
+{
+   equal_arg *a = (equal_arg *)malloc(sizeof(equal_arg));
+   a->l = l;
+   a->r = r;
+   return a;
+}
+
+static void run_equal(void *arg, long reps)
+{
+   equal_arg *a = arg;
+   long i;
+   for(i = 0; i < reps; ++i)
+   {
+      sink += generic_equal(a->l, a->r);
+   }
+}
+
+
+int main(int argc, char **argv)
+{
+   bench_case cases[32];
+   int frame_sizes[] = {1, 8, 64, 512};
+   int n = 0;
+   int i;
+   char *source = make_source(64);
+
+   cases[n] = (bench_case){"tokenize", run_tokenize, source, strlen(source)};
+   n++;
+   cases[n] = (bench_case){"read_tokens depth 8", run_read_tokens, nested_tokens(8, 4), 0};
+   n++;
+   cases[n] = (bench_case){"read_tokens depth 64", run_read_tokens, nested_tokens(64, 4), 0};
+   n++;
+   for(i = 0; i < sizeof(frame_sizes) / sizeof(int); ++i)
+   {
+      cases[n] = (bench_case){"", run_lookup, frame_of(frame_sizes[i]), 0};
+      sprintf(cases[n].name, "lookup_var_val frame %d", frame_sizes[i]);
+      n++;
+   }
+   cases[n] = (bench_case){"cons", run_cons, new_integer(1), 0};
+   n++;
+   cases[n] = (bench_case){"generic_equal tree depth 10",
+      run_equal, equal_pair(tree(10, 1), tree(10, 1)), 0};
+   n++;
+   cases[n] = (bench_case){"generic_equal list 1000",
+      run_equal, equal_pair(long_list(1000), long_list(1000)), 0};
+   n++;
+   cases[n] = (bench_case){"yield", run_yield, spawn(new_prim_proc(yield_forever)), 0};
+   n++;
+
+   printf("%-28s %10s %10s\n", "case", "median ns", "p99 ns");
+   for(i = 0; i < n; ++i)
+   {
+      if(argc < 2 || strstr(cases[i].name, argv[1]) != NULL)
+      {
+         run_case(&cases[i]);
+      }
+   }
+   return 0;
+}
@@ -0,0 +1,34 @@
+; count the solutions of the 7 queens problem with list backtracking
+(define ok?
+  (lambda (row dist placed)
+    (if (null? placed)
+        #t
+        (if (= (car placed) (+ row dist))
+            #f
+            (if (= (car placed) (- row dist))
+                #f
+                (if (= (car placed) row)
+                    #f
+                    (ok? row (+ dist 1) (cdr placed))))))))
+
+(define try-rows
+  (lambda (row n placed)
+    (if (> row n)
+        0
+        (+ (if (ok? row 1 placed)
+               (queens n (cons row placed))
+               0)
+           (try-rows (+ row 1) n placed)))))
+
+(define length
+  (lambda (l)
+    (if (null? l) 0 (+ 1 (length (cdr l))))))
+
+(define queens
+  (lambda (n placed)
+    (if (= (length placed) n)
+        1
+        (try-rows 1 n placed))))
+
+(display (queens 7 '()))
+(newline)
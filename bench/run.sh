@@ -0,0 +1,49 @@
+#!/bin/sh
+# Run every bench/*.scm several times and write the per run statistics
+# printed by "scheme --stats" to a json file.
+#
+#   BENCH_RUNS  runs per benchmark (default 5)
+#   BENCH_OUT   result file (default bench/results.json)
+#   SCHEME      interpreter (default ./scheme)
+
+SCHEME=${SCHEME:-./scheme}
+RUNS=${BENCH_RUNS:-5}
+OUT=${BENCH_OUT:-bench/results.json}
+DIR=$(dirname "$0")
+TMP=${TMPDIR:-/tmp}/scheme-bench.$$
+
+trap 'rm -f "$TMP" "$TMP.wall"' EXIT
+
+field()
+{
+   sed -n "s/.*\"$1\": \([0-9.]*\).*/\1/p"
+}
+
+{
+   printf '{\n  "runs": %d,\n  "benchmarks": [' "$RUNS"
+   sep=''
+   for f in "$DIR"/*.scm; do
+      name=$(basename "$f" .scm)
+      printf '%s\n    {"name": "%s", "runs": [' "$sep" "$name"
+      : > "$TMP.wall"
+      i=0
+      while [ "$i" -lt "$RUNS" ]; do
+         if ! "$SCHEME" --stats "$f" > /dev/null 2> "$TMP"; then
+            echo "bench: $name failed" >&2
+            cat "$TMP" >&2
+            exit 1
+         fi
+         stats=$(tail -n 1 "$TMP")
+         echo "$stats" | field wall_ms >> "$TMP.wall"
+         [ "$i" -gt 0 ] && printf ','
+         printf '\n      %s' "$stats"
+         i=$((i + 1))
+      done
+      median=$(sort -n "$TMP.wall" | awk '{ v[NR] = $1 } END { print v[int((NR + 1) / 2)] }')
+      printf '\n    ], "median_wall_ms": %s}' "$median"
+      printf '%-10s median %10s ms  rss %6s kB  allocations %s\n' "$name" "$median" \
+         "$(echo "$stats" | field max_rss_kb)" "$(echo "$stats" | field allocations)" >&2
+      sep=','
+   done
+   printf '\n  ]\n}\n'
+} > "$OUT"
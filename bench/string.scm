@@ -0,0 +1,26 @@
+; string building: repeated appends, a string builder and conversions
+(define build
+  (lambda (n s)
+    (if (= n 0)
+        s
+        (build (- n 1) (string-append s (number->string n) " ")))))
+
+(define fill
+  (lambda (n sb)
+    (if (= n 0)
+        sb
+        (begin
+          (string-builder-append! sb "item-" n " ")
+          (fill (- n 1) sb)))))
+
+(define run
+  (lambda (n total)
+    (if (= n 0)
+        total
+        (run (- n 1)
+             (+ total
+                (string-length (build 500 ""))
+                (string-length (string-builder->string (fill 500 (make-string-builder)))))))))
+
+(display (run 40 0))
+(newline)
@@ -0,0 +1,289 @@
+
+#include "bytevector.h"
+#include "interp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+typedef struct bytevector_data
+{
+   unsigned char *bytes;
+   long length;
+   bool readonly;
+   bool mapped;   /* bytes alias the pages of a file */
+} bytevector_data;
+
+static bytevector *wrap_bytes(unsigned char *bytes, long length, bool readonly, bool mapped)
+{
+   bytevector *bv = alloc_object(BYTEVECTOR);
+   bytevector_data *d = (bytevector_data *)lisp_alloc(BYTEVECTOR, sizeof(bytevector_data));
+   d->bytes = bytes;
+   d->length = length;
+   d->readonly = readonly;
+   d->mapped = mapped;
+   set_car(bv, d);
+   set_cdr(bv, NULL);
+   return bv;
+}
+
+/*@null@*/
+bytevector *new_bytevector(long length, unsigned char fill)
+{
+   unsigned char *bytes = (unsigned char *)lisp_alloc(BYTEVECTOR, length > 0 ? length : 1);
+   memset(bytes, fill, length);
+   return wrap_bytes(bytes, length, false, false);
+}
+
+static void unmap_bytevector(lispobj *bv)
+{
+   bytevector_data *d = car(bv);
+   if(d->bytes != NULL)
+   {
+      munmap(d->bytes, d->length);
+   }
+}
+
+/* the mapping is private and read only, so nothing is copied until
+ * a page is touched; it lasts as long as the interpreter */
+/*@null@*/
+bytevector *mmap_bytevector(char *filepath)
+{
+   struct stat st;
+   void *bytes = NULL;
+   bytevector *bv;
+   int fd = open(filepath, O_RDONLY);
+
+   if(fd < 0 || fstat(fd, &st) != 0)
+   {
+      lisp_error("mmap-file error: can not open %s", filepath);
+   }
+
+   if(st.st_size > 0)
+   {
+      bytes = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if(bytes == MAP_FAILED)
+      {
+         lisp_error("mmap-file error: can not map %s", filepath);
+      }
+   }
+   close(fd);
+
+   bv = wrap_bytes(bytes, st.st_size, true, true);
+   add_finalizer(bv, unmap_bytevector);
+   return bv;
+}
+
+bool is_bytevector(lispobj *obj)
+{
+   return obj == NULL ? false : obj->tid == BYTEVECTOR;
+}
+
+long bytevector_length(bytevector *bv)
+{
+   return ((bytevector_data *)car(bv))->length;
+}
+
+unsigned char *bytevector_bytes(bytevector *bv)
+{
+   return ((bytevector_data *)car(bv))->bytes;
+}
+
+bool bytevector_is_readonly(bytevector *bv)
+{
+   return ((bytevector_data *)car(bv))->readonly;
+}
+
+
+/* primitive procedures */
+/* registered in bytevector_prims, which the arguments are checked against */
+/* index of the first of width bytes */
+static long index_operand(bytevector *bv, lispobj *obj, int width, char *name)
+{
+   long k = integer_to_long(obj);
+
+   if(k < 0 || bytevector_length(bv) - width < k)
+   {
+      lisp_error("%s error: index out of range", name);
+   }
+   return k;
+}
+
+/* endianness is 'little (default) or 'big */
+static bool big_endian_operand(int argc, lispobj **argv, char *name)
+{
+   char *e;
+
+   if(argc < 3)
+   {
+      return false;
+   }
+
+   e = is_symbol(argv[2]) ? sym_to_string(argv[2]) : "";
+   if(strcmp(e, "big") == 0)
+   {
+      return true;
+   }
+   else if(strcmp(e, "little") != 0)
+   {
+      lisp_error("%s error: unknown endianness", name);
+   }
+   return false;
+}
+
+lispobj *prim_make_bytevector(int argc, lispobj **argv)
+{
+   long fill = 0;
+
+   if(integer_to_long(argv[0]) < 0)
+   {
+      lisp_error("make-bytevector error: bad length");
+   }
+   if(argc > 1)
+   {
+      fill = is_integer(argv[1]) ? integer_to_long(argv[1]) : -1;
+      if(fill < 0 || 255 < fill)
+      {
+         lisp_error("make-bytevector error: fill is not a byte");
+      }
+   }
+   return new_bytevector(integer_to_long(argv[0]), fill);
+}
+
+lispobj *prim_is_bytevector(int argc, lispobj **argv)
+{
+   return new_boolean(is_bytevector(argv[0]));
+}
+
+lispobj *prim_bytevector_length(int argc, lispobj **argv)
+{
+   return new_integer_long(bytevector_length(argv[0]));
+}
+
+lispobj *prim_bytevector_u8_ref(int argc, lispobj **argv)
+{
+   bytevector *bv;
+   long k;
+
+   bv = argv[0];
+   k = index_operand(bv, argv[1], 1, "bytevector-u8-ref");
+   return new_integer_long(bytevector_bytes(bv)[k]);
+}
+
+lispobj *prim_bytevector_u8_set(int argc, lispobj **argv)
+{
+   bytevector *bv;
+   lispobj *byte;
+   long k;
+
+   bv = argv[0];
+   k = index_operand(bv, argv[1], 1, "bytevector-u8-set!");
+   byte = argv[2];
+   if(bytevector_is_readonly(bv))
+   {
+      lisp_error("bytevector-u8-set! error: bytevector is read only");
+   }
+   if(!is_integer(byte) || integer_to_long(byte) < 0 || 255 < integer_to_long(byte))
+   {
+      lisp_error("bytevector-u8-set! error: not a byte");
+   }
+   bytevector_bytes(bv)[k] = integer_to_long(byte);
+   return byte;
+}
+
+lispobj *prim_bytevector_u16_ref(int argc, lispobj **argv)
+{
+   bytevector *bv;
+   unsigned char *p;
+   long k;
+
+   bv = argv[0];
+   k = index_operand(bv, argv[1], 2, "bytevector-u16-ref");
+   p = bytevector_bytes(bv) + k;
+   if(big_endian_operand(argc, argv, "bytevector-u16-ref"))
+   {
+      return new_integer_long((p[0] << 8) | p[1]);
+   }
+   return new_integer_long(p[0] | (p[1] << 8));
+}
+
+lispobj *prim_bytevector_u32_ref(int argc, lispobj **argv)
+{
+   bytevector *bv;
+   unsigned char *p;
+   uint32_t x;
+   long k;
+
+   bv = argv[0];
+   k = index_operand(bv, argv[1], 4, "bytevector-u32-ref");
+   p = bytevector_bytes(bv) + k;
+   if(big_endian_operand(argc, argv, "bytevector-u32-ref"))
+   {
+      x = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+   }
+   else
+   {
+      x = ((uint32_t)p[3] << 24) | ((uint32_t)p[2] << 16) | ((uint32_t)p[1] << 8) | p[0];
+   }
+   return new_integer_long(x);
+}
+
+lispobj *prim_utf8_to_string(int argc, lispobj **argv)
+{
+   bytevector *bv;
+   long start = 0;
+   long end;
+   char *chars;
+
+   bv = argv[0];
+   end = bytevector_length(bv);
+   if(argc > 1)
+   {
+      start = index_operand(bv, argv[1], 0, "utf8->string");
+   }
+   if(argc > 2)
+   {
+      end = index_operand(bv, argv[2], 0, "utf8->string");
+   }
+   if(end < start)
+   {
+      lisp_error("utf8->string error: index out of range");
+   }
+
+   chars = (char *)lisp_alloc(STRING, end - start + 1);
+   memcpy(chars, bytevector_bytes(bv) + start, end - start);
+   chars[end - start] = '\0';
+   return new_string_length(chars, end - start);
+}
+
+lispobj *prim_mmap_file(int argc, lispobj **argv)
+{
+   return mmap_bytevector(string_to_char(argv[0]));
+}
+
+static const prim_spec bytevector_prims[] =
+{
+   {"make-bytevector", prim_make_bytevector, 1, 2, {is_integer, NULL}, false},
+   {"bytevector?", prim_is_bytevector, 1, 1, {NULL}, true},
+   {"bytevector-length", prim_bytevector_length, 1, 1, {is_bytevector}, false},
+   {"bytevector-u8-ref", prim_bytevector_u8_ref, 2, 2,
+      {is_bytevector, is_integer}, false},
+   {"bytevector-u8-set!", prim_bytevector_u8_set, 3, 3,
+      {is_bytevector, is_integer, NULL}, false},
+   {"bytevector-u16-ref", prim_bytevector_u16_ref, 2, 3,
+      {is_bytevector, is_integer, NULL}, false},
+   {"bytevector-u32-ref", prim_bytevector_u32_ref, 2, 3,
+      {is_bytevector, is_integer, NULL}, false},
+   {"utf8->string", prim_utf8_to_string, 1, 3, {is_bytevector, is_integer, is_integer}, false},
+   {"mmap-file", prim_mmap_file, 1, 1, {is_string}, false},
+   {NULL}
+};
+
+environment *define_bytevector_procs(environment *env)
+{
+   return define_prims(env, bytevector_prims);
+}
@@ -0,0 +1,27 @@
+#ifndef _BYTEVECTOR_H_
+#define _BYTEVECTOR_H_
+
+#include <stdbool.h>
+#include "lispobj.h"
+
+typedef lispobj bytevector;
+bytevector *new_bytevector(long length, unsigned char fill);
+bytevector *mmap_bytevector(char *filepath);
+bool is_bytevector(lispobj *obj);
+long bytevector_length(bytevector *bv);
+unsigned char *bytevector_bytes(bytevector *bv);
+bool bytevector_is_readonly(bytevector *bv);
+
+/* primitive procedures */
+lispobj *prim_make_bytevector(int argc, lispobj **argv);
+lispobj *prim_is_bytevector(int argc, lispobj **argv);
+lispobj *prim_bytevector_length(int argc, lispobj **argv);
+lispobj *prim_bytevector_u8_ref(int argc, lispobj **argv);
+lispobj *prim_bytevector_u8_set(int argc, lispobj **argv);
+lispobj *prim_bytevector_u16_ref(int argc, lispobj **argv);
+lispobj *prim_bytevector_u32_ref(int argc, lispobj **argv);
+lispobj *prim_utf8_to_string(int argc, lispobj **argv);
+lispobj *prim_mmap_file(int argc, lispobj **argv);
+environment *define_bytevector_procs(environment *env);
+
+#endif
@@ -0,0 +1,279 @@
+#include "cont.h"
+#include "interp.h"
+#include "stack.h"
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+#include <alloca.h>
+
+struct escape_frame
+{
+   jmp_buf jump;
+   continuation *k;
+   /*@null@*/ lispobj *value;   /* passed to k */
+   /*@null@*/ escape_frame *outer;
+   char *bottom;                   /* which stack, see bottom_stack_base */
+   /*@null@*/ stack_segment *segments;
+
+   /* the interpreter at the call */
+   struct eval_guard *guard;
+   int eval_depth;
+   int shadow_depth;
+   long fuel_limit;
+   int depth_limit;
+   long heap_limit;
+};
+
+typedef struct cont_data
+{
+   /*@null@*/ escape_frame *frame;   /* NULL while the frame is off the stack */
+   escape_frame *home;               /* where the frame is when on the stack */
+   char *bottom;
+
+   /* call/cc only: the stack from low up to the base of the segment */
+   /*@null@*/ char *copy;
+   char *low;
+   size_t size;
+   char *base;
+   /*@null@*/ stack_segment *segment;
+   unsigned long serial;
+} cont_data;
+
+bool is_continuation(lispobj *obj)
+{
+   return obj == NULL ? false : obj->tid == CONTINUATION;
+}
+
+
+/* stack base */
+/*
+ * The callers of the outermost run_limited keep some of their variables
+ * in callee-saved registers.  __builtin_unwind_init makes this frame
+ * save all of them, above the base, so a segment copied back below it
+ * brings back the registers of the evaluation it was captured in and
+ * this frame returns the current ones to the current callers.
+ */
+static __attribute__((noinline))
+lispobj *eval_above_base(lispobj *(*evaluate)(lispobj *, environment *),
+   lispobj *exp, environment *env)
+{
+   /* this frame's return address is the last word of a segment */
+   current_interp()->stack_base = (char *)__builtin_frame_address(0) + 2 * sizeof(void *);
+   return evaluate(exp, env);
+}
+
+lispobj *eval_at_stack_base(lispobj *(*evaluate)(lispobj *, environment *),
+   lispobj *exp, environment *env)
+{
+   lispobj *result;
+
+   __builtin_unwind_init();
+   result = eval_above_base(evaluate, exp, env);
+   /* not a tail call */
+   __asm__ __volatile__("" ::: "memory");
+   return result;
+}
+
+/* the frames above to are off the stack */
+void unwind_escapes(escape_frame *to)
+{
+   interp *it = current_interp();
+   escape_frame *e;
+
+   for(e = it->escapes; e != NULL && e != to; e = e->outer)
+   {
+      cont_data *c = car(e->k);
+      if(c->frame == e)
+      {
+         c->frame = NULL;
+      }
+   }
+   it->escapes = to;
+}
+
+static void enter_frame(escape_frame *e, lispobj *value)
+{
+   interp *it = current_interp();
+
+   unwind_segments(e->segments);
+   it->escapes = e;
+   it->guard = e->guard;
+   it->stats.eval_depth = e->eval_depth;
+   profile_unwind(e->shadow_depth);
+   it->fuel_limit = e->fuel_limit;
+   it->depth_limit = e->depth_limit;
+   it->heap_limit = e->heap_limit;
+   e->value = value;
+   longjmp(e->jump, 1);
+}
+
+
+/* capture and resume */
+static __attribute__((noinline)) void copy_stack(cont_data *c)
+{
+   /* from here up, which takes in the frame of the call */
+   char *low = (char *)__builtin_frame_address(0);
+
+   c->low = low;
+   c->size = c->base - low;
+   c->copy = (char *)lisp_alloc(CONTINUATION, c->size);
+   memcpy(c->copy, low, c->size);
+}
+
+/* runs below the segment: copies it back over the frames there and
+ * jumps into it */
+static __attribute__((noinline)) void copy_back(cont_data *c, lispobj *value)
+{
+   escape_frame *e;
+
+   memcpy(c->low, c->copy, c->size);
+   for(e = c->home; e != NULL; e = e->outer)
+   {
+      cont_data *outer = car(e->k);
+      outer->frame = e;
+   }
+   enter_frame(c->home, value);
+}
+
+static void rewind_stack(cont_data *c, lispobj *value)
+{
+   char *here = (char *)__builtin_frame_address(0);
+   volatile char *room = NULL;
+
+   if(here + CONT_REWIND_MARGIN > c->low)
+   {
+      room = alloca(here + CONT_REWIND_MARGIN - c->low);
+      room[0] = 0;
+   }
+   copy_back(c, value);
+}
+
+static void throw_continuation(continuation *k, lispobj *value)
+{
+   cont_data *c = car(k);
+   char *bottom = bottom_stack_base();
+
+   if(c->frame != NULL && c->frame->bottom == bottom)
+   {
+      unwind_escapes(c->frame);
+      enter_frame(c->frame, value);
+   }
+   else if(c->copy == NULL)
+   {
+      lisp_error("continuation error: call/ec has returned");
+   }
+   else if(c->bottom != bottom)
+   {
+      lisp_error("continuation error: captured on another stack");
+   }
+   else if(!on_segment(c->segment, c->serial))
+   {
+      lisp_error("continuation error: captured on a stack segment since left");
+   }
+   unwind_escapes(NULL);
+   if(current_interp()->segments == c->segment)
+   {
+      rewind_stack(c, value);
+   }
+   /* from a segment above the one of the copy */
+   copy_back(c, value);
+}
+
+void apply_continuation(continuation *k, list *args)
+{
+   if(args != NULL && cdr(args) != NULL)
+   {
+      lisp_error("continuation error: arg error");
+   }
+   throw_continuation(k, args == NULL ? NULL : car(args));
+}
+
+/*@null@*/
+static lispobj *call_with_continuation(int argc, lispobj **argv, bool full, char *name)
+{
+   interp *it = current_interp();
+   escape_frame frame;
+   continuation *k;
+   cont_data *c;
+   lispobj *result;
+
+   if(full && it->stack_base == NULL)
+   {
+      lisp_error("%s error: not in an evaluation", name);
+   }
+
+   k = alloc_object(CONTINUATION);
+   c = (cont_data *)lisp_alloc(CONTINUATION, sizeof(cont_data));
+   memset(c, 0, sizeof(cont_data));
+   set_car(k, c);
+   set_cdr(k, NULL);
+
+   frame.k = k;
+   frame.value = NULL;
+   frame.outer = it->escapes;
+   frame.bottom = bottom_stack_base();
+   frame.segments = it->segments;
+   frame.guard = it->guard;
+   frame.eval_depth = it->stats.eval_depth;
+   frame.shadow_depth = profile_depth();
+   frame.fuel_limit = it->fuel_limit;
+   frame.depth_limit = it->depth_limit;
+   frame.heap_limit = it->heap_limit;
+   c->frame = &frame;
+   c->home = &frame;
+   c->bottom = frame.bottom;
+   c->base = it->stack_base;
+   c->segment = it->segments;
+   c->serial = segment_serial(it->segments);
+   it->escapes = &frame;
+
+   if(setjmp(frame.jump) == 0)
+   {
+      if(full)
+      {
+         copy_stack(c);
+      }
+      result = apply_procedure(argv[0], cons(k, NULL));
+   }
+   else
+   {
+      result = frame.value;
+   }
+
+   it->escapes = frame.outer;
+   c->frame = NULL;
+   return result;
+}
+
+
+/* primitive procedures */
+/*@null@*/
+lispobj *prim_call_cc(int argc, lispobj **argv)
+{
+   return call_with_continuation(argc, argv, true, "call/cc");
+}
+
+/*@null@*/
+lispobj *prim_call_ec(int argc, lispobj **argv)
+{
+   return call_with_continuation(argc, argv, false, "call/ec");
+}
+
+lispobj *prim_is_continuation(int argc, lispobj **argv)
+{
+   return new_boolean(is_continuation(argv[0]));
+}
+
+static const prim_spec cont_prims[] =
+{
+   {"call/cc", prim_call_cc, 1, 1, {NULL}, false},
+   {"call-with-current-continuation", prim_call_cc, 1, 1, {NULL}, false},
+   {"call/ec", prim_call_ec, 1, 1, {NULL}, false},
+   {"continuation?", prim_is_continuation, 1, 1, {NULL}, true},
+   {NULL}
+};
+
+environment *define_cont_procs(environment *env)
+{
+   return define_prims(env, cont_prims);
+}
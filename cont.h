@@ -0,0 +1,55 @@
+#ifndef _CONT_H_
+#define _CONT_H_
+
+#include <stdbool.h>
+#include "lispobj.h"
+
+enum cont_define
+{
+   CONT_REWIND_MARGIN = 1024   /* between a segment copied back and the copying frame */
+};
+
+/*
+ * First-class continuations on the recursive evaluator.
+ *
+ * (call/cc proc) and (call-with-current-continuation proc) call proc
+ * with a continuation k; (call/ec proc) does too, but its k is only
+ * good while the call/ec call has not returned.
+ *
+ * Either call sets up an escape frame on the C stack, a jmp_buf with
+ * the state of the interpreter, linked from the interpreter.  While the
+ * frame is on the stack, (k v) jumps straight to it: an early exit
+ * takes the same time from any depth, and the frames in between are
+ * dropped without being returned through.  This is the whole of
+ * call/ec, which copies nothing.
+ *
+ * call/cc also copies the C stack between its frame and the base of
+ * the evaluation, which is set by the outermost run_limited, so at the
+ * start of a toplevel form or of a green thread, or by the stack
+ * segment the evaluation has moved to (see stack.h); the copy is
+ * proportional to the depth at the capture.  After call/cc has
+ * returned, (k v) writes the copy back and jumps into it, which resumes
+ * the evaluation where it was captured; the part of the stack above the
+ * base is that of the current evaluation, so at toplevel a resumed form
+ * returns to the form being evaluated now.  A copy goes back only to
+ * the same place on the same stack: k is not resumed from another green
+ * thread or from an evaluation whose base is elsewhere, and k captured
+ * on a stack segment only while the evaluation has not left it.
+ */
+typedef lispobj continuation;
+typedef struct escape_frame escape_frame;
+bool is_continuation(lispobj *obj);
+void apply_continuation(continuation *k, list *args);
+
+/* for run_limited */
+lispobj *eval_at_stack_base(lispobj *(*evaluate)(lispobj *, environment *),
+   lispobj *exp, environment *env);
+void unwind_escapes(escape_frame *to);
+
+/* primitive procedures */
+lispobj *prim_call_cc(int argc, lispobj **argv);
+lispobj *prim_call_ec(int argc, lispobj **argv);
+lispobj *prim_is_continuation(int argc, lispobj **argv);
+environment *define_cont_procs(environment *env);
+
+#endif
@@ -0,0 +1,611 @@
+#include "green.h"
+#include "interp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+typedef struct task_data
+{
+   /* in the run queue, among the sleepers or the joiners of a task */
+   struct task_data *next;
+   lispobj *thunk;
+   /*@null@*/ lispobj *result;
+   bool done;
+   /*@null@*/ char *stack;     /* NULL for the root task */
+   long wake;                  /* usec, while sleeping */
+   struct task_data *joiners;
+
+   /* while suspended */
+#if defined(__x86_64__)
+   void *sp;
+#else
+   ucontext_t context;
+#endif
+   struct eval_guard *guard;
+   struct escape_frame *escapes;
+   char *stack_base;
+   struct stack_segment *segments;
+   int eval_depth;
+   int shadow_depth;
+   long fuel_limit;
+   int depth_limit;
+   long heap_limit;
+   char *stack_limit;
+} task_data;
+
+typedef struct scheduler
+{
+   task_data *current;
+   task_data *root;
+   task_data *head;           /* run queue */
+   task_data *tail;
+   task_data *sleepers;       /* by wake time */
+   /*@null@*/ task_data *dead;   /* finished, still on its stack */
+   char *stacks[GREEN_STACK_CACHE];
+   int num_of_stacks;
+
+   /* event loop, opened on first use */
+   bool events_open;
+   int epfd;
+   int timerfd;
+   long armed;                /* wake time the timer is set to, 0 if none */
+   int io_waiting;
+   unsigned int switches;
+} scheduler;
+
+
+/* context switch */
+#if defined(__x86_64__)
+/* pushes the callee-saved registers, saves the stack pointer in *save,
+ * takes sp and pops the registers saved there */
+void green_switch(void **save, void *sp);
+__asm__(
+   ".text\n"
+   ".globl green_switch\n"
+   ".type green_switch, @function\n"
+   "green_switch:\n"
+   "   pushq %rbp\n"
+   "   pushq %rbx\n"
+   "   pushq %r12\n"
+   "   pushq %r13\n"
+   "   pushq %r14\n"
+   "   pushq %r15\n"
+   "   movq %rsp, (%rdi)\n"
+   "   movq %rsi, %rsp\n"
+   "   popq %r15\n"
+   "   popq %r14\n"
+   "   popq %r13\n"
+   "   popq %r12\n"
+   "   popq %rbx\n"
+   "   popq %rbp\n"
+   "   ret\n"
+   ".size green_switch, .-green_switch\n");
+#endif
+
+static void task_entry();
+
+static void init_context(task_data *t)
+{
+#if defined(__x86_64__)
+   void **sp = (void **)(t->stack + GREEN_STACK_SIZE);
+
+   /* as if green_switch had been called from task_entry's caller */
+   *--sp = NULL;
+   *--sp = (void *)task_entry;
+   sp -= 6;
+   memset(sp, 0, 6 * sizeof(void *));
+   t->sp = sp;
+#else
+   getcontext(&t->context);
+   t->context.uc_stack.ss_sp = t->stack;
+   t->context.uc_stack.ss_size = GREEN_STACK_SIZE;
+   t->context.uc_link = NULL;
+   makecontext(&t->context, task_entry, 0);
+#endif
+}
+
+
+/* stacks */
+static char *new_stack(scheduler *s)
+{
+   char *stack;
+
+   if(s->num_of_stacks > 0)
+   {
+      return s->stacks[--s->num_of_stacks];
+   }
+   stack = mmap(NULL, GREEN_STACK_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+   if(stack == MAP_FAILED)
+   {
+      lisp_error("spawn error: %s", strerror(errno));
+   }
+   /* a guard page below */
+   mprotect(stack, sysconf(_SC_PAGESIZE), PROT_NONE);
+   return stack;
+}
+
+static void release_stack(scheduler *s, char *stack)
+{
+   if(s->num_of_stacks < GREEN_STACK_CACHE)
+   {
+      s->stacks[s->num_of_stacks++] = stack;
+   }
+   else
+   {
+      munmap(stack, GREEN_STACK_SIZE);
+   }
+}
+
+/* a finished task's stack is let go of once off it */
+static void reap(scheduler *s)
+{
+   if(s->dead != NULL && s->dead != s->current)
+   {
+      release_stack(s, s->dead->stack);
+      s->dead->stack = NULL;
+      s->dead = NULL;
+   }
+}
+
+
+/* scheduler */
+static void finalize_scheduler(lispobj *root)
+{
+   scheduler *s = cdr(root);
+   int i;
+
+   for(i = 0; i < s->num_of_stacks; ++i)
+   {
+      munmap(s->stacks[i], GREEN_STACK_SIZE);
+   }
+   if(s->events_open)
+   {
+      close(s->epfd);
+      close(s->timerfd);
+   }
+   if(current_interp()->scheduler == s)
+   {
+      current_interp()->scheduler = NULL;
+   }
+   free(s);
+}
+
+static scheduler *get_scheduler()
+{
+   interp *it = current_interp();
+   task *root;
+   scheduler *s;
+
+   if(it->scheduler != NULL)
+   {
+      return it->scheduler;
+   }
+   root = alloc_object(TASK);
+   set_car(root, lisp_alloc(TASK, sizeof(task_data)));
+   memset(car(root), 0, sizeof(task_data));
+   s = (scheduler *)calloc(1, sizeof(scheduler));
+   if(s == NULL)
+   {
+      fprintf(stderr, "spawn error: out of memory\n");
+      abort();
+   }
+   s->root = car(root);
+   s->current = s->root;
+   /* runs after the finalizers of the tasks, which come later */
+   set_cdr(root, s);
+   add_finalizer(root, finalize_scheduler);
+   it->scheduler = s;
+   return s;
+}
+
+static long now_usec()
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+static void enqueue(scheduler *s, task_data *t)
+{
+   t->next = NULL;
+   if(s->tail == NULL)
+   {
+      s->head = t;
+   }
+   else
+   {
+      s->tail->next = t;
+   }
+   s->tail = t;
+}
+
+static task_data *dequeue(scheduler *s)
+{
+   task_data *t = s->head;
+
+   s->head = t->next;
+   if(s->head == NULL)
+   {
+      s->tail = NULL;
+   }
+   return t;
+}
+
+static void wake_sleepers(scheduler *s)
+{
+   long now;
+
+   if(s->sleepers == NULL)
+   {
+      return;
+   }
+   now = now_usec();
+   while(s->sleepers != NULL && s->sleepers->wake <= now)
+   {
+      task_data *t = s->sleepers;
+      s->sleepers = t->next;
+      enqueue(s, t);
+   }
+}
+
+/* event loop */
+static void open_events(scheduler *s)
+{
+   struct epoll_event ev;
+
+   if(s->events_open)
+   {
+      return;
+   }
+   s->epfd = epoll_create1(EPOLL_CLOEXEC);
+   s->timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+   if(s->epfd < 0 || s->timerfd < 0)
+   {
+      lisp_error("event loop error: %s", strerror(errno));
+   }
+   ev.events = EPOLLIN;
+   ev.data.ptr = NULL;   /* the timer */
+   epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->timerfd, &ev);
+   s->events_open = true;
+}
+
+static void arm_timer(scheduler *s, long wake)
+{
+   struct itimerspec its;
+
+   if(s->armed == wake)
+   {
+      return;
+   }
+   memset(&its, 0, sizeof(its));
+   its.it_value.tv_sec = wake / 1000000;
+   its.it_value.tv_nsec = wake % 1000000 * 1000;
+   timerfd_settime(s->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+   s->armed = wake;
+}
+
+/* makes the tasks whose descriptors are ready runnable; blocking, it
+ * waits for one of them or the first sleeper */
+static void poll_events(scheduler *s, bool block)
+{
+   struct epoll_event events[GREEN_MAX_EVENTS];
+   int n;
+   int i;
+
+   open_events(s);
+   if(block && s->sleepers != NULL)
+   {
+      arm_timer(s, s->sleepers->wake);
+   }
+   n = epoll_wait(s->epfd, events, GREEN_MAX_EVENTS, block ? -1 : 0);
+   for(i = 0; i < n; ++i)
+   {
+      if(events[i].data.ptr == NULL)
+      {
+         unsigned long expirations;
+         if(read(s->timerfd, &expirations, sizeof(expirations)) > 0)
+         {
+            s->armed = 0;
+         }
+      }
+      else
+      {
+         enqueue(s, events[i].data.ptr);
+      }
+   }
+}
+
+/* waits while only sleepers and descriptors are left; NULL if none */
+/*@null@*/
+static task_data *next_task(scheduler *s)
+{
+   for(;;)
+   {
+      wake_sleepers(s);
+      if(s->head != NULL)
+      {
+         if(s->io_waiting > 0 && ++s->switches % GREEN_POLL_INTERVAL == 0)
+         {
+            poll_events(s, false);
+         }
+         return dequeue(s);
+      }
+      if(s->sleepers == NULL && s->io_waiting == 0)
+      {
+         return NULL;
+      }
+      poll_events(s, true);
+   }
+}
+
+/* the evaluation state of the interpreter goes with the task */
+static void switch_to(scheduler *s, task_data *next)
+{
+   interp *it = current_interp();
+   task_data *prev = s->current;
+
+   if(next == prev)
+   {
+      return;
+   }
+   prev->guard = it->guard;
+   prev->escapes = it->escapes;
+   prev->stack_base = it->stack_base;
+   prev->segments = it->segments;
+   prev->eval_depth = it->stats.eval_depth;
+   prev->shadow_depth = it->shadow_depth;
+   prev->fuel_limit = it->fuel_limit;
+   prev->depth_limit = it->depth_limit;
+   prev->heap_limit = it->heap_limit;
+   prev->stack_limit = set_stack_limit(next->stack_limit);
+
+   it->guard = next->guard;
+   it->escapes = next->escapes;
+   it->stack_base = next->stack_base;
+   it->segments = next->segments;
+   it->stats.eval_depth = next->eval_depth;
+   it->shadow_depth = next->shadow_depth;
+   it->fuel_limit = next->fuel_limit;
+   it->depth_limit = next->depth_limit;
+   it->heap_limit = next->heap_limit;
+   s->current = next;
+
+#if defined(__x86_64__)
+   green_switch(&prev->sp, next->sp);
+#else
+   swapcontext(&prev->context, &next->context);
+#endif
+   reap(s);
+}
+
+static lispobj *run_thunk(lispobj *thunk, environment *env)
+{
+   return apply_procedure(thunk, NULL);
+}
+
+static void task_entry()
+{
+   scheduler *s = current_interp()->scheduler;
+   task_data *t = s->current;
+   eval_limits no_limits = {0, 0, 0};
+   task_data *next;
+
+   reap(s);
+   t->result = run_limited(run_thunk, t->thunk, NULL, &no_limits);
+
+   t->done = true;
+   while(t->joiners != NULL)
+   {
+      task_data *j = t->joiners;
+      t->joiners = j->next;
+      enqueue(s, j);
+   }
+   s->dead = t;
+   next = next_task(s);
+   /* with nothing left to run, the root finds out in join */
+   switch_to(s, next != NULL ? next : s->root);
+   abort();
+}
+
+
+/* tasks */
+static void finalize_task(lispobj *obj)
+{
+   task_data *t = car(obj);
+
+   if(t->stack != NULL)
+   {
+      munmap(t->stack, GREEN_STACK_SIZE);
+   }
+}
+
+task *spawn(lispobj *thunk)
+{
+   scheduler *s = get_scheduler();
+   interp *it = current_interp();
+   task *obj = alloc_object(TASK);
+   task_data *t = (task_data *)lisp_alloc(TASK, sizeof(task_data));
+
+   memset(t, 0, sizeof(task_data));
+   t->thunk = thunk;
+   t->fuel_limit = it->fuel_limit;
+   t->depth_limit = it->depth_limit == INT_MAX ?
+      INT_MAX : it->depth_limit - it->stats.eval_depth;
+   t->heap_limit = it->heap_limit;
+   t->shadow_depth = it->shadow_depth;
+   t->stack = new_stack(s);
+   t->stack_limit = t->stack + STACK_MARGIN;
+   init_context(t);
+   set_car(obj, t);
+   add_finalizer(obj, finalize_task);
+   enqueue(s, t);
+   return obj;
+}
+
+bool is_task(lispobj *obj)
+{
+   return obj == NULL ? false : obj->tid == TASK;
+}
+
+void yield()
+{
+   scheduler *s = current_interp()->scheduler;
+
+   if(s == NULL)
+   {
+      return;
+   }
+   enqueue(s, s->current);
+   switch_to(s, next_task(s));
+}
+
+void sleep_msec(long msec)
+{
+   scheduler *s = get_scheduler();
+   task_data *t = s->current;
+   task_data **p;
+
+   t->wake = now_usec() + msec * 1000;
+   for(p = &s->sleepers; *p != NULL && (*p)->wake <= t->wake; p = &(*p)->next);
+   t->next = *p;
+   *p = t;
+   switch_to(s, next_task(s));
+}
+
+void wait_fd(int fd, unsigned int events)
+{
+   scheduler *s = get_scheduler();
+   struct epoll_event ev;
+
+   open_events(s);
+   ev.events = events | EPOLLONESHOT;
+   ev.data.ptr = s->current;
+   /* a descriptor waited on before is still in the set, disabled */
+   if(epoll_ctl(s->epfd, EPOLL_CTL_MOD, fd, &ev) != 0 &&
+      (errno != ENOENT || epoll_ctl(s->epfd, EPOLL_CTL_ADD, fd, &ev) != 0))
+   {
+      lisp_error("wait error: %s", strerror(errno));
+   }
+   s->io_waiting++;
+   switch_to(s, next_task(s));
+   s->io_waiting--;
+}
+
+static void remove_joiner(task_data *t, task_data *joiner)
+{
+   task_data **p;
+
+   for(p = &t->joiners; *p != NULL; p = &(*p)->next)
+   {
+      if(*p == joiner)
+      {
+         *p = joiner->next;
+         return;
+      }
+   }
+}
+
+/*@null@*/
+lispobj *join(task *obj)
+{
+   task_data *t = car(obj);
+   scheduler *s;
+
+   if(!t->done)
+   {
+      task_data *next;
+
+      s = get_scheduler();
+      if(t == s->current)
+      {
+         lisp_error("join error: a task can not join itself");
+      }
+      s->current->next = t->joiners;
+      t->joiners = s->current;
+      next = next_task(s);
+      if(next != NULL)
+      {
+         switch_to(s, next);
+      }
+      if(!t->done)
+      {
+         remove_joiner(t, s->current);
+         lisp_error("join error: deadlock");
+      }
+   }
+   if(is_error(t->result))
+   {
+      lisp_raise(error_message(t->result));
+   }
+   return t->result;
+}
+
+
+/* primitive procedures */
+lispobj *prim_spawn(int argc, lispobj **argv)
+{
+   if(!(is_lambda(argv[0]) || is_prim_proc(argv[0])))
+   {
+      lisp_error("spawn error: arg error");
+   }
+   return spawn(argv[0]);
+}
+
+/*@null@*/
+lispobj *prim_yield(int argc, lispobj **argv)
+{
+   yield();
+   return NULL;
+}
+
+/*@null@*/
+lispobj *prim_sleep(int argc, lispobj **argv)
+{
+   if(!is_integer(argv[0]) || integer_to_long(argv[0]) < 0)
+   {
+      lisp_error("sleep error: arg error");
+   }
+   sleep_msec(integer_to_long(argv[0]));
+   return NULL;
+}
+
+/*@null@*/
+lispobj *prim_join(int argc, lispobj **argv)
+{
+   if(!is_task(argv[0]))
+   {
+      lisp_error("join error: arg error");
+   }
+   return join(argv[0]);
+}
+
+lispobj *prim_is_task(int argc, lispobj **argv)
+{
+   return new_boolean(is_task(argv[0]));
+}
+
+static const prim_spec green_prims[] =
+{
+   {"spawn", prim_spawn, 1, 1, {NULL}, false},
+   {"yield", prim_yield, 0, 0, {NULL}, false},
+   {"sleep", prim_sleep, 1, 1, {NULL}, false},
+   {"join", prim_join, 1, 1, {NULL}, false},
+   {"task?", prim_is_task, 1, 1, {NULL}, true},
+   {NULL}
+};
+
+environment *define_green_procs(environment *env)
+{
+   return define_prims(env, green_prims);
+}
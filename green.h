@@ -0,0 +1,52 @@
+#ifndef _GREEN_H_
+#define _GREEN_H_
+
+#include <stdbool.h>
+#include "lispobj.h"
+
+enum green_define
+{
+   GREEN_STACK_SIZE = 1 << 20,       /* reserved; pages are committed on use */
+   GREEN_STACK_MARGIN = 64 * 1024,   /* refused to evaluation, see check_limits */
+   GREEN_STACK_CACHE = 64,           /* stacks of finished tasks kept for reuse */
+   GREEN_MAX_EVENTS = 64,            /* per epoll_wait */
+   GREEN_POLL_INTERVAL = 64          /* switches between polls while busy */
+};
+
+/*
+ * Green threads: tasks multiplexed on the thread of their interpreter.
+ *
+ * Every task runs on a C stack of its own, so the recursive evaluator
+ * is suspended simply by switching stacks, which saves and restores
+ * the callee-saved registers and nothing else.  Switches happen only
+ * in yield, sleep and join, and when a task finishes; a task that never
+ * calls them keeps the thread.  The scheduler runs the tasks in a FIFO
+ * run queue.  When none is runnable it waits in epoll for the
+ * descriptors tasks are waiting on and for a timerfd set to the wake
+ * time of the first sleeper; while busy it polls every
+ * GREEN_POLL_INTERVAL switches.  The thread that evaluates the program
+ * is a task too, the root one.
+ *
+ * A task's errors end the task and are raised again by join.  Tasks
+ * still unfinished when the program ends are dropped.
+ */
+typedef lispobj task;
+task *spawn(lispobj *thunk);
+bool is_task(lispobj *obj);
+void yield();
+void sleep_msec(long msec);
+
+/* suspends the current task until fd is ready for the epoll events;
+ * one task at a time may wait on a descriptor */
+void wait_fd(int fd, unsigned int events);
+/*@null@*/ lispobj *join(task *t);
+
+/* primitive procedures */
+lispobj *prim_spawn(int argc, lispobj **argv);
+lispobj *prim_yield(int argc, lispobj **argv);
+lispobj *prim_sleep(int argc, lispobj **argv);
+lispobj *prim_join(int argc, lispobj **argv);
+lispobj *prim_is_task(int argc, lispobj **argv);
+environment *define_green_procs(environment *env);
+
+#endif
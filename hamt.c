@@ -0,0 +1,616 @@
+
+#include "hamt.h"
+#include "hashtable.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Every node keeps its entries and its children in two arrays indexed
+ * by popcount of a bitmap (datamap/nodemap).  A node left with a single
+ * entry after a delete is folded into its parent, so a map has the same
+ * shape whatever order its keys were inserted in, and walking the trie
+ * in hash-fragment order gives a deterministic iteration order.
+ *
+ * Below HAMT_HASH_BITS the hash is exhausted and a node simply holds
+ * the colliding entries in insertion order.
+ */
+
+enum hamt_define
+{
+   HAMT_BITS = 5,
+   HAMT_MASK = 31,
+   HAMT_HASH_BITS = 32
+};
+
+typedef struct hamt_entry
+{
+   lispobj *key;
+   lispobj *val;
+   unsigned int hash;
+} hamt_entry;
+
+typedef struct hamt_node
+{
+   unsigned int datamap;
+   unsigned int nodemap;
+   int ndata;
+   int nnodes;
+   hamt_entry *data;
+   struct hamt_node **nodes;
+   void *edit;    /* owning transient, nodes of other owners are shared */
+} hamt_node;
+
+typedef struct hamt_root
+{
+   hamt_node *root;
+   int count;
+   void *edit;    /* NULL for a persistent map */
+} hamt_root;
+
+
+static unsigned int frag(unsigned int hash, int shift)
+{
+   return (hash >> shift) & HAMT_MASK;
+}
+
+static int index_of(unsigned int map, unsigned int bit)
+{
+   return __builtin_popcount(map & (bit - 1));
+}
+
+/* arrays live on the heap too; growing one copies it */
+static void *copy_array(void *p, size_t used, size_t size)
+{
+   void *q = lisp_alloc(HAMT, size > 0 ? size : 1);
+   if(used > 0)
+   {
+      memcpy(q, p, used);
+   }
+   return q;
+}
+
+static hamt_node *new_node(void *edit)
+{
+   hamt_node *n = (hamt_node *)lisp_alloc(HAMT, sizeof(hamt_node));
+   n->datamap = 0;
+   n->nodemap = 0;
+   n->ndata = 0;
+   n->nnodes = 0;
+   n->data = NULL;
+   n->nodes = NULL;
+   n->edit = edit;
+   return n;
+}
+
+static hamt_node *node_clone(hamt_node *n, void *edit)
+{
+   hamt_node *c = new_node(edit);
+   c->datamap = n->datamap;
+   c->nodemap = n->nodemap;
+   c->ndata = n->ndata;
+   c->nnodes = n->nnodes;
+   c->data = (hamt_entry *)copy_array(n->data,
+      n->ndata * sizeof(hamt_entry), n->ndata * sizeof(hamt_entry));
+   c->nodes = (hamt_node **)copy_array(n->nodes,
+      n->nnodes * sizeof(hamt_node *), n->nnodes * sizeof(hamt_node *));
+   return c;
+}
+
+/* path copying: a transient edits its own nodes in place */
+static hamt_node *editable(hamt_node *n, void *edit)
+{
+   return (edit != NULL && n->edit == edit) ? n : node_clone(n, edit);
+}
+
+static void data_insert(hamt_node *n, int i, hamt_entry *e)
+{
+   n->data = (hamt_entry *)copy_array(n->data,
+      n->ndata * sizeof(hamt_entry), (n->ndata + 1) * sizeof(hamt_entry));
+   memmove(&n->data[i + 1], &n->data[i], (n->ndata - i) * sizeof(hamt_entry));
+   n->data[i] = *e;
+   n->ndata++;
+}
+
+static void data_remove(hamt_node *n, int i)
+{
+   memmove(&n->data[i], &n->data[i + 1], (n->ndata - i - 1) * sizeof(hamt_entry));
+   n->ndata--;
+}
+
+static void child_insert(hamt_node *n, int i, hamt_node *child)
+{
+   n->nodes = (hamt_node **)copy_array(n->nodes,
+      n->nnodes * sizeof(hamt_node *), (n->nnodes + 1) * sizeof(hamt_node *));
+   memmove(&n->nodes[i + 1], &n->nodes[i], (n->nnodes - i) * sizeof(hamt_node *));
+   n->nodes[i] = child;
+   n->nnodes++;
+}
+
+static void child_remove(hamt_node *n, int i)
+{
+   memmove(&n->nodes[i], &n->nodes[i + 1], (n->nnodes - i - 1) * sizeof(hamt_node *));
+   n->nnodes--;
+}
+
+static bool entry_matches(hamt_entry *e, lispobj *key, unsigned int hash)
+{
+   return e->hash == hash && generic_equal(e->key, key);
+}
+
+static hamt_node *merge_entries(void *edit, hamt_entry *a, hamt_entry *b, int shift)
+{
+   hamt_node *n = new_node(edit);
+   unsigned int fa, fb;
+
+   if(shift >= HAMT_HASH_BITS)
+   {
+      data_insert(n, 0, a);
+      data_insert(n, 1, b);
+      return n;
+   }
+
+   fa = frag(a->hash, shift);
+   fb = frag(b->hash, shift);
+   if(fa == fb)
+   {
+      n->nodemap = 1u << fa;
+      child_insert(n, 0, merge_entries(edit, a, b, shift + HAMT_BITS));
+   }
+   else
+   {
+      n->datamap = (1u << fa) | (1u << fb);
+      data_insert(n, 0, fa < fb ? a : b);
+      data_insert(n, 1, fa < fb ? b : a);
+   }
+   return n;
+}
+
+/*@null@*/
+static hamt_entry *node_find(hamt_node *n, lispobj *key, unsigned int hash)
+{
+   int shift;
+   int i;
+
+   for(shift = 0; shift < HAMT_HASH_BITS; shift += HAMT_BITS)
+   {
+      unsigned int bit = 1u << frag(hash, shift);
+      if(n->datamap & bit)
+      {
+         hamt_entry *e = &n->data[index_of(n->datamap, bit)];
+         return entry_matches(e, key, hash) ? e : NULL;
+      }
+      else if(n->nodemap & bit)
+      {
+         n = n->nodes[index_of(n->nodemap, bit)];
+      }
+      else
+      {
+         return NULL;
+      }
+   }
+
+   for(i = 0; i < n->ndata; ++i)
+   {
+      if(entry_matches(&n->data[i], key, hash))
+      {
+         return &n->data[i];
+      }
+   }
+   return NULL;
+}
+
+static hamt_node *node_set(
+   void *edit, hamt_node *n, hamt_entry *e, int shift, bool *added)
+{
+   unsigned int bit;
+   int i;
+
+   if(shift >= HAMT_HASH_BITS)
+   {
+      for(i = 0; i < n->ndata; ++i)
+      {
+         if(entry_matches(&n->data[i], e->key, e->hash))
+         {
+            if(n->data[i].val != e->val)
+            {
+               n = editable(n, edit);
+               n->data[i].val = e->val;
+            }
+            return n;
+         }
+      }
+      n = editable(n, edit);
+      data_insert(n, n->ndata, e);
+      *added = true;
+      return n;
+   }
+
+   bit = 1u << frag(e->hash, shift);
+   if(n->datamap & bit)
+   {
+      hamt_node *child;
+      i = index_of(n->datamap, bit);
+      if(entry_matches(&n->data[i], e->key, e->hash))
+      {
+         if(n->data[i].val != e->val)
+         {
+            n = editable(n, edit);
+            n->data[i].val = e->val;
+         }
+         return n;
+      }
+
+      child = merge_entries(edit, &n->data[i], e, shift + HAMT_BITS);
+      n = editable(n, edit);
+      data_remove(n, i);
+      n->datamap &= ~bit;
+      n->nodemap |= bit;
+      child_insert(n, index_of(n->nodemap, bit), child);
+      *added = true;
+   }
+   else if(n->nodemap & bit)
+   {
+      hamt_node *child;
+      i = index_of(n->nodemap, bit);
+      child = node_set(edit, n->nodes[i], e, shift + HAMT_BITS, added);
+      if(child != n->nodes[i])
+      {
+         n = editable(n, edit);
+         n->nodes[i] = child;
+      }
+   }
+   else
+   {
+      n = editable(n, edit);
+      n->datamap |= bit;
+      data_insert(n, index_of(n->datamap, bit), e);
+      *added = true;
+   }
+   return n;
+}
+
+static hamt_node *node_delete(
+   void *edit, hamt_node *n, lispobj *key, unsigned int hash, int shift,
+   bool *removed)
+{
+   unsigned int bit;
+   int i;
+
+   if(shift >= HAMT_HASH_BITS)
+   {
+      for(i = 0; i < n->ndata; ++i)
+      {
+         if(entry_matches(&n->data[i], key, hash))
+         {
+            n = editable(n, edit);
+            data_remove(n, i);
+            *removed = true;
+            break;
+         }
+      }
+      return n;
+   }
+
+   bit = 1u << frag(hash, shift);
+   if(n->datamap & bit)
+   {
+      i = index_of(n->datamap, bit);
+      if(entry_matches(&n->data[i], key, hash))
+      {
+         n = editable(n, edit);
+         data_remove(n, i);
+         n->datamap &= ~bit;
+         *removed = true;
+      }
+   }
+   else if(n->nodemap & bit)
+   {
+      hamt_node *child;
+      i = index_of(n->nodemap, bit);
+      child = node_delete(edit, n->nodes[i], key, hash, shift + HAMT_BITS, removed);
+      if(*removed)
+      {
+         n = editable(n, edit);
+         if(child->ndata == 1 && child->nnodes == 0)
+         {
+            hamt_entry e = child->data[0];
+            child_remove(n, i);
+            n->nodemap &= ~bit;
+            n->datamap |= bit;
+            data_insert(n, index_of(n->datamap, bit), &e);
+         }
+         else
+         {
+            n->nodes[i] = child;
+         }
+      }
+   }
+   return n;
+}
+
+static void node_collect(hamt_node *n, int shift, cell **tail)
+{
+   int b;
+
+   if(shift >= HAMT_HASH_BITS)
+   {
+      for(b = 0; b < n->ndata; ++b)
+      {
+         cell *c = cons(cons(n->data[b].key, n->data[b].val), NULL);
+         set_cdr(*tail, c);
+         *tail = c;
+      }
+      return;
+   }
+
+   for(b = 0; b <= HAMT_MASK; ++b)
+   {
+      unsigned int bit = 1u << b;
+      if(n->datamap & bit)
+      {
+         hamt_entry *e = &n->data[index_of(n->datamap, bit)];
+         cell *c = cons(cons(e->key, e->val), NULL);
+         set_cdr(*tail, c);
+         *tail = c;
+      }
+      else if(n->nodemap & bit)
+      {
+         node_collect(n->nodes[index_of(n->nodemap, bit)], shift + HAMT_BITS, tail);
+      }
+   }
+}
+
+
+/* hamt */
+static hamt *wrap_root(hamt_node *root, int count, void *edit)
+{
+   hamt *m = alloc_object(HAMT);
+   hamt_root *r = (hamt_root *)lisp_alloc(HAMT, sizeof(hamt_root));
+   r->root = root;
+   r->count = count;
+   r->edit = edit;
+   set_car(m, r);
+   set_cdr(m, NULL);
+   return m;
+}
+
+/*@null@*/
+hamt *new_hamt()
+{
+   return wrap_root(new_node(NULL), 0, NULL);
+}
+
+bool is_hamt(lispobj *obj)
+{
+   return obj == NULL ? false : obj->tid == HAMT;
+}
+
+bool is_transient_hamt(lispobj *obj)
+{
+   return is_hamt(obj) && ((hamt_root *)car(obj))->edit != NULL;
+}
+
+bool hamt_lookup(hamt *m, lispobj *key, lispobj **val)
+{
+   hamt_root *r = car(m);
+   hamt_entry *e = node_find(r->root, key, hash_equal(key));
+   if(e != NULL && val != NULL)
+   {
+      *val = e->val;
+   }
+   return e != NULL;
+}
+
+int hamt_count(hamt *m)
+{
+   return ((hamt_root *)car(m))->count;
+}
+
+static void check_transient(hamt *m, bool transient, char *name)
+{
+   if(is_transient_hamt(m) != transient)
+   {
+      lisp_error("%s error: %s map expected",
+         name, transient ? "transient" : "persistent");
+   }
+}
+
+hamt *hamt_set(hamt *m, lispobj *key, lispobj *val)
+{
+   hamt_root *r = car(m);
+   hamt_entry e;
+   hamt_node *root;
+   bool added = false;
+
+   check_transient(m, false, "hamt-set");
+   e.key = key;
+   e.val = val;
+   e.hash = hash_equal(key);
+   root = node_set(NULL, r->root, &e, 0, &added);
+   return root == r->root ? m : wrap_root(root, r->count + added, NULL);
+}
+
+hamt *hamt_delete(hamt *m, lispobj *key)
+{
+   hamt_root *r = car(m);
+   hamt_node *root;
+   bool removed = false;
+
+   check_transient(m, false, "hamt-delete");
+   root = node_delete(NULL, r->root, key, hash_equal(key), 0, &removed);
+   return removed ? wrap_root(root, r->count - 1, NULL) : m;
+}
+
+hamt *hamt_transient(hamt *m)
+{
+   hamt_root *r = car(m);
+   check_transient(m, false, "hamt-transient");
+   return wrap_root(r->root, r->count, lisp_alloc(HAMT, 1));
+}
+
+hamt *hamt_set_transient(hamt *t, lispobj *key, lispobj *val)
+{
+   hamt_root *r = car(t);
+   hamt_entry e;
+   bool added = false;
+
+   check_transient(t, true, "hamt-set!");
+   e.key = key;
+   e.val = val;
+   e.hash = hash_equal(key);
+   r->root = node_set(r->edit, r->root, &e, 0, &added);
+   r->count += added;
+   return t;
+}
+
+hamt *hamt_delete_transient(hamt *t, lispobj *key)
+{
+   hamt_root *r = car(t);
+   bool removed = false;
+
+   check_transient(t, true, "hamt-delete!");
+   r->root = node_delete(r->edit, r->root, key, hash_equal(key), 0, &removed);
+   r->count -= removed;
+   return t;
+}
+
+/* the edit token is dropped, so the nodes are shared from now on */
+hamt *hamt_persistent(hamt *t)
+{
+   hamt_root *r = car(t);
+   check_transient(t, true, "hamt-persistent!");
+   r->edit = NULL;
+   return t;
+}
+
+/*@null@*/
+list *hamt_to_alist(hamt *m)
+{
+   cell *head = cons(NULL, NULL);
+   cell *tail = head;
+   node_collect(((hamt_root *)car(m))->root, 0, &tail);
+   return cdr(head);
+}
+
+
+/* primitive procedures */
+lispobj *prim_make_hamt(int argc, lispobj **argv)
+{
+   return new_hamt();
+}
+
+lispobj *prim_is_hamt(int argc, lispobj **argv)
+{
+   return new_boolean(is_hamt(argv[0]));
+}
+
+lispobj *prim_hamt_ref(int argc, lispobj **argv)
+{
+   hamt *m = argv[0];
+   lispobj *val;
+
+   if(hamt_lookup(m, argv[1], &val))
+   {
+      return val;
+   }
+   else if(argc > 2)
+   {
+      return argv[2];
+   }
+   return new_boolean(false);
+}
+
+lispobj *prim_hamt_set(int argc, lispobj **argv)
+{
+   hamt *m = argv[0];
+   return hamt_set(m, argv[1], argv[2]);
+}
+
+lispobj *prim_hamt_delete(int argc, lispobj **argv)
+{
+   hamt *m = argv[0];
+   return hamt_delete(m, argv[1]);
+}
+
+lispobj *prim_hamt_contains(int argc, lispobj **argv)
+{
+   hamt *m = argv[0];
+   return new_boolean(hamt_lookup(m, argv[1], NULL));
+}
+
+lispobj *prim_hamt_count(int argc, lispobj **argv)
+{
+   hamt *m = argv[0];
+   return new_integer(hamt_count(m));
+}
+
+lispobj *prim_hamt_to_alist(int argc, lispobj **argv)
+{
+   hamt *m = argv[0];
+   return hamt_to_alist(m);
+}
+
+/* the first binding of a key wins, as with assoc */
+lispobj *prim_alist_to_hamt(int argc, lispobj **argv)
+{
+   hamt *t = hamt_transient(new_hamt());
+   list *l;
+
+   for(l = argv[0]; is_cell(l); l = cdr(l))
+   {
+      cell *pair = car(l);
+      if(!hamt_lookup(t, car(pair), NULL))
+      {
+         hamt_set_transient(t, car(pair), cdr(pair));
+      }
+   }
+   return hamt_persistent(t);
+}
+
+lispobj *prim_hamt_transient(int argc, lispobj **argv)
+{
+   hamt *m = argv[0];
+   return hamt_transient(m);
+}
+
+lispobj *prim_hamt_set_transient(int argc, lispobj **argv)
+{
+   hamt *t = argv[0];
+   return hamt_set_transient(t, argv[1], argv[2]);
+}
+
+lispobj *prim_hamt_delete_transient(int argc, lispobj **argv)
+{
+   hamt *t = argv[0];
+   return hamt_delete_transient(t, argv[1]);
+}
+
+lispobj *prim_hamt_persistent(int argc, lispobj **argv)
+{
+   hamt *t = argv[0];
+   return hamt_persistent(t);
+}
+
+static const prim_spec hamt_prims[] =
+{
+   {"make-hamt", prim_make_hamt, 0, 0, {NULL}, false},
+   {"hamt?", prim_is_hamt, 1, 1, {NULL}, true},
+   {"hamt-ref", prim_hamt_ref, 2, 3, {is_hamt, NULL}, false},
+   {"hamt-set", prim_hamt_set, 3, 3, {is_hamt, NULL}, false},
+   {"hamt-delete", prim_hamt_delete, 2, 2, {is_hamt, NULL}, false},
+   {"hamt-contains?", prim_hamt_contains, 2, 2, {is_hamt, NULL}, false},
+   {"hamt-count", prim_hamt_count, 1, 1, {is_hamt}, false},
+   {"hamt->alist", prim_hamt_to_alist, 1, 1, {is_hamt}, false},
+   {"alist->hamt", prim_alist_to_hamt, 1, 1, {NULL}, false},
+   {"hamt-transient", prim_hamt_transient, 1, 1, {is_hamt}, false},
+   {"hamt-set!", prim_hamt_set_transient, 3, 3, {is_hamt, NULL}, false},
+   {"hamt-delete!", prim_hamt_delete_transient, 2, 2, {is_hamt, NULL}, false},
+   {"hamt-persistent!", prim_hamt_persistent, 1, 1, {is_hamt}, false},
+   {NULL}
+};
+
+environment *define_hamt_procs(environment *env)
+{
+   return define_prims(env, hamt_prims);
+}
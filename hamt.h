@@ -0,0 +1,42 @@
+#ifndef _HAMT_H_
+#define _HAMT_H_
+
+#include <stdbool.h>
+#include "lispobj.h"
+
+/*
+ * persistent hash array mapped trie.  keys are compared with
+ * generic_equal.  a transient map is edited in place until
+ * hamt_persistent() is called on it.
+ */
+typedef lispobj hamt;
+hamt *new_hamt();
+bool is_hamt(lispobj *obj);
+bool is_transient_hamt(lispobj *obj);
+bool hamt_lookup(hamt *m, lispobj *key, lispobj **val);
+int hamt_count(hamt *m);
+hamt *hamt_set(hamt *m, lispobj *key, lispobj *val);
+hamt *hamt_delete(hamt *m, lispobj *key);
+hamt *hamt_transient(hamt *m);
+hamt *hamt_set_transient(hamt *t, lispobj *key, lispobj *val);
+hamt *hamt_delete_transient(hamt *t, lispobj *key);
+hamt *hamt_persistent(hamt *t);
+list *hamt_to_alist(hamt *m);
+
+/* primitive procedures */
+lispobj *prim_make_hamt(int argc, lispobj **argv);
+lispobj *prim_is_hamt(int argc, lispobj **argv);
+lispobj *prim_hamt_ref(int argc, lispobj **argv);
+lispobj *prim_hamt_set(int argc, lispobj **argv);
+lispobj *prim_hamt_delete(int argc, lispobj **argv);
+lispobj *prim_hamt_contains(int argc, lispobj **argv);
+lispobj *prim_hamt_count(int argc, lispobj **argv);
+lispobj *prim_hamt_to_alist(int argc, lispobj **argv);
+lispobj *prim_alist_to_hamt(int argc, lispobj **argv);
+lispobj *prim_hamt_transient(int argc, lispobj **argv);
+lispobj *prim_hamt_set_transient(int argc, lispobj **argv);
+lispobj *prim_hamt_delete_transient(int argc, lispobj **argv);
+lispobj *prim_hamt_persistent(int argc, lispobj **argv);
+environment *define_hamt_procs(environment *env);
+
+#endif
@@ -0,0 +1,577 @@
+
+#include "hashtable.h"
+#include "interp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+/*
+ * Open addressing with linear probing.  When a table gets too full a
+ * new slot array is allocated and the old one is drained a few slots
+ * per insert or delete, so no single insert ever pays for a whole
+ * rehash.  Lookups only read both arrays, as parallel-map workers may
+ * look up the same table at once.
+ */
+
+enum hash_table_define
+{
+   HT_MIN_SIZE = 8,
+   HT_MIGRATE_STEP = 8,
+   HT_HASH_BUDGET = 32
+};
+
+typedef enum slot_state
+{
+   SLOT_EMPTY, SLOT_USED, SLOT_DELETED
+} slot_state;
+
+typedef struct ht_slot
+{
+   lispobj *key;
+   lispobj *val;
+   unsigned int hash;
+   slot_state state;
+} ht_slot;
+
+typedef struct ht_array
+{
+   ht_slot *slots;
+   int size;      /* power of two */
+   int used;      /* live entries */
+   int filled;    /* live and deleted entries */
+} ht_array;
+
+typedef struct ht_table
+{
+   hash_kind kind;
+   ht_array cur;
+   ht_array old;  /* slots not yet moved to cur, or NULL */
+   int migrated;  /* index of the next old slot to move */
+} ht_table;
+
+
+/* hashing */
+unsigned int hash_bytes(const char *s, int length)
+{
+   unsigned int h = 2166136261u;
+   int i;
+   for(i = 0; i < length; ++i)
+   {
+      h ^= (unsigned char)s[i];
+      h *= 16777619u;
+   }
+   return h;
+}
+
+static unsigned int hash_mix(uintptr_t x)
+{
+   x ^= x >> 16;
+   x *= 0x45d9f3bu;
+   x ^= x >> 16;
+   x *= 0x45d9f3bu;
+   x ^= x >> 16;
+   return (unsigned int)x;
+}
+
+unsigned int hash_eqv(lispobj *obj)
+{
+   if(obj == NULL)
+   {
+      return 0;
+   }
+
+   switch(obj->tid)
+   {
+      case SYMBOL:
+         return hash_bytes(sym_to_string(obj), strlen(sym_to_string(obj)));
+      case INTEGER:
+         return hash_mix((uintptr_t)integer_to_long(obj));
+      case CHARACTER:
+         return hash_mix((unsigned char)character_to_char(obj));
+      case BOOLEAN:
+         return is_true(obj) ? 1 : 2;
+      default:
+         return hash_mix((uintptr_t)obj);
+   }
+}
+
+static unsigned int hash_equal_budget(lispobj *obj, int *budget)
+{
+   unsigned int h = 17;
+
+   while(is_cell(obj) && *budget > 0)
+   {
+      --*budget;
+      h = h * 31 + hash_equal_budget(car(obj), budget);
+      obj = cdr(obj);
+   }
+
+   if(is_cell(obj))
+   {
+      return h;
+   }
+   else if(is_string(obj))
+   {
+      return h * 31 + string_hash(obj);
+   }
+   return h * 31 + hash_eqv(obj);
+}
+
+unsigned int hash_equal(lispobj *obj)
+{
+   int budget = HT_HASH_BUDGET;
+   return hash_equal_budget(obj, &budget);
+}
+
+bool equal_eqv(lispobj *l, lispobj *r)
+{
+   if(l == r)
+   {
+      return true;
+   }
+   else if(l == NULL || r == NULL || l->tid != r->tid)
+   {
+      return false;
+   }
+
+   switch(l->tid)
+   {
+      case SYMBOL:
+      case INTEGER:
+      case CHARACTER:
+      case BOOLEAN:
+         return generic_equal(l, r);
+      default:
+         return false;
+   }
+}
+
+static unsigned int hash_key(hash_kind kind, lispobj *key)
+{
+   return kind == HASH_EQV ? hash_eqv(key) : hash_equal(key);
+}
+
+static bool equal_key(hash_kind kind, lispobj *l, lispobj *r)
+{
+   return kind == HASH_EQV ? equal_eqv(l, r) : generic_equal(l, r);
+}
+
+
+/* slot arrays */
+static void array_init(ht_array *a, int size)
+{
+   a->slots = (ht_slot *)calloc(size, sizeof(ht_slot));
+   if(a->slots == NULL)
+   {
+      fprintf(stderr, "hash table error: out of memory\n");
+      abort();
+   }
+   a->size = size;
+   a->used = 0;
+   a->filled = 0;
+}
+
+/*@null@*/
+static ht_slot *array_find(
+   ht_array *a, hash_kind kind, lispobj *key, unsigned int hash)
+{
+   int mask = a->size - 1;
+   int i = hash & mask;
+   int n;
+
+   for(n = 0; n < a->size; ++n, i = (i + 1) & mask)
+   {
+      ht_slot *s = &a->slots[i];
+      if(s->state == SLOT_EMPTY)
+      {
+         break;
+      }
+      else if(s->state == SLOT_USED && s->hash == hash &&
+              equal_key(kind, s->key, key))
+      {
+         return s;
+      }
+   }
+   return NULL;
+}
+
+/* key must not be in the array */
+static void array_put(
+   ht_array *a, lispobj *key, lispobj *val, unsigned int hash)
+{
+   int mask = a->size - 1;
+   int i = hash & mask;
+   ht_slot *s;
+
+   while(a->slots[i].state == SLOT_USED)
+   {
+      i = (i + 1) & mask;
+   }
+
+   s = &a->slots[i];
+   if(s->state == SLOT_EMPTY)
+   {
+      a->filled++;
+   }
+   s->key = key;
+   s->val = val;
+   s->hash = hash;
+   s->state = SLOT_USED;
+   a->used++;
+}
+
+static void slot_delete(ht_array *a, ht_slot *s)
+{
+   s->key = NULL;
+   s->val = NULL;
+   s->state = SLOT_DELETED;
+   a->used--;
+}
+
+
+/* incremental resizing */
+static void migrate(ht_table *t, int steps)
+{
+   while(t->old.slots != NULL && steps-- > 0)
+   {
+      if(t->migrated < t->old.size)
+      {
+         ht_slot *s = &t->old.slots[t->migrated++];
+         if(s->state == SLOT_USED)
+         {
+            array_put(&t->cur, s->key, s->val, s->hash);
+            slot_delete(&t->old, s);
+         }
+      }
+
+      if(t->migrated >= t->old.size)
+      {
+         free(t->old.slots);
+         t->old.slots = NULL;
+         t->old.size = 0;
+         t->old.used = 0;
+         t->old.filled = 0;
+      }
+   }
+}
+
+static void reserve_one(ht_table *t)
+{
+   int size;
+
+   if((t->cur.filled + 1) * 4 <= t->cur.size * 3)
+   {
+      return;
+   }
+
+   /* previous resize is not finished yet; this is not expected to
+    * happen because every insert drains HT_MIGRATE_STEP slots */
+   if(t->old.slots != NULL)
+   {
+      ht_array a;
+      int i;
+
+      for(size = t->cur.size; size < (t->cur.used + t->old.used) * 4; size *= 2);
+      array_init(&a, size);
+      for(i = t->migrated; i < t->old.size; ++i)
+      {
+         ht_slot *s = &t->old.slots[i];
+         if(s->state == SLOT_USED)
+         {
+            array_put(&a, s->key, s->val, s->hash);
+         }
+      }
+      for(i = 0; i < t->cur.size; ++i)
+      {
+         ht_slot *s = &t->cur.slots[i];
+         if(s->state == SLOT_USED)
+         {
+            array_put(&a, s->key, s->val, s->hash);
+         }
+      }
+      free(t->old.slots);
+      free(t->cur.slots);
+      t->old.slots = NULL;
+      t->old.size = 0;
+      t->old.used = 0;
+      t->old.filled = 0;
+      t->cur = a;
+      return;
+   }
+
+   size = t->cur.size;
+   if(t->cur.used * 2 >= t->cur.size)
+   {
+      size *= 2;
+   }
+
+   t->old = t->cur;
+   t->migrated = 0;
+   array_init(&t->cur, size);
+}
+
+
+/* hash table */
+/* the slot arrays are malloc'd, a resize frees the old ones */
+static void finalize_hash_table(lispobj *h)
+{
+   ht_table *t = car(h);
+   free(t->old.slots);
+   free(t->cur.slots);
+}
+
+/*@null@*/
+hash_table *new_hash_table(hash_kind kind)
+{
+   hash_table *h = alloc_object(HASH_TABLE);
+   ht_table *t = (ht_table *)lisp_alloc(HASH_TABLE, sizeof(ht_table));
+   t->kind = kind;
+   array_init(&t->cur, HT_MIN_SIZE);
+   t->old.slots = NULL;
+   t->old.size = 0;
+   t->old.used = 0;
+   t->old.filled = 0;
+   t->migrated = 0;
+   set_car(h, t);
+   set_cdr(h, NULL);
+   add_finalizer(h, finalize_hash_table);
+   return h;
+}
+
+bool is_hash_table(lispobj *obj)
+{
+   return obj == NULL ? false : obj->tid == HASH_TABLE;
+}
+
+/*@null@*/
+static ht_slot *table_find(ht_table *t, lispobj *key, unsigned int hash)
+{
+   ht_slot *s = array_find(&t->cur, t->kind, key, hash);
+   if(s == NULL && t->old.slots != NULL)
+   {
+      s = array_find(&t->old, t->kind, key, hash);
+   }
+   return s;
+}
+
+bool hash_table_lookup(hash_table *h, lispobj *key, lispobj **val)
+{
+   ht_table *t = car(h);
+   ht_slot *s = table_find(t, key, hash_key(t->kind, key));
+
+   if(s != NULL && val != NULL)
+   {
+      *val = s->val;
+   }
+   return s != NULL;
+}
+
+lispobj *hash_table_set(hash_table *h, lispobj *key, lispobj *val)
+{
+   ht_table *t = car(h);
+   unsigned int hash = hash_key(t->kind, key);
+   ht_slot *s;
+
+   migrate(t, HT_MIGRATE_STEP);
+   s = table_find(t, key, hash);
+   if(s != NULL)
+   {
+      s->val = val;
+   }
+   else
+   {
+      reserve_one(t);
+      array_put(&t->cur, key, val, hash);
+   }
+   return val;
+}
+
+bool hash_table_delete(hash_table *h, lispobj *key)
+{
+   ht_table *t = car(h);
+   unsigned int hash = hash_key(t->kind, key);
+   ht_slot *s;
+
+   migrate(t, HT_MIGRATE_STEP);
+   s = array_find(&t->cur, t->kind, key, hash);
+   if(s != NULL)
+   {
+      slot_delete(&t->cur, s);
+      return true;
+   }
+
+   if(t->old.slots != NULL)
+   {
+      s = array_find(&t->old, t->kind, key, hash);
+      if(s != NULL)
+      {
+         slot_delete(&t->old, s);
+         return true;
+      }
+   }
+   return false;
+}
+
+int hash_table_count(hash_table *h)
+{
+   ht_table *t = car(h);
+   return t->cur.used + t->old.used;
+}
+
+static list *array_to_alist(ht_array *a, list *tail)
+{
+   int i;
+   for(i = a->size - 1; i >= 0; --i)
+   {
+      ht_slot *s = &a->slots[i];
+      if(s->state == SLOT_USED)
+      {
+         tail = cons(cons(s->key, s->val), tail);
+      }
+   }
+   return tail;
+}
+
+/*@null@*/
+list *hash_table_to_alist(hash_table *h)
+{
+   ht_table *t = car(h);
+   list *result = array_to_alist(&t->cur, NULL);
+   if(t->old.slots != NULL)
+   {
+      result = array_to_alist(&t->old, result);
+   }
+   return result;
+}
+
+
+/* primitive procedures */
+lispobj *prim_make_hash_table(int argc, lispobj **argv)
+{
+   hash_kind kind = HASH_EQUAL;
+   if(argc > 0)
+   {
+      char *name = sym_to_string(argv[0]);
+      if(strcmp(name, "eq") == 0 || strcmp(name, "eqv") == 0)
+      {
+         kind = HASH_EQV;
+      }
+      else if(strcmp(name, "equal") != 0)
+      {
+         lisp_error("make-hash-table error: unknown kind");
+      }
+   }
+   return new_hash_table(kind);
+}
+
+lispobj *prim_is_hash_table(int argc, lispobj **argv)
+{
+   return new_boolean(is_hash_table(argv[0]));
+}
+
+lispobj *prim_hash_table_ref(int argc, lispobj **argv)
+{
+   hash_table *h = argv[0];
+   lispobj *val;
+
+   if(hash_table_lookup(h, argv[1], &val))
+   {
+      return val;
+   }
+   else if(argc > 2)
+   {
+      return argv[2];
+   }
+   return new_boolean(false);
+}
+
+lispobj *prim_hash_table_set(int argc, lispobj **argv)
+{
+   hash_table *h = argv[0];
+   return hash_table_set(h, argv[1], argv[2]);
+}
+
+lispobj *prim_hash_table_delete(int argc, lispobj **argv)
+{
+   hash_table *h = argv[0];
+   return new_boolean(hash_table_delete(h, argv[1]));
+}
+
+lispobj *prim_hash_table_contains(int argc, lispobj **argv)
+{
+   hash_table *h = argv[0];
+   return new_boolean(hash_table_lookup(h, argv[1], NULL));
+}
+
+lispobj *prim_hash_table_count(int argc, lispobj **argv)
+{
+   hash_table *h = argv[0];
+   return new_integer(hash_table_count(h));
+}
+
+lispobj *prim_hash_table_keys(int argc, lispobj **argv)
+{
+   hash_table *h = argv[0];
+   list *alist = hash_table_to_alist(h);
+   list *l;
+   for(l = alist; l != NULL; l = cdr(l))
+   {
+      set_car(l, car(car(l)));
+   }
+   return alist;
+}
+
+lispobj *prim_hash_table_values(int argc, lispobj **argv)
+{
+   hash_table *h = argv[0];
+   list *alist = hash_table_to_alist(h);
+   list *l;
+   for(l = alist; l != NULL; l = cdr(l))
+   {
+      set_car(l, cdr(car(l)));
+   }
+   return alist;
+}
+
+lispobj *prim_hash_table_to_alist(int argc, lispobj **argv)
+{
+   hash_table *h = argv[0];
+   return hash_table_to_alist(h);
+}
+
+/* the entries are copied first so proc may modify the table */
+lispobj *prim_hash_table_walk(int argc, lispobj **argv)
+{
+   hash_table *h = argv[0];
+   lispobj *proc = argv[1];
+   list *l;
+
+   for(l = hash_table_to_alist(h); l != NULL; l = cdr(l))
+   {
+      cell *pair = car(l);
+      apply_procedure(proc, cons(car(pair), cons(cdr(pair), NULL)));
+   }
+   return NULL;
+}
+
+static const prim_spec hash_table_prims[] =
+{
+   {"make-hash-table", prim_make_hash_table, 0, 1, {is_symbol}, false},
+   {"hash-table?", prim_is_hash_table, 1, 1, {NULL}, true},
+   {"hash-table-ref", prim_hash_table_ref, 2, 3, {is_hash_table, NULL}, false},
+   {"hash-table-set!", prim_hash_table_set, 3, 3, {is_hash_table, NULL}, false},
+   {"hash-table-delete!", prim_hash_table_delete, 2, 2, {is_hash_table, NULL}, false},
+   {"hash-table-contains?", prim_hash_table_contains, 2, 2, {is_hash_table, NULL}, false},
+   {"hash-table-count", prim_hash_table_count, 1, 1, {is_hash_table}, false},
+   {"hash-table-keys", prim_hash_table_keys, 1, 1, {is_hash_table}, false},
+   {"hash-table-values", prim_hash_table_values, 1, 1, {is_hash_table}, false},
+   {"hash-table->alist", prim_hash_table_to_alist, 1, 1, {is_hash_table}, false},
+   {"hash-table-walk", prim_hash_table_walk, 2, 2, {is_hash_table, NULL}, false},
+   {NULL}
+};
+
+environment *define_hash_table_procs(environment *env)
+{
+   return define_prims(env, hash_table_prims);
+}
@@ -0,0 +1,44 @@
+#ifndef _HASHTABLE_H_
+#define _HASHTABLE_H_
+
+#include <stdbool.h>
+#include "lispobj.h"
+
+/* key comparison of a hash table */
+typedef enum hash_kind
+{
+   HASH_EQV,      /* identity, atoms compared by value */
+   HASH_EQUAL     /* generic_equal */
+} hash_kind;
+
+/* hashing */
+unsigned int hash_bytes(const char *s, int length);
+unsigned int hash_eqv(lispobj *obj);
+unsigned int hash_equal(lispobj *obj);
+bool equal_eqv(lispobj *l, lispobj *r);
+
+/* hash table */
+typedef lispobj hash_table;
+hash_table *new_hash_table(hash_kind kind);
+bool is_hash_table(lispobj *obj);
+bool hash_table_lookup(hash_table *h, lispobj *key, lispobj **val);
+lispobj *hash_table_set(hash_table *h, lispobj *key, lispobj *val);
+bool hash_table_delete(hash_table *h, lispobj *key);
+int hash_table_count(hash_table *h);
+list *hash_table_to_alist(hash_table *h);
+
+/* primitive procedures */
+lispobj *prim_make_hash_table(int argc, lispobj **argv);
+lispobj *prim_is_hash_table(int argc, lispobj **argv);
+lispobj *prim_hash_table_ref(int argc, lispobj **argv);
+lispobj *prim_hash_table_set(int argc, lispobj **argv);
+lispobj *prim_hash_table_delete(int argc, lispobj **argv);
+lispobj *prim_hash_table_contains(int argc, lispobj **argv);
+lispobj *prim_hash_table_count(int argc, lispobj **argv);
+lispobj *prim_hash_table_keys(int argc, lispobj **argv);
+lispobj *prim_hash_table_values(int argc, lispobj **argv);
+lispobj *prim_hash_table_to_alist(int argc, lispobj **argv);
+lispobj *prim_hash_table_walk(int argc, lispobj **argv);
+environment *define_hash_table_procs(environment *env);
+
+#endif
@@ -0,0 +1,376 @@
+#include "interp.h"
+#include "hashtable.h"
+#include "port.h"
+#include "stack.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+
+struct arena_chunk
+{
+   struct arena_chunk *next;
+   size_t size;
+   size_t used;
+   char data[];
+};
+
+struct finalizer
+{
+   struct finalizer *next;
+   lispobj *obj;
+   void (*finalize)(lispobj *);
+};
+
+static __thread interp *current = NULL;
+
+
+/* interpreter */
+interp *new_interp()
+{
+   interp *it = (interp *)calloc(1, sizeof(interp));
+   if(it == NULL)
+   {
+      fprintf(stderr, "interp error: out of memory\n");
+      abort();
+   }
+   pthread_mutex_init(&it->lock, NULL);
+   it->chunk_size = ARENA_MIN_CHUNK_SIZE;
+   it->fuel_limit = LONG_MAX;
+   it->depth_limit = INT_MAX;
+   it->heap_limit = LONG_MAX;
+   clock_gettime(CLOCK_MONOTONIC, &it->start_time);
+   return it;
+}
+
+static long remaining(long limit, long used)
+{
+   return limit == LONG_MAX ? LONG_MAX : limit - used;
+}
+
+/* the child may use what is left of the owner's limits */
+interp *new_child_interp(interp *owner)
+{
+   interp *it = new_interp();
+   it->owner = owner;
+   it->global_env = owner->global_env;
+   it->fuel_limit = remaining(owner->fuel_limit, owner->stats.evals);
+   it->depth_limit = owner->depth_limit == INT_MAX ?
+      INT_MAX : owner->depth_limit - owner->stats.eval_depth;
+   it->heap_limit = remaining(owner->heap_limit, owner->alloc_bytes);
+   return it;
+}
+
+/* the objects, finalizers and counts of child become it's */
+void merge_interp(interp *it, interp *child)
+{
+   finalizer **f;
+   arena_chunk **c;
+   int i;
+
+   if(child->stdout_port != NULL)
+   {
+      port_flush(child->stdout_port);
+   }
+
+   for(c = &child->chunks; *c != NULL; c = &(*c)->next);
+   if(it->chunks != NULL)
+   {
+      /* behind the first chunk, which keeps being bumped */
+      *c = it->chunks->next;
+      it->chunks->next = child->chunks;
+   }
+   else
+   {
+      it->chunks = child->chunks;
+   }
+
+   for(f = &child->finalizers; *f != NULL; f = &(*f)->next);
+   *f = it->finalizers;
+   it->finalizers = child->finalizers;
+
+   it->allocs += child->allocs;
+   it->alloc_bytes += child->alloc_bytes;
+   it->objects += child->objects;
+   for(i = 0; i < NUM_OF_TYPES; ++i)
+   {
+      it->type_objects[i] += child->type_objects[i];
+      it->type_bytes[i] += child->type_bytes[i];
+   }
+   it->stats.evals += child->stats.evals;
+   it->stats.lookups += child->stats.lookups;
+   if(it->stats.eval_depth + child->stats.max_eval_depth > it->stats.max_eval_depth)
+   {
+      it->stats.max_eval_depth = it->stats.eval_depth + child->stats.max_eval_depth;
+   }
+
+   free_stack_segments(child);
+   pthread_mutex_destroy(&child->lock);
+   free(child);
+}
+
+/* finalizers run with the interpreter current, they may write to its
+ * ports; then every object of it is gone at once */
+void delete_interp(interp *it)
+{
+   interp *outer = set_current_interp(it);
+   finalizer *f;
+   arena_chunk *c;
+   arena_chunk *next;
+
+   for(f = it->finalizers; f != NULL; f = f->next)
+   {
+      f->finalize(f->obj);
+   }
+   set_current_interp(outer == it ? NULL : outer);
+
+   for(c = it->chunks; c != NULL; c = next)
+   {
+      next = c->next;
+      free(c);
+   }
+   free_stack_segments(it);
+   free(it->symbols);
+   pthread_mutex_destroy(&it->lock);
+   free(it);
+}
+
+/* a thread that never chose one gets an interpreter of its own */
+interp *current_interp()
+{
+   if(current == NULL)
+   {
+      current = new_interp();
+   }
+   return current;
+}
+
+/* for signal handlers, which must not allocate */
+/*@null@*/
+interp *peek_current_interp()
+{
+   return current;
+}
+
+/* returns the previous one */
+interp *set_current_interp(interp *it)
+{
+   interp *outer = current;
+   current = it;
+   return outer;
+}
+
+
+/* heap */
+static arena_chunk *new_chunk(size_t size)
+{
+   arena_chunk *c = (arena_chunk *)malloc(sizeof(arena_chunk) + size);
+   if(c == NULL)
+   {
+      fprintf(stderr, "alloc error: out of memory\n");
+      abort();
+   }
+   c->next = NULL;
+   c->size = size;
+   c->used = 0;
+   return c;
+}
+
+void *arena_alloc(interp *it, size_t size)
+{
+   arena_chunk *c = it->chunks;
+   void *p;
+
+   size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+   if(c == NULL || c->used + size > c->size)
+   {
+      if(size > ARENA_LARGE_SIZE && c != NULL)
+      {
+         /* behind the first chunk, which keeps being bumped */
+         arena_chunk *large = new_chunk(size);
+         large->used = size;
+         large->next = c->next;
+         c->next = large;
+         return large->data;
+      }
+      c = new_chunk(size > it->chunk_size ? size : it->chunk_size);
+      c->next = it->chunks;
+      it->chunks = c;
+      if(it->chunk_size < ARENA_CHUNK_SIZE)
+      {
+         it->chunk_size *= 2;
+      }
+   }
+   p = c->data + c->used;
+   c->used += size;
+   return p;
+}
+
+/* objects and their payloads come from here so that the counts
+ * show how hard a program works the heap */
+static void *allocate(int tid, size_t size, bool object)
+{
+   interp *it = current_interp();
+   void *p = arena_alloc(it, size);
+
+   it->allocs++;
+   it->alloc_bytes += size;
+   it->type_bytes[tid] += size;
+   if(object)
+   {
+      it->objects++;
+      it->type_objects[tid]++;
+   }
+   if(it->owner == NULL)
+   {
+      heap_profile_record(tid, size, object);
+   }
+   if(it->alloc_bytes > it->heap_limit)
+   {
+      lisp_raise("heap limit exceeded");
+   }
+   return p;
+}
+
+/* payload of an object of type tid */
+/*@null@*/
+void *lisp_alloc(int tid, size_t size)
+{
+   return allocate(tid, size, false);
+}
+
+/*@null@*/
+lispobj *alloc_object(int tid)
+{
+   lispobj *obj = allocate(tid, sizeof(lispobj), true);
+   obj->tid = tid;
+   return obj;
+}
+
+long alloc_count()
+{
+   return current_interp()->allocs;
+}
+
+long alloc_bytes()
+{
+   return current_interp()->alloc_bytes;
+}
+
+long object_count()
+{
+   return current_interp()->objects;
+}
+
+/* for objects holding malloc'd memory or descriptors */
+void add_finalizer(lispobj *obj, void (*finalize)(lispobj *))
+{
+   interp *it = current_interp();
+   finalizer *f = (finalizer *)arena_alloc(it, sizeof(finalizer));
+   f->obj = obj;
+   f->finalize = finalize;
+   f->next = it->finalizers;
+   it->finalizers = f;
+}
+
+
+/* symbol table */
+/* children use their owner's table, taking its lock */
+static unsigned int symbol_slot(char *name, int size)
+{
+   return hash_bytes(name, strlen(name)) & (size - 1);
+}
+
+static void grow_symbols(interp *it)
+{
+   symbol **old = it->symbols;
+   int old_size = it->symbols_size;
+   int i;
+   unsigned int k;
+
+   it->symbols_size = old_size == 0 ? SYMBOL_TABLE_SIZE : old_size * 2;
+   it->symbols = (symbol **)calloc(it->symbols_size, sizeof(symbol *));
+   if(it->symbols == NULL)
+   {
+      fprintf(stderr, "symbol table error: out of memory\n");
+      abort();
+   }
+   for(i = 0; i < old_size; ++i)
+   {
+      if(old[i] == NULL)
+      {
+         continue;
+      }
+      for(k = symbol_slot(sym_to_string(old[i]), it->symbols_size);
+          it->symbols[k] != NULL; k = (k + 1) & (it->symbols_size - 1));
+      it->symbols[k] = old[i];
+   }
+   free(old);
+}
+
+static symbol **symbol_entry(interp *it, char *name)
+{
+   unsigned int k;
+
+   for(k = symbol_slot(name, it->symbols_size); it->symbols[k] != NULL;
+       k = (k + 1) & (it->symbols_size - 1))
+   {
+      if(strcmp(sym_to_string(it->symbols[k]), name) == 0)
+      {
+         break;
+      }
+   }
+   return &it->symbols[k];
+}
+
+/*@null@*/
+symbol *find_symbol(char *name)
+{
+   interp *it = current_interp();
+   interp *home = it->owner != NULL ? it->owner : it;
+   symbol *s = NULL;
+
+   if(it->owner != NULL)
+   {
+      pthread_mutex_lock(&home->lock);
+   }
+   if(home->symbols != NULL)
+   {
+      s = *symbol_entry(home, name);
+   }
+   if(it->owner != NULL)
+   {
+      pthread_mutex_unlock(&home->lock);
+   }
+   return s;
+}
+
+/* returns the symbol of that name already in the table, if another
+ * thread added one since find_symbol */
+symbol *add_symbol(symbol *s)
+{
+   interp *it = current_interp();
+   interp *home = it->owner != NULL ? it->owner : it;
+   symbol **e;
+
+   if(it->owner != NULL)
+   {
+      pthread_mutex_lock(&home->lock);
+   }
+   if(home->symbols_used * 2 >= home->symbols_size)
+   {
+      grow_symbols(home);
+   }
+   e = symbol_entry(home, sym_to_string(s));
+   if(*e == NULL)
+   {
+      *e = s;
+      home->symbols_used++;
+   }
+   s = *e;
+   if(it->owner != NULL)
+   {
+      pthread_mutex_unlock(&home->lock);
+   }
+   return s;
+}
@@ -0,0 +1,112 @@
+#ifndef _INTERP_H_
+#define _INTERP_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include "lispobj.h"
+#include "profile.h"
+
+enum interp_define
+{
+   ARENA_MIN_CHUNK_SIZE = 64 * 1024,         /* chunks double up to ARENA_CHUNK_SIZE */
+   ARENA_CHUNK_SIZE = 1 << 20,
+   ARENA_LARGE_SIZE = ARENA_CHUNK_SIZE / 8,   /* bigger ones get a chunk of their own */
+   ARENA_ALIGN = 8,
+   SYMBOL_TABLE_SIZE = 1024                   /* initial size, power of two */
+};
+
+typedef struct arena_chunk arena_chunk;
+typedef struct finalizer finalizer;
+struct eval_guard;
+struct scheduler;
+struct escape_frame;
+struct stack_segment;
+
+/*
+ * An interpreter owns the objects allocated while it is current, its
+ * symbols and the counters and limits of its evaluations.  Objects are
+ * never freed one by one: delete_interp releases the whole heap at
+ * once, after running the finalizers of the objects holding memory or
+ * descriptors from outside the heap.
+ *
+ * Each thread has its own current interpreter, made on first use; an
+ * interpreter is used by one thread at a time.
+ *
+ * A worker evaluating for another interpreter, its owner, gets a child
+ * interpreter: it shares the owner's symbols and global environment and
+ * has a heap of its own, which merge_interp hands over to the owner
+ * when the work is done.
+ */
+typedef struct interp
+{
+   /*@null@*/ struct interp *owner;
+   pthread_mutex_t lock;      /* symbols, while children run */
+
+   /* heap */
+   arena_chunk *chunks;       /* the first one is bumped */
+   size_t chunk_size;
+   finalizer *finalizers;
+   long allocs;
+   long alloc_bytes;
+   long objects;
+   long type_objects[NUM_OF_TYPES];
+   long type_bytes[NUM_OF_TYPES];
+
+   /* symbols are interned, so equal symbols are usually the same object */
+   symbol **symbols;
+   int symbols_size;
+   int symbols_used;
+
+   /*@null@*/ environment *global_env;
+
+   /* evaluation */
+   runtime_stats stats;
+   struct timespec start_time;
+   long fuel_limit;
+   int depth_limit;
+   long heap_limit;
+   /*@null@*/ struct eval_guard *guard;
+   /*@null@*/ struct escape_frame *escapes;   /* innermost call/cc, see cont.h */
+   /*@null@*/ char *stack_base;
+
+   /* stack segments, see stack.h */
+   /*@null@*/ struct stack_segment *segments;   /* the one evaluating */
+   /*@null@*/ struct stack_segment *free_segments;
+   int num_free_segments;
+   size_t segment_bytes;
+   unsigned long segment_serial;
+   eval_limits toplevel_limits;
+   /*@null@*/ struct scheduler *scheduler;   /* of green threads, see green.h */
+
+   /* standard ports, buffered per interpreter */
+   /*@null@*/ lispobj *stdin_port;
+   /*@null@*/ lispobj *stdout_port;
+
+   /* profiler */
+   lispobj *shadow_stack[PROFILE_STACK_SIZE];
+   volatile int shadow_depth;
+   /*@null@*/ lispobj *names;
+} interp;
+
+interp *new_interp();
+interp *new_child_interp(interp *owner);
+void merge_interp(interp *it, interp *child);
+void delete_interp(interp *it);
+interp *current_interp();
+/*@null@*/ interp *peek_current_interp();
+interp *set_current_interp(interp *it);
+
+/* evaluation, raises when a limit is exceeded */
+void check_limits(interp *it);
+
+/* heap */
+void *arena_alloc(interp *it, size_t size);
+void add_finalizer(lispobj *obj, void (*finalize)(lispobj *));
+
+/* symbol table */
+/*@null@*/ symbol *find_symbol(char *name);
+symbol *add_symbol(symbol *s);
+
+#endif
@@ -1,26 +1,71 @@
 
+#define _GNU_SOURCE
 #include "lispobj.h"
+#include "interp.h"
+#include "hashtable.h"
+#include "hamt.h"
+#include "lispstring.h"
+#include "bytevector.h"
+#include "port.h"
+#include "profile.h"
+#include "server.h"
+#include "parallel.h"
+#include "place.h"
+#include "green.h"
+#include "async.h"
+#include "cont.h"
+#include "stack.h"
+#include "analyze.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdarg.h>
 #include <string.h>
 #include <assert.h>
-
-typedef enum type_id 
-{
-   SYMBOL, CELL, INTEGER, CHARACTER, BOOLEAN, STRING,
-   SYNTAX, MACRO, PRIM_PROC, LAMBDA,  NUM_OF_TYPES
-} type_id;
+#include <limits.h>
+#include <setjmp.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/resource.h>
 
 /* lower index is higher priority */
 enum SPCL_CHRS {UNQUOTE_SPLICING, QUASIQUOTE, QUOTE, UNQUOTE, NUM_OF_SPCIL_CHRS };
-char* special_chars[] = {",@", "`", "'", ","};
-char* readmacro_symbols[] = {"unquote-splicing", "quasiquote", "quote", "unquote"};
-char* brackets_chars[] = {"(", ")"};
+/* read only, shared by every interpreter */
+static char* special_chars[] = {",@", "`", "'", ","};
+static char* readmacro_symbols[] = {"unquote-splicing", "quasiquote", "quote", "unquote"};
+static char* brackets_chars[] = {"(", ")"};
 
 /* generic equal */
-bool (*equalf_pointers[NUM_OF_TYPES])(lispobj *, lispobj *)
+static bool (*equalf_pointers[NUM_OF_TYPES])(lispobj *, lispobj *)
 = {equal_symbol, equal_cell, equal_integer, equal_character,
-   equal_boolean, NULL};
+   equal_boolean, equal_string, NULL};
+
+
+/* runtime statistics */
+/* a few increments per eval, cheap enough to keep on all the time */
+runtime_stats *get_runtime_stats()
+{
+   return &current_interp()->stats;
+}
+
+static long timespec_usec(struct timespec *t)
+{
+   return t->tv_sec * 1000000L + t->tv_nsec / 1000;
+}
+
+/* since the interpreter was made */
+long wall_usec()
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return timespec_usec(&now) - timespec_usec(&current_interp()->start_time);
+}
+
+long cpu_usec()
+{
+   struct timespec now;
+   clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+   return timespec_usec(&now);
+}
 
 
 /* cell */
@@ -29,13 +74,11 @@ static void *get_val(cell *c, int i)
 {
    if(c == NULL)
    {
-      fprintf(stderr, "get_val(): cell is NULL\n");
-      abort();
+      lisp_error("get_val(): cell is NULL");
    }
    if(!(0 <= i &&i < NUM_OF_VALUES))
    {
-      fprintf(stderr, "get_val(): index error\n");
-      abort();
+      lisp_error("get_val(): index error");
    }
    return c->value[i];   
 }
@@ -45,7 +88,8 @@ static void *set_val(cell *c, int i, lispobj *obj)
 {
    void *result = NULL;
    result = c->value[i];
-   c->value[i] = obj;
+   /* published to other threads only once the object is complete */
+   __atomic_store_n(&c->value[i], obj, __ATOMIC_RELEASE);
    return result;
 }
 
@@ -76,8 +120,7 @@ void *set_cdr(cell *c, void *obj)
 /*@null@*/
 cell *cons(void *l, void *r)
 {
-   cell *c = (cell *)malloc(sizeof(cell));
-   c->tid = CELL;
+   cell *c = alloc_object(CELL);
    set_car(c, l);
    set_cdr(c, r);
    return c;
@@ -88,32 +131,43 @@ bool is_cell(lispobj *obj)
    return obj == NULL ? 0 :obj->tid == CELL;
 }
 
+/* loops along the cdrs, so only nesting in the cars takes C stack */
 bool equal_cell(cell *l, cell* r)
 {
-   bool result = false;
-   if(is_cell(l) && is_cell(r))
+   if(!is_cell(l) || !is_cell(r))
    {
-      result = 
-         (generic_equal(car(l), car(r)) && 
-         generic_equal(cdr(l), cdr(r)));
+      return false;
    }
-   return result;
+   for(; is_cell(l) && is_cell(r) && l != r; l = cdr(l), r = cdr(r))
+   {
+      if(!generic_equal(car(l), car(r)))
+      {
+         return false;
+      }
+   }
+   return generic_equal(l, r);
 }
 
 /* symbol */
 symbol *new_symbol(char *name)
 {
-   symbol *s = (symbol *)malloc(sizeof(symbol));
+   symbol *s = find_symbol(name);
    char *symbol_name;
    int name_size;
    char *p;
-   s->tid = SYMBOL;
+
+   if(s != NULL)
+   {
+      return s;
+   }
+   s = alloc_object(SYMBOL);
    for(name_size = 1, p = name;  *p != '\0';
        name_size++, p++);
-   symbol_name = (char *)malloc(name_size);
+   symbol_name = (char *)lisp_alloc(SYMBOL, name_size);
    strcpy(symbol_name, name);
    set_car(s, symbol_name);
-   return s;
+   set_cdr(s, NULL);
+   return add_symbol(s);
 }
 
 bool is_symbol(lispobj *l)
@@ -138,18 +192,61 @@ char *sym_to_string(symbol *s)
    return (char *)(car(s));
 }
 
+/* counts the definitions of the symbol, for caches of its bindings */
+unsigned long symbol_version(symbol *s)
+{
+   return (unsigned long)__atomic_load_n(&s->value[1], __ATOMIC_ACQUIRE);
+}
+
 /* integer */
+enum integer_define
+{
+   NUM_OF_SMALL_INTEGERS = 256
+};
+
+/* integers are never modified, so byte values are shared by every
+ * interpreter and reading them out of a bytevector does not allocate */
+static integer small_integers[NUM_OF_SMALL_INTEGERS];
+static long small_integer_values[NUM_OF_SMALL_INTEGERS];
+static pthread_once_t small_integers_once = PTHREAD_ONCE_INIT;
+
+static void init_small_integers()
+{
+   int x;
+   for(x = 0; x < NUM_OF_SMALL_INTEGERS; ++x)
+   {
+      small_integer_values[x] = x;
+      small_integers[x].tid = INTEGER;
+      small_integers[x].value[0] = &small_integer_values[x];
+      small_integers[x].value[1] = NULL;
+   }
+}
+
 /*@null@*/
-integer *new_integer(int x)
+integer *new_integer_long(long x)
 {
-   integer *i = (integer*)malloc(sizeof(integer));
-   int *p = (int *)malloc(sizeof(int));
-   i->tid = INTEGER;
+   integer *i;
+   long *p;
+
+   if(0 <= x && x < NUM_OF_SMALL_INTEGERS)
+   {
+      pthread_once(&small_integers_once, init_small_integers);
+      return &small_integers[x];
+   }
+
+   i = alloc_object(INTEGER);
+   p = (long *)lisp_alloc(INTEGER, sizeof(long));
    *p = x;
    set_car(i, p);
    return i;
 }
 
+/*@null@*/
+integer *new_integer(int x)
+{
+   return new_integer_long(x);
+}
+
 bool is_integer(integer *i)
 {
    return i == NULL ? 0 : i->tid == INTEGER;
@@ -157,7 +254,12 @@ bool is_integer(integer *i)
 
 int integer_to_int(integer *i)
 {
-   return *(int *)(car(i));
+   return (int)*(long *)(car(i));
+}
+
+long integer_to_long(integer *i)
+{
+   return *(long *)(car(i));
 }
 
 bool equal_integer(integer *l, integer *r)
@@ -165,7 +267,7 @@ bool equal_integer(integer *l, integer *r)
    bool result = 0;
    if(is_integer(l) && is_integer(r))
    {
-      result = integer_to_int(l) == integer_to_int(r);
+      result = integer_to_long(l) == integer_to_long(r);
    }
    return result;
 }
@@ -174,9 +276,8 @@ bool equal_integer(integer *l, integer *r)
 /*@null@*/
 character *new_character(char c)
 {
-   character *chrctr = (character*)malloc(sizeof(character));
-   char *d = (char *)malloc(sizeof(char));
-   chrctr->tid = CHARACTER;
+   character *chrctr = alloc_object(CHARACTER);
+   char *d = (char *)lisp_alloc(CHARACTER, sizeof(char));
    *d = c;
    set_car(chrctr, d);
    set_cdr(chrctr, NULL);
@@ -185,7 +286,7 @@ character *new_character(char c)
 
 bool is_character(character *c)
 {
-   return c->tid == CHARACTER;
+   return c == NULL ? false : c->tid == CHARACTER;
 }
 
 bool equal_character(character *l, character *r)
@@ -203,36 +304,26 @@ char character_to_char(character *c)
 
 bool is_list(lispobj *obj)
 {
-   bool result = false;
-   if(obj == NULL)
+   while(is_cell(obj))
    {
-      result = true;
-   }
-   else if(is_cell(obj))
-   {
-      result = is_list(cdr(obj));
+      obj = cdr(obj);
    }
-   return result;
+   return obj == NULL;
 }
 
 /*@null@*/
 cell *assoc(symbol *s, list *l)
 {
-   cell *result = NULL;
    cell *pair = NULL;
-   if(l != NULL && is_list(l))
+   for(; is_cell(l); l = cdr(l))
    {
       pair = car(l);
       if(generic_equal(s, car(pair)))
       {
-         result = pair;
-      }
-      else
-      {
-         result = assoc(s, cdr(l));
+         return pair;
       }
    }
-   return result;
+   return NULL;
 }
 
 cell *last_cell(list *l)
@@ -241,14 +332,11 @@ cell *last_cell(list *l)
    {
       return NULL;
    }
-   else if(cdr(l) == NULL)
-   {
-      return l;
-   }
-   else
+   while(cdr(l) != NULL)
    {
-      return last_cell(cdr(l));
+      l = cdr(l);
    }
+   return l;
 }
 
 lispobj *append(list *lhs, lispobj *rhs)
@@ -267,42 +355,191 @@ lispobj *append(list *lhs, lispobj *rhs)
       }
    }
 
-   fprintf(stderr,"append error\n");
-   abort();
+   lisp_error("append error");
    return NULL;
 }
 
 int list_length(list *l)
 {
-   return l == NULL ? 0 : 1 + list_length(cdr(l));
+   int n = 0;
+   for(; l != NULL; l = cdr(l))
+   {
+      n++;
+   }
+   return n;
 }
 
 /* string */
+
+/*
+ * car holds the characters, cdr a string_info.  A rope made by
+ * string_append has no characters until string_to_char flattens it.
+ */
+typedef struct string_info
+{
+   int length;
+   unsigned int hash;
+   bool hashed;
+   string *left;
+   string *right;
+} string_info;
+
+enum string_define
+{
+   ROPE_MIN_LENGTH = 256
+};
+
+static string *alloc_string(char *s, int length, string *left, string *right)
+{
+   string *ns = alloc_object(STRING);
+   string_info *info = (string_info *)lisp_alloc(STRING, sizeof(string_info));
+   info->length = length;
+   info->hash = 0;
+   info->hashed = false;
+   info->left = left;
+   info->right = right;
+   set_car(ns, s);
+   set_cdr(ns, info);
+   return ns;
+}
+
 /*@null@*/
 string *new_string(char *s)
 {
-   string *ns = (string*)malloc(sizeof(string));
-   ns->tid = STRING;
-   set_car(ns, s);
-   set_cdr(ns, NULL);
-   return ns;
+   return alloc_string(s, strlen(s), NULL, NULL);
+}
+
+/*@null@*/
+string *new_string_length(char *s, int length)
+{
+   return alloc_string(s, length, NULL, NULL);
 }
 
 bool is_string(lispobj *s)
 {
-   return s->tid == STRING;
+   return s == NULL ? false : s->tid == STRING;
+}
+
+int string_length(string *s)
+{
+   return ((string_info *)cdr(s))->length;
+}
+
+unsigned int string_hash(string *s)
+{
+   string_info *info = cdr(s);
+   if(!info->hashed)
+   {
+      info->hash = hash_bytes(string_to_char(s), info->length);
+      info->hashed = true;
+   }
+   return info->hash;
 }
 
 bool equal_string(string *l, string *r)
 {
-   return strcmp(car(l), car(r)) == 0;
+   string_info *li;
+   string_info *ri;
+
+   if(!is_string(l) || !is_string(r))
+   {
+      return false;
+   }
+
+   li = cdr(l);
+   ri = cdr(r);
+   if(li->length != ri->length)
+   {
+      return false;
+   }
+   else if(li->hashed && ri->hashed && li->hash != ri->hash)
+   {
+      return false;
+   }
+   return memcmp(string_to_char(l), string_to_char(r), li->length) == 0;
 }
 
-char *string_to_char(string *s)
+/*@null@*/
+string *string_append(string *l, string *r)
 {
-   return (char *)car(s);
+   int length = string_length(l) + string_length(r);
+   char *s;
+
+   if(length >= ROPE_MIN_LENGTH)
+   {
+      return alloc_string(NULL, length, l, r);
+   }
+
+   s = (char *)lisp_alloc(STRING, length + 1);
+   memcpy(s, string_to_char(l), string_length(l));
+   memcpy(s + string_length(l), string_to_char(r), string_length(r));
+   s[length] = '\0';
+   return alloc_string(s, length, NULL, NULL);
 }
 
+/* the characters of a flat string, or NULL for a rope; parallel-map
+ * workers may flatten the same rope at once */
+/*@null@*/
+static char *flat_chars(string *s)
+{
+   return (char *)__atomic_load_n(&s->value[0], __ATOMIC_ACQUIRE);
+}
+
+/* ropes grow on the left when built in a loop, so walk them with an
+ * explicit stack rather than recursion.  The characters are published
+ * before the children are dropped, so a rope found without children
+ * has them */
+static void flatten_rope(string *s)
+{
+   string_info *info = cdr(s);
+   char *buf = (char *)lisp_alloc(STRING, info->length + 1);
+   int capacity = 64;
+   string **stack = (string **)malloc(capacity * sizeof(string *));
+   int depth = 0;
+   int pos = 0;
+
+   stack[depth++] = s;
+   while(depth > 0)
+   {
+      string *top = stack[--depth];
+      string_info *ti = cdr(top);
+      char *chars = flat_chars(top);
+      string *left = __atomic_load_n(&ti->left, __ATOMIC_ACQUIRE);
+      string *right = __atomic_load_n(&ti->right, __ATOMIC_ACQUIRE);
+
+      if(chars != NULL || left == NULL || right == NULL)
+      {
+         chars = flat_chars(top);
+         memcpy(buf + pos, chars, ti->length);
+         pos += ti->length;
+      }
+      else
+      {
+         if(depth + 2 > capacity)
+         {
+            capacity *= 2;
+            stack = (string **)realloc(stack, capacity * sizeof(string *));
+         }
+         stack[depth++] = right;
+         stack[depth++] = left;
+      }
+   }
+
+   buf[pos] = '\0';
+   free(stack);
+   set_car(s, buf);
+   __atomic_store_n(&info->left, NULL, __ATOMIC_RELEASE);
+   __atomic_store_n(&info->right, NULL, __ATOMIC_RELEASE);
+}
+
+char *string_to_char(string *s)
+{
+   if(flat_chars(s) == NULL)
+   {
+      flatten_rope(s);
+   }
+   return flat_chars(s);
+}
 
 bool generic_equal(lispobj *l, lispobj *r)
 {
@@ -314,7 +551,7 @@ bool generic_equal(lispobj *l, lispobj *r)
    {
       return false;
    }
-   else if(l->tid == r->tid)
+   else if(l->tid == r->tid && equalf_pointers[l->tid] != NULL)
    {
       return equalf_pointers[l->tid](l, r);
    }
@@ -326,37 +563,56 @@ bool generic_equal(lispobj *l, lispobj *r)
 
 /* environment */
 /*@null@*/
-static list *new_frame(lispobj *vars, list *vals)
+static list *new_frame(lispobj *vars, int argc, lispobj **argv)
 {
    list *result = NULL;
+   cell *tail = NULL;
+   int i = 0;
 
-   if(vars == NULL || vals == NULL)
-   {
-      result = NULL;
-   }
-   else if(is_symbol(vars))
+   while(vars != NULL && i < argc)
    {
-      result = 
-         cons(cons(vars, vals), NULL);
-   }
-   else
-   {
-      lispobj *var = car(vars);
-      lispobj *val = car(vals);
+      cell *binding;
 
-      result = 
-         cons(
-            cons(var, val),
-            new_frame(cdr(vars), cdr(vals)));
-   }
+      if(is_symbol(vars))
+      {
+         /* a rest parameter takes the remaining values */
+         binding = cons(cons(vars, argv_to_list(argc - i, argv + i)), NULL);
+         vars = NULL;
+      }
+      else
+      {
+         binding = cons(cons(car(vars), argv[i]), NULL);
+         vars = cdr(vars);
+         ++i;
+      }
 
+      if(tail == NULL)
+      {
+         result = binding;
+      }
+      else
+      {
+         set_cdr(tail, binding);
+      }
+      tail = binding;
+   }
    return result;
 }
 
 /*@null@*/
 environment *extend_env(list *vars, list *vals, environment *env)
 {
-   return cons(new_frame(vars, vals), env);
+   lispobj *buffer[MAX_STACK_ARGS];
+   int argc;
+   lispobj **argv = list_to_argv(vals, &argc, buffer);
+
+   return cons(new_frame(vars, argc, argv), env);
+}
+
+/*@null@*/
+environment *extend_env_argv(list *vars, int argc, lispobj **argv, environment *env)
+{
+   return cons(new_frame(vars, argc, argv), env);
 }
 
 /*@null@*/
@@ -366,14 +622,28 @@ environment *define_var_val(symbol *var, lispobj *val, environment *env)
    cell *c = NULL;
    if(env == NULL)
    {
-      result = 
-         cons(new_frame(cons(var, NULL), 
-         cons(val, NULL)), env);
+      result = extend_env(cons(var, NULL), cons(val, NULL), env);
    }
    else
    {
-      c = cons(var, val);
-      set_car(env, cons(c, car(env)));
+      /* parallel workers may define into the same frame */
+      cell *frame = cons(cons(var, val), NULL);
+      c = car(env);
+      do
+      {
+         set_cdr(frame, c);
+      }
+      while(!__atomic_compare_exchange_n(&env->value[0], (void **)&c, frame,
+                                         false, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+   }
+   if(is_symbol(var))
+   {
+      /* the new binding may shadow a cached one */
+      __atomic_fetch_add(&var->value[1], 1, __ATOMIC_RELEASE);
+   }
+   if(val != NULL && (is_lambda(val) || is_prim_proc(val)))
+   {
+      profile_name(val, var);
    }
    return env;
 }
@@ -382,13 +652,11 @@ environment *define_var_val(symbol *var, lispobj *val, environment *env)
 cell *lookup_var_val(symbol *var, environment *env)
 {
    cell *result = NULL;
-   if(env != NULL)
+
+   current_interp()->stats.lookups++;
+   for(; env != NULL && result == NULL; env = cdr(env))
    {
-      result = assoc(var, car(env));
-      if(result == NULL)
-      {
-         result = lookup_var_val(var, cdr(env));
-      }
+      result = assoc(var, frame_bindings(car(env)));
    }
    return result;
 }
@@ -405,82 +673,333 @@ environment *set_var_val(
    return env;
 }
 
+static const prim_spec core_prims[] =
+{
+   {"+", proc_plus_integer, 0, -1, {is_integer, is_integer, is_integer}, true},
+   {"-", prim_minus, 1, -1, {is_integer, is_integer, is_integer}, true},
+   {"*", prim_times, 0, -1, {is_integer, is_integer, is_integer}, true},
+   {"quotient", prim_quotient, 2, 2, {is_integer, is_integer}, true},
+   {"remainder", prim_remainder, 2, 2, {is_integer, is_integer}, true},
+   {"=", prim_num_equal, 1, -1, {is_integer, is_integer, is_integer}, true},
+   {"<", prim_less, 1, -1, {is_integer, is_integer, is_integer}, true},
+   {">", prim_greater, 1, -1, {is_integer, is_integer, is_integer}, true},
+   {"<=", prim_less_equal, 1, -1, {is_integer, is_integer, is_integer}, true},
+   {">=", prim_greater_equal, 1, -1, {is_integer, is_integer, is_integer}, true},
+   {"car", prim_car, 1, 1, {is_cell}, true},
+   {"cdr", prim_cdr, 1, 1, {is_cell}, true},
+   {"cons", prim_cons, 2, 2, {NULL}, false},
+   {"list", prim_list, 0, -1, {NULL}, false},
+   {"null?", prim_is_null, 1, 1, {NULL}, true},
+   {"pair?", prim_is_pair, 1, 1, {NULL}, true},
+   {"eq?", prim_is_eq, 2, 2, {NULL}, true},
+   {"not", prim_not, 1, 1, {NULL}, true},
+   {"set-car!", prim_set_car, 2, 2, {is_cell, NULL}, false},
+   {"set-cdr!", prim_set_cdr, 2, 2, {is_cell, NULL}, false},
+   {"print", prim_print, 0, -1, {NULL}, false},
+   {"runtime-stats", prim_runtime_stats, 0, 0, {NULL}, false},
+   {"error", prim_error, 0, -1, {NULL}, false},
+   {"error?", prim_is_error, 1, 1, {NULL}, true},
+   {"error-message", prim_error_message, 1, 1, {is_error}, false},
+   {NULL}
+};
+
+static environment *define_core_syntax(environment *env)
+{
+   define_var_val(new_symbol("begin"), new_syntax(syntax_begin), env);
+   define_var_val(new_symbol("define"), new_syntax(syntax_define), env);
+   define_var_val(new_symbol("lambda"), new_syntax(syntax_lambda), env);
+   define_var_val(new_symbol("quote"), new_syntax(syntax_quote), env);
+   define_var_val(new_symbol(readmacro_symbols[QUASIQUOTE]),
+      new_syntax(syntax_quasiquote), env);
+   define_var_val(new_symbol("defmacro"), new_syntax(syntax_defmacro), env);
+   define_var_val(new_symbol("gequal"), new_syntax(syntax_gequal), env);
+   define_var_val(new_symbol("cond"), new_syntax(syntax_cond), env);
+   define_var_val(new_symbol("if"), new_syntax(syntax_if), env);
+   define_var_val(new_symbol("set!"), new_syntax(syntax_set), env);
+   define_var_val(new_symbol("load"), new_syntax(syntax_load), env);
+   define_var_val(new_symbol("time"), new_syntax(syntax_time), env);
+   define_var_val(new_symbol("with-limits"), new_syntax(syntax_with_limits), env);
+   return env;
+}
+
 /*@null@*/
 environment *new_env()
 {
-   symbol *begin = new_symbol("begin");
-   symbol *define = new_symbol("define");
-   symbol *lambda = new_symbol("lambda");
-   symbol *quote = new_symbol("quote");
-   symbol *plus = new_symbol("+");
-   symbol *symbol_car = new_symbol("car");
-   symbol *symbol_cdr = new_symbol("cdr");
-   symbol *symbol_defmacro = new_symbol("defmacro");
-   symbol *symbol_gequal = new_symbol("gequal");
-   symbol *quasiquote = new_symbol(readmacro_symbols[QUASIQUOTE]);
-   symbol *symbol_cond = new_symbol("cond"); 
-   symbol *symbol_print = new_symbol("print");
-   symbol *symbol_load = new_symbol("load");
-
-   syntax *s_begin = new_syntax(syntax_begin);
-   syntax *s_define = new_syntax(syntax_define);
-   syntax *s_lambda = new_syntax(syntax_lambda);
-   syntax *s_quote = new_syntax(syntax_quote);
-   syntax *s_quasiquote = new_syntax(syntax_quasiquote);
-   syntax *s_defmacro = new_syntax(syntax_defmacro);
-   syntax *s_gequal = new_syntax(syntax_gequal);
-   syntax *s_cond = new_syntax(syntax_cond);
-   syntax *s_load = new_syntax(syntax_load);
-
-   prim_proc *p_plus = new_prim_proc(proc_plus_integer);
-   prim_proc *p_car = new_prim_proc(prim_car);
-   prim_proc *p_cdr = new_prim_proc(prim_cdr);
-   prim_proc *p_print = new_prim_proc(prim_print);
-
-   list *vars = 
-      cons(begin,
-      cons(define,
-      cons(lambda,
-      cons(quote,
-      cons(plus,
-      cons(quasiquote,
-      cons(symbol_car,
-      cons(symbol_cdr,
-      cons(symbol_defmacro,
-      cons(symbol_gequal,
-      cons(symbol_cond,
-      cons(symbol_print,
-      cons(symbol_load,
-      NULL)))))))))))));
-   
-   list *vals =
-      cons(s_begin,
-      cons(s_define,
-      cons(s_lambda,
-      cons(s_quote,
-      cons(p_plus,
-      cons(s_quasiquote,
-      cons(p_car,
-      cons(p_cdr,
-      cons(s_defmacro,
-      cons(s_gequal,
-      cons(s_cond,
-      cons(p_print,
-      cons(s_load,
-      NULL)))))))))))));
-
-   return extend_env(vars, vals, NULL);
+   environment *env = extend_env(NULL, NULL, NULL);
+
+   define_core_syntax(env);
+   define_prims(env, core_prims);
+   define_hash_table_procs(env);
+   define_hamt_procs(env);
+   define_string_procs(env);
+   define_bytevector_procs(env);
+   define_port_procs(env);
+   define_profile_procs(env);
+   define_parallel_procs(env);
+   define_place_procs(env);
+   define_green_procs(env);
+   define_async_procs(env);
+   define_cont_procs(env);
+   return env;
+}
+
+/* error object */
+/*@null@*/
+error_object *new_error(char *message)
+{
+   error_object *e = alloc_object(ERROR_OBJECT);
+   char *m = (char *)lisp_alloc(ERROR_OBJECT, strlen(message) + 1);
+   strcpy(m, message);
+   set_car(e, m);
+   set_cdr(e, NULL);
+   return e;
+}
+
+bool is_error(lispobj *obj)
+{
+   return obj == NULL ? false : obj->tid == ERROR_OBJECT;
+}
+
+char *error_message(error_object *e)
+{
+   return (char *)car(e);
+}
+
+
+/* limits */
+/*
+ * eval_limited sets a guard and narrows the limits.  lisp_raise jumps
+ * back to the innermost guard, which turns the message into an error
+ * object; without a guard it aborts like the other errors.
+ */
+typedef struct eval_guard
+{
+   jmp_buf jump;
+   char message[ERROR_MESSAGE_SIZE];
+   struct eval_guard *outer;
+} eval_guard;
+
+/* the C stack is per thread; evaluation below stack_limit moves to a
+ * stack segment */
+static __thread char *stack_limit = NULL;
+static __thread bool stack_limit_ready = false;
+
+void lisp_raise(char *message)
+{
+   interp *it = current_interp();
+
+   if(it->guard == NULL)
+   {
+      fprintf(stderr, "%s\n", message);
+      abort();
+   }
+   snprintf(it->guard->message, ERROR_MESSAGE_SIZE, "%s", message);
+   longjmp(it->guard->jump, 1);
+}
+
+/* the errors of primitives and syntax, formatted like printf */
+void lisp_error(char *format, ...)
+{
+   char message[ERROR_MESSAGE_SIZE];
+   va_list ap;
+
+   va_start(ap, format);
+   vsnprintf(message, ERROR_MESSAGE_SIZE, format, ap);
+   va_end(ap);
+   lisp_raise(message);
+}
+
+static void init_stack_limit()
+{
+   pthread_attr_t attr;
+   void *low;
+   size_t size;
+
+   stack_limit_ready = true;
+   if(pthread_getattr_np(pthread_self(), &attr) != 0)
+   {
+      return;
+   }
+   if(pthread_attr_getstack(&attr, &low, &size) == 0 && size > STACK_MARGIN)
+   {
+      stack_limit = (char *)low + STACK_MARGIN;
+   }
+   pthread_attr_destroy(&attr);
+}
+
+void check_limits(interp *it)
+{
+   if(it->stats.evals > it->fuel_limit)
+   {
+      lisp_raise("fuel exhausted");
+   }
+   if(it->stats.eval_depth > it->depth_limit)
+   {
+      lisp_raise("recursion too deep");
+   }
+}
+
+/* frames below stack_limit go on a stack segment */
+bool below_stack_limit(char *frame)
+{
+   if(!stack_limit_ready)
+   {
+      init_stack_limit();
+   }
+   return frame < stack_limit;
+}
+
+/* for code switching to a stack of its own; returns the previous limit */
+char *set_stack_limit(char *limit)
+{
+   char *outer;
+
+   if(!stack_limit_ready)
+   {
+      init_stack_limit();
+   }
+   outer = stack_limit;
+   stack_limit = limit;
+   return outer;
+}
+
+/*@null@*/
+lispobj *run_limited(lispobj *(*evaluate)(lispobj *, environment *),
+   lispobj *exp, environment *env, eval_limits *limits)
+{
+   interp *it = current_interp();
+   eval_guard g;
+   long outer_fuel = it->fuel_limit;
+   int outer_depth = it->depth_limit;
+   long outer_heap = it->heap_limit;
+   int eval_depth = it->stats.eval_depth;
+   int shadow_depth = profile_depth();
+   escape_frame *escapes = it->escapes;
+   stack_segment *segments = it->segments;
+   bool at_base = it->stack_base == NULL;
+   lispobj *result = NULL;
+   bool raised;
+
+   if(limits->fuel > 0 && it->stats.evals + limits->fuel < it->fuel_limit)
+   {
+      it->fuel_limit = it->stats.evals + limits->fuel;
+   }
+   if(limits->max_depth > 0 && eval_depth + limits->max_depth < it->depth_limit)
+   {
+      it->depth_limit = eval_depth + limits->max_depth;
+   }
+   if(limits->max_heap_bytes > 0 &&
+      it->alloc_bytes + limits->max_heap_bytes < it->heap_limit)
+   {
+      it->heap_limit = it->alloc_bytes + limits->max_heap_bytes;
+   }
+
+   g.outer = it->guard;
+   it->guard = &g;
+   if(setjmp(g.jump) == 0)
+   {
+      result = at_base ?
+         eval_at_stack_base(evaluate, exp, env) : evaluate(exp, env);
+      raised = false;
+   }
+   else
+   {
+      it->stats.eval_depth = eval_depth;
+      profile_unwind(shadow_depth);
+      unwind_escapes(escapes);
+      unwind_segments(segments);
+      raised = true;
+   }
+   if(at_base)
+   {
+      it->stack_base = NULL;
+   }
+
+   /* the error object is made under the outer limits */
+   it->guard = g.outer;
+   it->fuel_limit = outer_fuel;
+   it->depth_limit = outer_depth;
+   it->heap_limit = outer_heap;
+   return raised ? new_error(g.message) : result;
+}
+
+/* the result is an error object when a limit is exceeded or the
+ * evaluation raised; limits of an outer evaluation still apply */
+/*@null@*/
+lispobj *eval_limited(lispobj *exp, environment *env, eval_limits *limits)
+{
+   return run_limited(eval, exp, env, limits);
+}
+
+void set_toplevel_limits(eval_limits *limits)
+{
+   current_interp()->toplevel_limits = *limits;
+}
+
+
+/* arguments */
+/*@null@*/
+list *argv_to_list(int argc, lispobj **argv)
+{
+   list *result = NULL;
+   int i;
+
+   for(i = argc - 1; i >= 0; --i)
+   {
+      result = cons(argv[i], result);
+   }
+   return result;
+}
+
+/* the elements of l in buffer, or in the heap when there are more than
+ * MAX_STACK_ARGS */
+lispobj **list_to_argv(list *l, int *argc, lispobj **buffer)
+{
+   int n = list_length(l);
+   lispobj **argv = n <= MAX_STACK_ARGS ? buffer : lisp_alloc(CELL, n * sizeof(lispobj *));
+   int i;
+
+   for(i = 0; i < n; ++i, l = cdr(l))
+   {
+      argv[i] = car(l);
+   }
+   *argc = n;
+   return argv;
 }
 
 /* eval */
+static lispobj **values_to_argv(list *exps, environment *env, int *argc, lispobj **buffer)
+{
+   int n = list_length(exps);
+   lispobj **argv = n <= MAX_STACK_ARGS ? buffer : lisp_alloc(CELL, n * sizeof(lispobj *));
+   int i;
+
+   for(i = 0; i < n; ++i, exps = cdr(exps))
+   {
+      argv[i] = eval(car(exps), env);
+   }
+   *argc = n;
+   return argv;
+}
+
 /*@null@*/
 list *list_of_values(list *exps, environment *env)
 {
    list *result = NULL;
-   if(exps != NULL)
+   cell *tail = NULL;
+
+   for(; exps != NULL; exps = cdr(exps))
    {
-      result = cons(eval(car(exps), env), 
-      list_of_values(cdr(exps), env));
+      cell *c = cons(eval(car(exps), env), NULL);
+      if(tail == NULL)
+      {
+         result = c;
+      }
+      else
+      {
+         set_cdr(tail, c);
+      }
+      tail = c;
    }
    return result;
 }
@@ -488,9 +1007,25 @@ list *list_of_values(list *exps, environment *env)
 /*@null@*/
 lispobj *eval(lispobj *exp, environment *env)
 {
+   interp *it = current_interp();
    lispobj *result;
    lispobj *operator;
    list *operands;
+   lispobj *buffer[MAX_STACK_ARGS];
+   lispobj **argv;
+   int argc;
+
+   if(below_stack_limit((char *)__builtin_frame_address(0)))
+   {
+      return eval_on_segment(exp, env);
+   }
+
+   it->stats.evals++;
+   if(++it->stats.eval_depth > it->stats.max_eval_depth)
+   {
+      it->stats.max_eval_depth = it->stats.eval_depth;
+   }
+   check_limits(it);
 
    if(exp == NULL)
    {
@@ -531,13 +1066,18 @@ lispobj *eval(lispobj *exp, environment *env)
 
       if(is_prim_proc(operator))
       {
-         operands = list_of_values(cdr(exp), env);
-         result = apply_prim_proc(operator, operands);
+         argv = values_to_argv(cdr(exp), env, &argc, buffer);
+         result = apply_prim_proc(operator, argc, argv);
       }
       else if(is_lambda(operator))
       {
-         operands = list_of_values(cdr(exp), env);
-         result = apply_lambda(operator, operands);
+         argv = values_to_argv(cdr(exp), env, &argc, buffer);
+         result = apply_lambda(operator, argc, argv);
+      }
+      else if(is_continuation(operator))
+      {
+         apply_continuation(operator, list_of_values(cdr(exp), env));
+         result = NULL;
       }
       else if(is_syntax(operator))
       {
@@ -553,110 +1093,351 @@ lispobj *eval(lispobj *exp, environment *env)
       }
       else
       {
-         fprintf(stderr, "eval error: not applicable\n");
-         abort();
+         lisp_error("eval error: not applicable");
       }
    }
    else
    {
-      fprintf(stderr, "eval error: can not evaluate\n");
-      abort();
+      lisp_error("eval error: can not evaluate");
    }
 
+   it->stats.eval_depth--;
    return result;
 }
 
+/* how an argument failing a type_predicate is described */
+static const struct
+{
+   type_predicate is_type;
+   char *name;
+} type_names[] =
+{
+   {is_integer, "an integer"},
+   {is_cell, "a pair"},
+   {is_symbol, "a symbol"},
+   {is_string, "a string"},
+   {is_error, "an error"},
+   {is_hash_table, "a hash table"},
+   {is_hamt, "a hamt"},
+   {is_string_builder, "a string builder"},
+   {is_bytevector, "a bytevector"},
+   {is_character, "a character"},
+   {is_port, "a port"},
+   {is_channel, "a channel"}
+};
+
+static void check_prim_types(const prim_spec *spec, int argc, lispobj **argv)
+{
+   type_predicate is_type;
+   int i;
+   int j;
+
+   for(i = 0; i < argc; ++i)
+   {
+      is_type = spec->types[i < PRIM_TYPES ? i : PRIM_TYPES - 1];
+      if(is_type != NULL && !is_type(argv[i]))
+      {
+         for(j = 0; j < sizeof(type_names) / sizeof(type_names[0]); ++j)
+         {
+            if(type_names[j].is_type == is_type)
+            {
+               lisp_error("%s error: not %s", spec->name, type_names[j].name);
+            }
+         }
+         lisp_error("%s error: wrong type argument", spec->name);
+      }
+   }
+}
+
 /*@null@*/
-lispobj *apply_prim_proc(prim_proc *proc, list *arg)
+lispobj *apply_prim_proc(prim_proc *proc, int argc, lispobj **argv)
 {
-   lispobj *(*p)(list *) = car(proc);
-   return p(arg);
+   if(!prim_takes(proc, argc))
+   {
+      lisp_error("%s error: arg error", prim_proc_spec(proc)->name);
+   }
+   return call_prim_proc(proc, argc, argv);
+}
+
+/*@null@*/
+lispobj *call_prim_proc(prim_proc *proc, int argc, lispobj **argv)
+{
+   lispobj *(*p)(int, lispobj **) = car(proc);
+   const prim_spec *spec = cdr(proc);
+   lispobj *result;
+
+   if(spec != NULL)
+   {
+      check_prim_types(spec, argc, argv);
+   }
+   profile_enter(proc);
+   result = p(argc, argv);
+   profile_leave();
+   return result;
+}
+
+
+/*@null@*/
+lispobj *apply_procedure(lispobj *proc, list *args)
+{
+   lispobj *buffer[MAX_STACK_ARGS];
+   lispobj **argv;
+   int argc;
+
+   if(proc != NULL && is_prim_proc(proc))
+   {
+      argv = list_to_argv(args, &argc, buffer);
+      return apply_prim_proc(proc, argc, argv);
+   }
+   else if(proc != NULL && is_lambda(proc))
+   {
+      argv = list_to_argv(args, &argc, buffer);
+      return apply_lambda(proc, argc, argv);
+   }
+   else if(proc != NULL && is_continuation(proc))
+   {
+      apply_continuation(proc, args);
+   }
+
+   lisp_error("apply error: not applicable");
+   return NULL;
 }
 
 
 /* primitive procedures */
+/* registered in core_prims, which the arguments are checked against */
+
+/** plus_integers **/
+long plus_integers_to_int(int argc, lispobj **argv)
+{
+   long result = 0;
+   int i;
+
+   for(i = 0; i < argc && is_integer(argv[i]); ++i)
+   {
+      result += integer_to_long(argv[i]);
+   }
+   return result;
+}
+
+/*@null@*/
+integer *proc_plus_integer(int argc, lispobj **argv)
+{
+   return new_integer_long(plus_integers_to_int(argc, argv));
+}
+
+lispobj *prim_car(int argc, lispobj **argv)
+{
+   return car(argv[0]);
+}
+
+lispobj *prim_cdr(int argc, lispobj **argv)
+{
+   return cdr(argv[0]);
+}
+
+boolean *prim_print(int argc, lispobj **argv)
+{
+   if(argc == 0)
+   {
+      return new_boolean(print_sexp(NULL));
+   }
+   else if(argc < 2)
+   {
+      return new_boolean(print_sexp(argv[0]));
+   }
+   else
+   {
+      return new_boolean(print_sexp(argv_to_list(argc, argv)));
+   }
+}
+
+lispobj *prim_minus(int argc, lispobj **argv)
+{
+   long result = integer_to_long(argv[0]);
+   int i;
+
+   if(argc == 1)
+   {
+      return new_integer_long(-result);
+   }
+   for(i = 1; i < argc; ++i)
+   {
+      result -= integer_to_long(argv[i]);
+   }
+   return new_integer_long(result);
+}
+
+lispobj *prim_times(int argc, lispobj **argv)
+{
+   long result = 1;
+   int i;
+
+   for(i = 0; i < argc; ++i)
+   {
+      result *= integer_to_long(argv[i]);
+   }
+   return new_integer_long(result);
+}
+
+lispobj *prim_quotient(int argc, lispobj **argv)
+{
+   long d = integer_to_long(argv[1]);
+
+   if(d == 0)
+   {
+      lisp_error("quotient error: division by zero");
+   }
+   return new_integer_long(integer_to_long(argv[0]) / d);
+}
+
+lispobj *prim_remainder(int argc, lispobj **argv)
+{
+   long d = integer_to_long(argv[1]);
+
+   if(d == 0)
+   {
+      lisp_error("remainder error: division by zero");
+   }
+   return new_integer_long(integer_to_long(argv[0]) % d);
+}
+
+/* true when every adjacent pair of operands is in order */
+static lispobj *compare_integers(int argc, lispobj **argv, int order, bool or_equal)
+{
+   long l = integer_to_long(argv[0]);
+   long r;
+   int i;
+
+   for(i = 1; i < argc; ++i)
+   {
+      r = integer_to_long(argv[i]);
+      if(!((l == r && or_equal) || (order < 0 && l < r) || (0 < order && l > r)))
+      {
+         return new_boolean(false);
+      }
+      l = r;
+   }
+   return new_boolean(true);
+}
+
+lispobj *prim_num_equal(int argc, lispobj **argv)
+{
+   return compare_integers(argc, argv, 0, true);
+}
+
+lispobj *prim_less(int argc, lispobj **argv)
+{
+   return compare_integers(argc, argv, -1, false);
+}
+
+lispobj *prim_greater(int argc, lispobj **argv)
+{
+   return compare_integers(argc, argv, 1, false);
+}
+
+lispobj *prim_less_equal(int argc, lispobj **argv)
+{
+   return compare_integers(argc, argv, -1, true);
+}
+
+lispobj *prim_greater_equal(int argc, lispobj **argv)
+{
+   return compare_integers(argc, argv, 1, true);
+}
+
+lispobj *prim_cons(int argc, lispobj **argv)
+{
+   return cons(argv[0], argv[1]);
+}
+
+lispobj *prim_list(int argc, lispobj **argv)
+{
+   return argv_to_list(argc, argv);
+}
+
+lispobj *prim_is_null(int argc, lispobj **argv)
+{
+   return new_boolean(argv[0] == NULL);
+}
+
+lispobj *prim_is_pair(int argc, lispobj **argv)
+{
+   return new_boolean(is_cell(argv[0]));
+}
+
+/* symbols are not interned, so eq? compares them by name */
+lispobj *prim_is_eq(int argc, lispobj **argv)
+{
+   return new_boolean(equal_eqv(argv[0], argv[1]));
+}
+
+lispobj *prim_not(int argc, lispobj **argv)
+{
+   return new_boolean(!is_true(argv[0]));
+}
+
+lispobj *prim_set_car(int argc, lispobj **argv)
+{
+   set_car(argv[0], argv[1]);
+   return argv[1];
+}
+
+lispobj *prim_set_cdr(int argc, lispobj **argv)
+{
+   set_cdr(argv[0], argv[1]);
+   return argv[1];
+}
 
-/** plus_integers **/
-int plus_integers_to_int(list *integers)
+/* (error message irritant ...) */
+lispobj *prim_error(int argc, lispobj **argv)
 {
-   int result = 0;
-   if(integers != NULL)
+   port *out = open_output_string();
+   int i;
+
+   for(i = 0; i < argc; ++i)
    {
-      if(is_integer(car(integers)))
+      port_write_obj(out, argv[i], is_string(argv[i]));
+      if(i + 1 < argc)
       {
-         result = integer_to_int(car(integers)) 
-            + plus_integers_to_int(cdr(integers));
+         port_putc(out, ' ');
       }
    }
-   return result;
+   lisp_raise(string_to_char(port_output_string(out)));
+   return NULL;
 }
 
-/*@null@*/
-integer *proc_plus_integer(list *integers)
+lispobj *prim_is_error(int argc, lispobj **argv)
 {
-   int result = 0;
-   if(integers != NULL)
-   {
-      result = plus_integers_to_int(integers);
-   }
-   else
-   {
-      fprintf(stderr,"plus error: no arg");
-   }
-
-   return new_integer(result);
+   return new_boolean(is_error(argv[0]));
 }
 
-lispobj *prim_car(lispobj *operands)
+lispobj *prim_error_message(int argc, lispobj **argv)
 {
-   if(operands == NULL)
-   {
-      fprintf(stderr,"car error: operands == NULL");
-      abort();
-   }
-   else if(list_length(operands) != 1)
-   {
-      fprintf(stderr,"car error: arg error ");
-      abort();
-   }
-   else
-   {
-      return car(car(operands));
-   }
+   return new_string(error_message(argv[0]));
 }
 
-lispobj *prim_cdr(lispobj *operands)
+static lispobj *stats_pair(char *name, long value)
 {
-   if(operands == NULL)
-   {
-      fprintf(stderr,"cdr error: operands == NULL");
-      abort();
-   }
-   else if(list_length(operands) != 1)
-   {
-      fprintf(stderr,"cdr error: arg error ");
-      abort();
-   }
-   else
-   {
-      return cdr(car(operands));
-   }
+   return cons(new_symbol(name), new_integer_long(value));
 }
 
-boolean *prim_print(lispobj *operands)
+/* the counts are taken before the result is allocated */
+lispobj *prim_runtime_stats(int argc, lispobj **argv)
 {
-   if(operands == NULL)
-   {
-      return new_boolean(print_sexp(operands));
-   }
-   else if(list_length(operands) < 2)
-   {
-      return new_boolean(print_sexp(car(operands)));
-   }
-   else
+   runtime_stats *stats = get_runtime_stats();
+   long values[] = {wall_usec(), cpu_usec(), object_count(), alloc_count(),
+      alloc_bytes(), stats->evals, stats->lookups, stats->max_eval_depth};
+   char *names[] = {"real-us", "cpu-us", "objects", "allocations",
+      "bytes", "evals", "lookups", "max-depth"};
+   list *result = NULL;
+   int i;
+
+   for(i = sizeof(values) / sizeof(long) - 1; i >= 0; --i)
    {
-      return new_boolean(print_sexp(operands));
+      result = cons(stats_pair(names[i], values[i]), result);
    }
+   return result;
 }
 
 
@@ -666,20 +1447,57 @@ int is_prim_proc(lispobj *obj)
 }
 
 /*@null@*/
-prim_proc *new_prim_proc(lispobj *(*p)(list *))
+prim_proc *new_prim_proc(lispobj *(*p)(int, lispobj **))
 {
-   prim_proc *proc = (prim_proc*)malloc(sizeof(prim_proc));
-   proc->tid = PRIM_PROC;
+   prim_proc *proc = alloc_object(PRIM_PROC);
    set_car(proc, (void*)p);
+   set_cdr(proc, NULL);
+
+   return proc;
+}
+
+/* the spec is kept, not copied; the tables are static */
+/*@null@*/
+prim_proc *new_prim(const prim_spec *spec)
+{
+   prim_proc *proc = new_prim_proc(spec->proc);
+   set_cdr(proc, (void *)spec);
 
    return proc;
 }
 
+/*@null@*/
+const prim_spec *prim_proc_spec(prim_proc *proc)
+{
+   return cdr(proc);
+}
+
+bool prim_takes(prim_proc *proc, int argc)
+{
+   const prim_spec *spec = cdr(proc);
+   return spec == NULL ||
+      (spec->min_args <= argc && (spec->max_args < 0 || argc <= spec->max_args));
+}
+
+bool is_pure_prim(lispobj *obj)
+{
+   return obj != NULL && is_prim_proc(obj) && cdr(obj) != NULL &&
+      prim_proc_spec(obj)->pure;
+}
+
+environment *define_prims(environment *env, const prim_spec *specs)
+{
+   for(; specs->name != NULL; ++specs)
+   {
+      define_var_val(new_symbol(specs->name), new_prim(specs), env);
+   }
+   return env;
+}
+
 /*@null@*/
 syntax *new_syntax(lispobj *(*p)(list *,environment *))
 {
-   syntax *s = (syntax *)malloc(sizeof(syntax));
-   s->tid = SYNTAX;
+   syntax *s = alloc_object(SYNTAX);
    set_car(s, (void*)p);
 
    return s;
@@ -721,8 +1539,7 @@ boolean *syntax_gequal(list *operands, environment *env)
 {
    if(list_length(operands) != 2)
    {
-      fprintf(stderr, "gequal error\n");
-      abort();
+      lisp_error("gequal error");
    }
    else
    {
@@ -750,49 +1567,73 @@ lispobj *syntax_load(list *operands, environment *env)
 
 
 
+static bool is_readmacro(lispobj *obj, int macro)
+{
+   return is_symbol(obj) && strcmp(sym_to_string(obj), readmacro_symbols[macro]) == 0;
+}
+
+/* loops along the cdrs, so only nesting in the cars takes C stack */
 lispobj *evaluate_quasiquote(lispobj *exp, environment *env)
 {
-   if(exp == NULL)
-   {
-      return NULL;
-   }
-   else if(is_cell(exp))
+   list *result = NULL;
+   cell *tail = NULL;
+   lispobj *rest;
+
+   while(is_cell(exp) &&
+         !is_readmacro(car(exp), UNQUOTE) && !is_readmacro(car(exp), UNQUOTE_SPLICING))
    {
-      lispobj *obj = car(exp);
-      if(obj == NULL)
-      {
-         return cons(NULL, evaluate_quasiquote(cdr(exp), env));
-      }
-      else if(is_symbol(obj) && strcmp(sym_to_string(obj), readmacro_symbols[UNQUOTE]) == 0)
-      {
-         return eval(car(cdr(exp)), env);
-      }
-      else if(is_symbol(obj) && strcmp(sym_to_string(obj), readmacro_symbols[UNQUOTE_SPLICING]) == 0)
+      lispobj *evaluated_car = evaluate_quasiquote(car(exp), env);
+      list *elements;
+
+      if(is_cell(evaluated_car) && is_readmacro(car(evaluated_car), UNQUOTE_SPLICING))
       {
-         return cons(obj, eval(car(cdr(exp)), env));
+         /* spliced in place, as append does */
+         elements = cdr(evaluated_car);
+         if(!is_list(elements))
+         {
+            lisp_error("append error");
+         }
       }
       else
       {
-         lispobj *evaluated_car = evaluate_quasiquote(car(exp), env);
+         elements = cons(evaluated_car, NULL);
+      }
 
-         if(
-            evaluated_car != NULL && 
-            is_cell(evaluated_car) && 
-            is_symbol(car(evaluated_car)) &&
-            strcmp(sym_to_string(car(evaluated_car)), readmacro_symbols[UNQUOTE_SPLICING]) == 0)
+      if(elements != NULL)
+      {
+         cell *last = last_cell(elements);
+         if(tail == NULL)
          {
-            return append(cdr(evaluated_car), evaluate_quasiquote(cdr(exp), env));
+            result = elements;
          }
          else
          {
-            return cons(evaluated_car, evaluate_quasiquote(cdr(exp), env));
+            set_cdr(tail, elements);
          }
+         tail = last;
       }
+      exp = cdr(exp);
+   }
+
+   if(!is_cell(exp))
+   {
+      rest = exp;
+   }
+   else if(is_readmacro(car(exp), UNQUOTE))
+   {
+      rest = eval(car(cdr(exp)), env);
    }
    else
    {
-      return exp;
+      rest = cons(car(exp), eval(car(cdr(exp)), env));
+   }
+
+   if(tail == NULL)
+   {
+      return rest;
    }
+   set_cdr(tail, rest);
+   return result;
 }
 
 lispobj *syntax_quasiquote(list *operands, environment *env)
@@ -826,15 +1667,10 @@ lispobj *syntax_begin(list *exp, environment *env)
    {
       fprintf(stderr, "begin error\n");
    }
-   else if(cdr(exp) == NULL)
+   for(; exp != NULL; exp = cdr(exp))
    {
       result = eval(car(exp), env);
    }
-   else
-   {
-      eval(car(exp), env);
-      result = syntax_begin(cdr(exp), env);
-   }
    return result;
 }
 
@@ -855,45 +1691,145 @@ lispobj *syntax_lambda(list *exp, environment *env)
 
 lispobj *syntax_cond(list *exp, environment *env)
 {
-   if(exp == NULL || !is_cell(exp))
+   for(;; exp = cdr(exp))
    {
-      fprintf(stderr, "cond error\n");
-      abort();
+      lispobj *cond;
+      lispobj *sexp;
+
+      if(exp == NULL || !is_cell(exp))
+      {
+         lisp_error("cond error");
+      }
+
+      cond = car(car(exp));
+      sexp = car(cdr(car(exp)));
+      if((is_symbol(cond) && strcmp(sym_to_string(cond), "else") == 0) ||
+         is_true(eval(cond, env)))
+      {
+         return eval(sexp, env);
+      }
    }
+}
 
-   lispobj *cond = car(car(exp));
-   lispobj *sexp = car(cdr(car(exp)));
+lispobj *syntax_if(list *exp, environment *env)
+{
+   int n = list_length(exp);
 
-   if(strcmp(sym_to_string(cond), "else") == 0 ||
-   is_true(eval(cond, env)))
+   if(n != 2 && n != 3)
    {
-      return eval(sexp, env);
+      lisp_error("if error");
    }
-   else
+
+   if(is_true(eval(car(exp), env)))
+   {
+      return eval(car(cdr(exp)), env);
+   }
+   else if(n == 3)
+   {
+      return eval(car(cdr(cdr(exp))), env);
+   }
+   return new_boolean(false);
+}
+
+lispobj *syntax_set(list *exp, environment *env)
+{
+   lispobj *val;
+
+   if(list_length(exp) != 2 || !is_symbol(car(exp)))
+   {
+      lisp_error("set! error");
+   }
+   if(lookup_var_val(car(exp), env) == NULL)
+   {
+      lisp_error("set! error: unbound variable %s", sym_to_string(car(exp)));
+   }
+
+   val = eval(car(cdr(exp)), env);
+   set_var_val(car(exp), val, env);
+   return val;
+}
+
+/* evaluates the body like begin and prints what it cost */
+lispobj *syntax_time(list *exp, environment *env)
+{
+   runtime_stats *stats = get_runtime_stats();
+   long wall = wall_usec();
+   long cpu = cpu_usec();
+   long objects = object_count();
+   long lookups = stats->lookups;
+   int outer_max_depth = stats->max_eval_depth;
+   lispobj *result;
+
+   stats->max_eval_depth = stats->eval_depth;
+   result = syntax_begin(exp, env);
+   port_printf(current_output_port(),
+      "time: real %.3f ms, cpu %.3f ms, %ld objects, %ld lookups, depth %d\n",
+      (wall_usec() - wall) / 1000.0, (cpu_usec() - cpu) / 1000.0,
+      object_count() - objects, stats->lookups - lookups,
+      stats->max_eval_depth - stats->eval_depth);
+
+   if(stats->max_eval_depth < outer_max_depth)
    {
-      return syntax_cond(cdr(exp), env);
+      stats->max_eval_depth = outer_max_depth;
    }
+   return result;
+}
+
+static long limit_operand(lispobj *obj)
+{
+   if(!is_integer(obj) || integer_to_long(obj) < 0)
+   {
+      lisp_raise("with-limits error: a limit is not a non negative integer");
+   }
+   return integer_to_long(obj);
+}
+
+/* (with-limits (fuel depth heap-bytes) body ...), 0 is no limit */
+lispobj *syntax_with_limits(list *exp, environment *env)
+{
+   eval_limits limits;
+   list *values;
+
+   if(exp == NULL || list_length(car(exp)) != 3 || cdr(exp) == NULL)
+   {
+      lisp_raise("with-limits error");
+   }
+   values = list_of_values(car(exp), env);
+   limits.fuel = limit_operand(car(values));
+   limits.max_depth = limit_operand(car(cdr(values)));
+   limits.max_heap_bytes = limit_operand(car(cdr(cdr(values))));
+   return run_limited(syntax_begin, cdr(exp), env, &limits);
 }
 
 /* lambda */
 /*@null@*/
 lambda *new_lambda(list *arg_body, environment *env)
 {
-   lambda *l = (lambda *)malloc(sizeof(lambda));
-   l->tid = LAMBDA;
+   lambda *l = alloc_object(LAMBDA);
    set_car(l, arg_body);
    set_cdr(l, env);
    return l;
 }
 
 /*@null@*/
-lispobj *apply_lambda(lambda *l, list *vals)
+lispobj *apply_lambda(lambda *l, int argc, lispobj **argv)
 {
-   list *vars = car(car(l));
-   list *body = cdr(car(l));
+   /* parallel workers may analyze the body at once; the code is
+    * published whole */
+   list *arg_body = __atomic_load_n(&l->value[0], __ATOMIC_ACQUIRE);
    environment *env = cdr(l);
-   env = extend_env(vars, vals, env);
-   return syntax_begin(body, env);
+   lispobj *result;
+
+   if(cdr(arg_body) == NULL || !is_code(cdr(arg_body)))
+   {
+      arg_body = analyze_lambda(arg_body, env);
+      __atomic_store_n(&l->value[0], arg_body, __ATOMIC_RELEASE);
+   }
+   profile_enter(l);
+   env = extend_env_argv(car(arg_body), argc, argv, env);
+   result = run_code(cdr(arg_body), env);
+   profile_leave();
+   return result;
 }
 
 bool is_lambda(lispobj *l)
@@ -927,8 +1863,7 @@ char *wordtail(char *exp)
 {
    if(exp == NULL)
    {
-      fprintf(stderr, "wordtail null\n");
-      abort();
+      lisp_error("wordtail null");
    }
 
    if(
@@ -958,8 +1893,7 @@ char *stringtail(char *exp)
       (exp == NULL) ||
       (exp[0] == '\0'))
    {
-      fprintf(stderr, "string error\n");
-      abort();
+      lisp_error("string error");
    }
 
    if(exp[0] == '"')
@@ -1079,9 +2013,10 @@ list *expand_readmacro(list *tokens)
 {
    int index;
    list *result = NULL;
-   if(tokens == NULL)
+   if(!is_cell(tokens))
    {
-      return result;
+      /* a symbol keeps its version in the cdr */
+      return tokens;
    }
 
    if(index_of_equal_string(car(tokens), special_chars, sizeof(special_chars)/sizeof(char*), &index))
@@ -1106,7 +2041,7 @@ int print_token(list *tokens)
    if(tokens != NULL)
    {
       s = car(tokens);
-      printf("%s\n", s);
+      port_printf(current_output_port(), "%s\n", s);
       print_token(cdr(tokens));
    }
    return 1;
@@ -1125,6 +2060,7 @@ bool has_any_pointers(char *s, char **pointers, int size)
    return false;
 }
 
+/* the words are malloc'd; the cells belong to the heap like any other */
 int delete_tokens(list *tokens)
 {
    if(tokens != NULL)
@@ -1140,7 +2076,6 @@ int delete_tokens(list *tokens)
       }
 
       delete_tokens(cdr(tokens));
-      free(tokens);
    }
    return 1;
 }
@@ -1222,6 +2157,10 @@ bool string_is_num(char *s)
 {
    int i;
    int result = 1;
+   if(s[0] == '-' && s[1] != '\0')
+   {
+      s++;
+   }
    for(i = 0; s[i] != '\0'; ++i)
    {
       if(!char_is_num(s[i]))
@@ -1241,7 +2180,7 @@ char *stringtoken_to_cstring(char *exp)
    char *cs;
 
    for(size = 0; exp[size] != '\0'; ++size){};
-   cs = (char *)malloc(sizeof(char)*size);
+   cs = (char *)lisp_alloc(STRING, sizeof(char)*size);
 
    if(exp[0] == '"')
    {
@@ -1308,7 +2247,7 @@ lispobj *new_lispobj(char *exp)
 {
    if(string_is_num(exp))
    {
-      return new_integer(atoi(exp));
+      return new_integer_long(atol(exp));
    }
    else if(
       (strcmp(exp, "#t") == 0) || 
@@ -1403,83 +2342,76 @@ list *read_listtokens(list *tokens, cell *tail)
 
 bool print_cell(cell* c, bool is_list_head)
 {
+   port *out = current_output_port();
    lispobj *first;
    lispobj *second;
 
    if(c == NULL)
    {
-      fprintf(stderr, "cell is NULL\n");
-      abort();
+      lisp_error("cell is NULL");
    }
 
    if(is_list_head)
    {
-      printf("(");
+      port_putc(out, '(');
    }
 
-   first = car(c);
-   second = cdr(c);
-
-   if(first == NULL)
-   {
-      printf("'() ");
-   }
-   else if(is_cell(first))
-   {
-      print_cell(first, true);
-   }
-   else
+   for(;; c = second)
    {
-      print_lispobj(first);
-   }
+      first = car(c);
+      second = cdr(c);
 
-   if(second == NULL)
-   {
-      printf(")");
-   }
-   else if(is_cell(second))
-   {
-      print_cell(second, false);
-   }
-   else
-   {
-      printf(". ");
-      print_lispobj(second);
-      printf(")");
+      if(first == NULL)
+      {
+         port_write(out, "'() ", 4);
+      }
+      else if(is_cell(first))
+      {
+         print_cell(first, true);
+      }
+      else
+      {
+         print_lispobj(first);
+      }
+
+      if(second == NULL)
+      {
+         port_putc(out, ')');
+         break;
+      }
+      else if(!is_cell(second))
+      {
+         port_write(out, ". ", 2);
+         print_lispobj(second);
+         port_putc(out, ')');
+         break;
+      }
    }
    return true;
 }
 
 bool print_lispobj(lispobj *obj)
 {
-   if(is_symbol(obj))
-   {
-      printf("%s ", sym_to_string(obj));
-   }
-   else if(is_integer(obj))
-   {
-      printf("%d ", integer_to_int(obj));
-   }
-   else if(is_boolean(obj))
-   {
-      printf("%s ", (*((bool*)car(obj)))? "#t" : "#f");
-   }
-   else if(is_string(obj))
+   port *out = current_output_port();
+   if(is_string(obj))
    {
-      puts((char *)string_to_char(obj));
+      port_write(out, string_to_char(obj), string_length(obj));
+      port_putc(out, '\n');
    }
    else
    {
-      printf("typeid=%d ", obj->tid);
+      port_write_obj(out, obj, false);
+      port_putc(out, ' ');
    }
    return true;
 }
 
 bool print_sexp(lispobj *obj)
 {
+   port *out = current_output_port();
    if(obj == NULL)
    {
-      printf("'()");
+      port_write(out, "'()", 3);
    }
    else if(is_cell(obj))
    {
@@ -1489,7 +2421,7 @@ bool print_sexp(lispobj *obj)
    {
       print_lispobj(obj);
    }
-   printf("\n");
+   port_putc(out, '\n');
    return true;
 }
 
@@ -1497,12 +2429,12 @@ bool print_tokens(list *l)
 {
    if(l == NULL)
    {
-      printf("\n");
+      port_putc(current_output_port(), '\n');
       return true;
    }
    else
    {
-      printf("%s ", (char*)car(l));
+      port_printf(current_output_port(), "%s ", (char*)car(l));
       return print_tokens(cdr(l));
    }
 }
@@ -1510,8 +2442,7 @@ bool print_tokens(list *l)
 /*MACRO*/
 macro *new_macro(list *arg, list *body)
 {
-   macro *m = (macro *)malloc(sizeof(macro));
-   m->tid = MACRO;
+   macro *m = alloc_object(MACRO);
    set_car(m, arg);
    set_cdr(m, body);
    return m;
@@ -1565,9 +2496,8 @@ bool is_true(lispobj *obj)
 
 boolean* new_boolean(bool b)
 {
-   boolean *nwbln = (boolean*)malloc(sizeof(boolean));
-   bool *nwb = (bool *)malloc(sizeof(bool));
-   nwbln->tid = BOOLEAN;
+   boolean *nwbln = alloc_object(BOOLEAN);
+   bool *nwb = (bool *)lisp_alloc(BOOLEAN, sizeof(bool));
    *nwb = b;
    set_car(nwbln, nwb);
    return nwbln;
@@ -1589,69 +2519,212 @@ bool equal_boolean(boolean *lhs, boolean *rhs)
    }
 }
 
+/* the next datum of in or the eof object, read under a guard like the
+ * evaluation, as reading raises when in ends inside a datum */
+static lispobj *read_datum(lispobj *in, environment *env)
+{
+   lispobj *datum;
+   return port_read_datum(in, &datum) ? datum : eof_object();
+}
+
 bool repl()
 {
-   char buf[256];
    environment *env = new_env();
+   port *in = current_input_port();
+   port *out = current_output_port();
+   eval_limits no_limits = {0, 0, 0};
    lispobj *obj_in;
    lispobj *obj_out;
-   list *tokens;
 
-   while(printf("> ") && fgets(buf, 256, stdin))
+   for(;;)
    {
-      tokens = tokenize(buf);
-      if(tokens != NULL)
+      port_write(out, "> ", 2);
+      obj_in = run_limited(read_datum, in, env, &no_limits);
+      if(is_eof_object(obj_in))
       {
-         tokens = expand_readmacro(tokens);
-         obj_in = read_tokens(tokens);
-         obj_out = eval(obj_in, env);
-         print_sexp(obj_out);
+         break;
       }
-      printf("\n");
+      obj_out = is_error(obj_in) ? obj_in :
+         eval_limited(obj_in, env, &current_interp()->toplevel_limits);
+      print_sexp(obj_out);
+      port_putc(out, '\n');
    }
+   port_flush(out);
    return true;
 }
 
 lispobj* load_file(char *filepath, environment *env)
 {
-   FILE *fp = fopen(filepath, "r");
-   char buf[BUFSIZ] = {0};
-   list *tokens = cons("(", cons("begin", NULL));
-   list *objs;
-
-   if(fp == NULL)
-   {
-      fprintf(stderr, "fopen error");
-      abort();
-   }
+   port *in = open_input_file(filepath);
+   eval_limits no_limits = {0, 0, 0};
+   lispobj *obj = NULL;
+   lispobj *result = NULL;
 
-   while(fgets(buf, BUFSIZ, fp))
+   for(;;)
    {
-      append(tokens,tokenize(buf));
+      obj = run_limited(read_datum, in, env, &no_limits);
+      if(is_eof_object(obj))
+      {
+         break;
+      }
+      result = is_error(obj) ? obj :
+         eval_limited(obj, env, &current_interp()->toplevel_limits);
+      if(is_error(result))
+      {
+         fprintf(stderr, "%s: %s\n", filepath, error_message(result));
+         break;
+      }
    }
+   port_close(in);
 
-   append(tokens, tokenize(")"));
-   tokens = expand_readmacro(tokens);
-   objs = read_tokens(tokens);
-   objs = eval(objs, env);
+   return result;
+}
 
-   fclose(fp);
 
-   return objs;
+#ifdef __MAIN__
+static double elapsed_ms(struct timespec *start)
+{
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+   return (now.tv_sec - start->tv_sec) * 1000.0 +
+      (now.tv_nsec - start->tv_nsec) / 1000000.0;
 }
 
+/* one line of json on stderr, read by bench/run.sh */
+static void print_stats(struct timespec *start)
+{
+   struct rusage usage;
+
+   port_flush_all();
+   getrusage(RUSAGE_SELF, &usage);
+   fprintf(stderr,
+      "{\"wall_ms\": %.3f, \"user_ms\": %.3f, \"sys_ms\": %.3f, "
+      "\"max_rss_kb\": %ld, \"objects\": %ld, \"allocations\": %ld, "
+      "\"alloc_bytes\": %ld, \"evals\": %ld, \"lookups\": %ld, "
+      "\"max_depth\": %d}\n",
+      elapsed_ms(start),
+      usage.ru_utime.tv_sec * 1000.0 + usage.ru_utime.tv_usec / 1000.0,
+      usage.ru_stime.tv_sec * 1000.0 + usage.ru_stime.tv_usec / 1000.0,
+      usage.ru_maxrss, object_count(), alloc_count(), alloc_bytes(),
+      get_runtime_stats()->evals, get_runtime_stats()->lookups,
+      get_runtime_stats()->max_eval_depth);
+}
 
-#ifdef __MAIN__
 int main(int argc, char **argv)
 {
-   if(argc == 2)
+   struct timespec start;
+   bool stats = false;
+   bool profile = false;
+   char *profile_path = NULL;
+   int heap_period = 0;
+   eval_limits limits = {0, 0, 0};
+   int status = 0;
+   char *filepath = NULL;
+   char *serve_path = NULL;
+   int i;
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for(i = 1; i < argc; ++i)
+   {
+      if(strcmp(argv[i], "--stats") == 0)
+      {
+         stats = true;
+      }
+      else if(strcmp(argv[i], "--profile") == 0)
+      {
+         profile = true;
+      }
+      else if(strncmp(argv[i], "--profile=", 10) == 0)
+      {
+         profile = true;
+         profile_path = argv[i] + 10;
+      }
+      else if(strncmp(argv[i], "--fuel=", 7) == 0)
+      {
+         limits.fuel = atol(argv[i] + 7);
+      }
+      else if(strncmp(argv[i], "--max-depth=", 12) == 0)
+      {
+         limits.max_depth = atoi(argv[i] + 12);
+      }
+      else if(strncmp(argv[i], "--max-heap=", 11) == 0)
+      {
+         limits.max_heap_bytes = atol(argv[i] + 11);
+      }
+      else if(strcmp(argv[i], "--serve") == 0 && i + 1 < argc)
+      {
+         serve_path = argv[++i];
+      }
+      else if(strcmp(argv[i], "--client") == 0 && i + 1 < argc)
+      {
+         /* the rest of the arguments are requests */
+         return scheme_client(argv[i + 1], argv + i + 2, argc - i - 2);
+      }
+      else if(strcmp(argv[i], "--heap-profile") == 0)
+      {
+         heap_period = 1;
+      }
+      else if(strncmp(argv[i], "--heap-profile=", 15) == 0)
+      {
+         heap_period = atoi(argv[i] + 15);
+         if(heap_period < 1)
+         {
+            fprintf(stderr, "scheme: bad --heap-profile period\n");
+            return 1;
+         }
+      }
+      else
+      {
+         filepath = argv[i];
+      }
+   }
+
+   if(profile && !profile_start(profile_path))
+   {
+      return 1;
+   }
+   if(heap_period > 0)
+   {
+      heap_profile_start(heap_period);
+   }
+   set_toplevel_limits(&limits);
+
+   if(serve_path != NULL)
+   {
+      /* the file is the prelude, loaded once */
+      scheme *sc = scheme_open();
+      scheme_use(sc);
+      scheme_set_limits(sc, &limits);
+      if(filepath != NULL && is_error(load_file(filepath, sc->global_env)))
+      {
+         status = 1;
+      }
+      else
+      {
+         status = scheme_serve(sc, serve_path);
+      }
+   }
+   else if(filepath != NULL)
    {
-      load_file(argv[1], new_env());
+      status = is_error(load_file(filepath, new_env())) ? 1 : 0;
    }
    else
    {
       repl();
    }
-   return 0;
+
+   if(profile)
+   {
+      profile_stop();
+   }
+   if(heap_period > 0)
+   {
+      heap_profile_report(stderr);
+   }
+   if(stats)
+   {
+      print_stats(&start);
+   }
+   return status;
 }
 #endif
@@ -2,13 +2,24 @@
 #define _LISPOBJ_H_
 
 #include <stdbool.h>
-
+#include <stddef.h>
 
 enum lispobj_define
 {
-   NUM_OF_VALUES = 2
+   NUM_OF_VALUES = 2,
+   ERROR_MESSAGE_SIZE = 256,
+   STACK_MARGIN = 256 * 1024,
+   MAX_STACK_ARGS = 16      /* arguments passed in an array on the C stack */
 };
 
+typedef enum type_id 
+{
+   SYMBOL, CELL, INTEGER, CHARACTER, BOOLEAN, STRING,
+   SYNTAX, MACRO, PRIM_PROC, LAMBDA, HASH_TABLE, HAMT,
+   BYTEVECTOR, PORT, EOF_OBJECT, ERROR_OBJECT, CHANNEL, TASK,
+   CONTINUATION, CODE, NUM_OF_TYPES
+} type_id;
+
 typedef struct lispobj
 {
       int tid;
@@ -16,6 +27,25 @@ typedef struct lispobj
 } lispobj;
 
 
+/* allocation */
+lispobj *alloc_object(int tid);
+void *lisp_alloc(int tid, size_t size);
+long alloc_count();
+long alloc_bytes();
+long object_count();
+
+/* runtime statistics */
+typedef struct runtime_stats
+{
+   long evals;
+   long lookups;
+   int eval_depth;
+   int max_eval_depth;
+} runtime_stats;
+runtime_stats *get_runtime_stats();
+long wall_usec();
+long cpu_usec();
+
 /* cell */
 typedef lispobj cell;
 void *car(cell *c);
@@ -32,13 +62,16 @@ symbol *new_symbol(char *name);
 bool equal_symbol(symbol *l, symbol *r);
 bool is_symbol(lispobj *l);
 char *sym_to_string(symbol *s);
+unsigned long symbol_version(symbol *s);
 
 /* integer */
 typedef lispobj integer;
 integer *new_integer(int x);
+integer *new_integer_long(long x);
 bool is_integer(integer *i);
 bool equal_integer(integer *l, integer *r);
 int integer_to_int(integer *i);
+long integer_to_long(integer *i);
 
 /* char */
 typedef lispobj character;
@@ -51,15 +84,20 @@ char character_to_char(character *c);
 typedef lispobj list;
 bool is_list(lispobj *obj);
 cell *assoc(symbol *s, list *l);
+/*@null@*/ cell *last_cell(list *l);
 list *append(list *lhs, lispobj *rhs);
 int list_length(list *l);
 
 /* string */
 typedef list string;
 string *new_string(char *s);
+string *new_string_length(char *s, int length);
 bool is_string(lispobj *s);
 bool equal_string(string *l, string *r);
 char *string_to_char(string *s);
+int string_length(string *s);
+unsigned int string_hash(string *s);
+string *string_append(string *l, string *r);
 
 
 /* generic func */
@@ -68,14 +106,42 @@ bool generic_equal(lispobj *l, lispobj *r);
 /* environment */
 typedef list environment;
 environment *extend_env(list *vars, list *vals, environment* env);
+environment *extend_env_argv(list *vars, int argc, lispobj **argv, environment *env);
 environment *define_var_val(symbol *var, lispobj *val, environment* env);
 environment *set_var_val(symbol *var, lispobj *val, environment* env);
 cell *lookup_var_val(symbol *var, environment *env);
 environment *new_env();
 
+/* arguments, passed to procedures as an array and a count */
+list *argv_to_list(int argc, lispobj **argv);
+lispobj **list_to_argv(list *l, int *argc, lispobj **buffer);
+
 /* eval */
 list *list_of_values(lispobj *exps, environment *env);
 lispobj *eval(lispobj *exp, environment *env);
+lispobj *apply_procedure(lispobj *proc, list *args);
+
+/* error object */
+typedef lispobj error_object;
+error_object *new_error(char *message);
+bool is_error(lispobj *obj);
+char *error_message(error_object *e);
+void lisp_raise(char *message) __attribute__((noreturn));
+void lisp_error(char *format, ...) __attribute__((noreturn, format(printf, 1, 2)));
+
+/* evaluation limits, 0 is no limit */
+typedef struct eval_limits
+{
+   long fuel;              /* evals */
+   int max_depth;          /* nested evals */
+   long max_heap_bytes;    /* bytes allocated */
+} eval_limits;
+lispobj *eval_limited(lispobj *exp, environment *env, eval_limits *limits);
+lispobj *run_limited(lispobj *(*evaluate)(lispobj *, environment *),
+   lispobj *exp, environment *env, eval_limits *limits);
+void set_toplevel_limits(eval_limits *limits);
+char *set_stack_limit(char *limit);
+bool below_stack_limit(char *frame);
 
 /*boolean*/
 typedef lispobj boolean;
@@ -85,14 +151,69 @@ bool equal_boolean(boolean *lhs, boolean *rhs);
 bool is_true(lispobj *obj);
 
 /* primitive procedures */
+/*
+ * A primitive is registered with its name, the numbers of arguments it
+ * takes (max_args < 0 for no limit), a predicate for each of the first
+ * PRIM_TYPES arguments, the last one also for the arguments after them
+ * (NULL takes anything), and whether it is pure: no effects, and a result
+ * that depends on the arguments alone and is not a new mutable object,
+ * so a call on constants may be computed ahead.  apply_prim_proc checks
+ * the arguments against all this before proc is called.
+ */
+enum { PRIM_TYPES = 3 };
+typedef bool (*type_predicate)(lispobj *obj);
+typedef struct prim_spec
+{
+   char *name;
+   lispobj *(*proc)(int argc, lispobj **argv);
+   int min_args;
+   int max_args;
+   type_predicate types[PRIM_TYPES];
+   bool pure;
+} prim_spec;
+
 typedef lispobj prim_proc;
-prim_proc *new_prim_proc(lispobj *(*p)(list *));
+prim_proc *new_prim_proc(lispobj *(*p)(int, lispobj **));
+prim_proc *new_prim(const prim_spec *spec);
 int is_prim_proc(lispobj *obj);
-lispobj *apply_prim_proc(prim_proc *proc, list *arg);
-integer *proc_plus_integer(list *integers);
-lispobj *prim_car(lispobj *operands);
-lispobj *prim_cdr(lispobj *operands);
-boolean *prim_print(lispobj *operands);
+
+/* NULL for a primitive made by new_prim_proc, which checks its own
+ * arguments */
+/*@null@*/ const prim_spec *prim_proc_spec(prim_proc *proc);
+bool prim_takes(prim_proc *proc, int argc);
+bool is_pure_prim(lispobj *obj);
+
+/* defines the primitives of specs, up to an entry without a name */
+environment *define_prims(environment *env, const prim_spec *specs);
+lispobj *apply_prim_proc(prim_proc *proc, int argc, lispobj **argv);
+
+/* for a caller that knows prim_takes(proc, argc) */
+lispobj *call_prim_proc(prim_proc *proc, int argc, lispobj **argv);
+integer *proc_plus_integer(int argc, lispobj **argv);
+lispobj *prim_car(int argc, lispobj **argv);
+lispobj *prim_cdr(int argc, lispobj **argv);
+boolean *prim_print(int argc, lispobj **argv);
+lispobj *prim_minus(int argc, lispobj **argv);
+lispobj *prim_times(int argc, lispobj **argv);
+lispobj *prim_quotient(int argc, lispobj **argv);
+lispobj *prim_remainder(int argc, lispobj **argv);
+lispobj *prim_num_equal(int argc, lispobj **argv);
+lispobj *prim_less(int argc, lispobj **argv);
+lispobj *prim_greater(int argc, lispobj **argv);
+lispobj *prim_less_equal(int argc, lispobj **argv);
+lispobj *prim_greater_equal(int argc, lispobj **argv);
+lispobj *prim_cons(int argc, lispobj **argv);
+lispobj *prim_list(int argc, lispobj **argv);
+lispobj *prim_is_null(int argc, lispobj **argv);
+lispobj *prim_is_pair(int argc, lispobj **argv);
+lispobj *prim_is_eq(int argc, lispobj **argv);
+lispobj *prim_not(int argc, lispobj **argv);
+lispobj *prim_set_car(int argc, lispobj **argv);
+lispobj *prim_set_cdr(int argc, lispobj **argv);
+lispobj *prim_runtime_stats(int argc, lispobj **argv);
+lispobj *prim_error(int argc, lispobj **argv);
+lispobj *prim_is_error(int argc, lispobj **argv);
+lispobj *prim_error_message(int argc, lispobj **argv);
 
 /* syntax */
 typedef lispobj syntax;
@@ -110,11 +231,15 @@ lispobj *syntax_unquote(list *operands, environment *env);
 boolean *syntax_gequal(list *operands, environment *env);
 lispobj *syntax_cond(list *operands, environment *env);
 lispobj *syntax_load(list *operands, environment *env);
+lispobj *syntax_if(list *operands, environment *env);
+lispobj *syntax_set(list *operands, environment *env);
+lispobj *syntax_time(list *operands, environment *env);
+lispobj *syntax_with_limits(list *operands, environment *env);
 
 /* lambda */
 typedef lispobj lambda;
 lambda *new_lambda(list *arg_body, environment *env);
-lispobj *apply_lambda(lambda *l, list *arg);
+lispobj *apply_lambda(lambda *l, int argc, lispobj **argv);
 bool is_lambda(lispobj *l);
 
 bool char_is_num(char c);
@@ -0,0 +1,245 @@
+
+#include "lispstring.h"
+#include "port.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/* strbuf */
+void strbuf_init(strbuf *b)
+{
+   b->data = NULL;
+   b->length = 0;
+   b->capacity = 0;
+}
+
+void strbuf_reserve(strbuf *b, int length)
+{
+   int capacity = b->capacity == 0 ? 64 : b->capacity;
+
+   while(capacity < length + 1)
+   {
+      capacity *= 2;
+   }
+
+   if(capacity != b->capacity)
+   {
+      b->data = (char *)realloc(b->data, capacity);
+      if(b->data == NULL)
+      {
+         fprintf(stderr, "strbuf error: out of memory\n");
+         abort();
+      }
+      b->capacity = capacity;
+   }
+}
+
+void strbuf_append(strbuf *b, const char *s, int length)
+{
+   strbuf_reserve(b, b->length + length);
+   memcpy(b->data + b->length, s, length);
+   b->length += length;
+   b->data[b->length] = '\0';
+}
+
+void strbuf_putc(strbuf *b, char c)
+{
+   strbuf_append(b, &c, 1);
+}
+
+void strbuf_clear(strbuf *b)
+{
+   b->length = 0;
+   if(b->data != NULL)
+   {
+      b->data[0] = '\0';
+   }
+}
+
+void strbuf_free(strbuf *b)
+{
+   free(b->data);
+   strbuf_init(b);
+}
+
+/* string builder */
+/* a builder is an output string port, appending displays the object */
+/*@null@*/
+string_builder *new_string_builder()
+{
+   return open_output_string();
+}
+
+bool is_string_builder(lispobj *obj)
+{
+   return is_output_port(obj) && is_string_port(obj);
+}
+
+string_builder *string_builder_append(string_builder *sb, lispobj *obj)
+{
+   port_write_obj(sb, obj, true);
+   return sb;
+}
+
+/*@null@*/
+string *string_builder_to_string(string_builder *sb)
+{
+   return port_output_string(sb);
+}
+
+/*@null@*/
+static string *copy_to_string(const char *s, int length)
+{
+   char *chars = (char *)lisp_alloc(STRING, length + 1);
+   memcpy(chars, s, length);
+   chars[length] = '\0';
+   return new_string_length(chars, length);
+}
+
+
+
+/* primitive procedures */
+/* registered in string_prims, which the arguments are checked against */
+static int index_operand(lispobj *obj, int limit, char *name)
+{
+   if(integer_to_long(obj) < 0 || limit < integer_to_long(obj))
+   {
+      lisp_error("%s error: index out of range", name);
+   }
+   return integer_to_int(obj);
+}
+
+lispobj *prim_is_string(int argc, lispobj **argv)
+{
+   return new_boolean(is_string(argv[0]));
+}
+
+lispobj *prim_string_length(int argc, lispobj **argv)
+{
+   return new_integer(string_length(argv[0]));
+}
+
+lispobj *prim_string_append(int argc, lispobj **argv)
+{
+   string *result;
+   int i;
+
+   if(argc == 0)
+   {
+      return copy_to_string("", 0);
+   }
+
+   result = argv[0];
+   for(i = 1; i < argc; ++i)
+   {
+      result = string_append(result, argv[i]);
+   }
+   return result;
+}
+
+lispobj *prim_string_ref(int argc, lispobj **argv)
+{
+   string *s = argv[0];
+   int k = index_operand(argv[1], string_length(s) - 1, "string-ref");
+
+   return new_character(string_to_char(s)[k]);
+}
+
+lispobj *prim_substring(int argc, lispobj **argv)
+{
+   string *s = argv[0];
+   int end = string_length(s);
+   int start = index_operand(argv[1], end, "substring");
+
+   if(argc > 2)
+   {
+      end = index_operand(argv[2], end, "substring");
+   }
+   if(end < start)
+   {
+      lisp_error("substring error: index out of range");
+   }
+   return copy_to_string(string_to_char(s) + start, end - start);
+}
+
+lispobj *prim_string_equal(int argc, lispobj **argv)
+{
+   int i;
+
+   for(i = 1; i < argc; ++i)
+   {
+      if(!equal_string(argv[0], argv[i]))
+      {
+         return new_boolean(false);
+      }
+   }
+   return new_boolean(true);
+}
+
+lispobj *prim_number_to_string(int argc, lispobj **argv)
+{
+   char num[32];
+
+   return copy_to_string(num, sprintf(num, "%ld", integer_to_long(argv[0])));
+}
+
+lispobj *prim_symbol_to_string(int argc, lispobj **argv)
+{
+   char *name = sym_to_string(argv[0]);
+
+   return copy_to_string(name, strlen(name));
+}
+
+lispobj *prim_string_to_symbol(int argc, lispobj **argv)
+{
+   return new_symbol(string_to_char(argv[0]));
+}
+
+lispobj *prim_make_string_builder(int argc, lispobj **argv)
+{
+   return new_string_builder();
+}
+
+lispobj *prim_string_builder_append(int argc, lispobj **argv)
+{
+   string_builder *sb = argv[0];
+   int i;
+
+   for(i = 1; i < argc; ++i)
+   {
+      string_builder_append(sb, argv[i]);
+   }
+   return sb;
+}
+
+lispobj *prim_string_builder_to_string(int argc, lispobj **argv)
+{
+   return string_builder_to_string(argv[0]);
+}
+
+static const prim_spec string_prims[] =
+{
+   {"string?", prim_is_string, 1, 1, {NULL}, true},
+   {"string-length", prim_string_length, 1, 1, {is_string}, true},
+   {"string-append", prim_string_append, 0, -1,
+      {is_string, is_string, is_string}, true},
+   {"string-ref", prim_string_ref, 2, 2, {is_string, is_integer}, true},
+   {"substring", prim_substring, 2, 3, {is_string, is_integer, is_integer}, true},
+   {"string=?", prim_string_equal, 1, -1,
+      {is_string, is_string, is_string}, true},
+   {"number->string", prim_number_to_string, 1, 1, {is_integer}, true},
+   {"symbol->string", prim_symbol_to_string, 1, 1, {is_symbol}, true},
+   {"string->symbol", prim_string_to_symbol, 1, 1, {is_string}, true},
+   {"make-string-builder", prim_make_string_builder, 0, 0, {NULL}, false},
+   {"string-builder-append!", prim_string_builder_append, 1, -1,
+      {is_string_builder, NULL}, false},
+   {"string-builder->string", prim_string_builder_to_string, 1, 1,
+      {is_string_builder}, false},
+   {NULL}
+};
+
+environment *define_string_procs(environment *env)
+{
+   return define_prims(env, string_prims);
+}
@@ -0,0 +1,44 @@
+#ifndef _LISPSTRING_H_
+#define _LISPSTRING_H_
+
+#include <stdbool.h>
+#include "lispobj.h"
+
+/* growable character buffer */
+typedef struct strbuf
+{
+   char *data;
+   int length;
+   int capacity;
+} strbuf;
+
+void strbuf_init(strbuf *b);
+void strbuf_reserve(strbuf *b, int length);
+void strbuf_append(strbuf *b, const char *s, int length);
+void strbuf_putc(strbuf *b, char c);
+void strbuf_clear(strbuf *b);
+void strbuf_free(strbuf *b);
+
+/* string builder */
+typedef lispobj string_builder;
+string_builder *new_string_builder();
+bool is_string_builder(lispobj *obj);
+string_builder *string_builder_append(string_builder *sb, lispobj *obj);
+string *string_builder_to_string(string_builder *sb);
+
+/* primitive procedures */
+lispobj *prim_is_string(int argc, lispobj **argv);
+lispobj *prim_string_length(int argc, lispobj **argv);
+lispobj *prim_string_append(int argc, lispobj **argv);
+lispobj *prim_string_ref(int argc, lispobj **argv);
+lispobj *prim_substring(int argc, lispobj **argv);
+lispobj *prim_string_equal(int argc, lispobj **argv);
+lispobj *prim_number_to_string(int argc, lispobj **argv);
+lispobj *prim_symbol_to_string(int argc, lispobj **argv);
+lispobj *prim_string_to_symbol(int argc, lispobj **argv);
+lispobj *prim_make_string_builder(int argc, lispobj **argv);
+lispobj *prim_string_builder_append(int argc, lispobj **argv);
+lispobj *prim_string_builder_to_string(int argc, lispobj **argv);
+environment *define_string_procs(environment *env);
+
+#endif
@@ -0,0 +1,464 @@
+#include "parallel.h"
+#include "interp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+
+typedef struct task
+{
+   int begin;
+   int end;
+} task;
+
+/* Chase-Lev: the owner pushes and pops at bottom, thieves take from top */
+typedef struct deque
+{
+   long top;
+   long bottom;
+   task *buffer[PARALLEL_DEQUE_SIZE];
+} deque;
+
+typedef struct job
+{
+   lispobj *proc;
+   lispobj **items;
+   lispobj **results;
+   int grain;                 /* ranges this long are not split */
+   task *tasks;
+   int tasks_size;
+   int tasks_used;
+   /*@null@*/ task *root;     /* until a worker takes it */
+   int remaining;             /* elements not done yet */
+   bool failed;
+   interp **children;         /* one per worker */
+   int left;                  /* workers done with the job */
+} job;
+
+typedef struct worker
+{
+   pthread_t thread;
+   int id;
+   unsigned int seed;
+   deque tasks;
+} worker;
+
+static struct
+{
+   int size;
+   worker *workers;
+   pthread_mutex_t submit;    /* one job at a time */
+   pthread_mutex_t lock;
+   pthread_cond_t wake;
+   pthread_cond_t done;
+   long epoch;                /* bumped for every job */
+   /*@null@*/ job *job;
+} pool = {0, NULL, PTHREAD_MUTEX_INITIALIZER, PTHREAD_MUTEX_INITIALIZER,
+          PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, NULL};
+
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static __thread worker *self = NULL;
+
+
+/* deque */
+static bool deque_push(deque *d, task *t)
+{
+   long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED);
+   long top = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+
+   if(b - top >= PARALLEL_DEQUE_SIZE)
+   {
+      return false;
+   }
+   __atomic_store_n(&d->buffer[b & (PARALLEL_DEQUE_SIZE - 1)], t, __ATOMIC_RELAXED);
+   __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELEASE);
+   return true;
+}
+
+/*@null@*/
+static task *deque_pop(deque *d)
+{
+   long b = __atomic_load_n(&d->bottom, __ATOMIC_RELAXED) - 1;
+   long t;
+   task *x = NULL;
+
+   __atomic_store_n(&d->bottom, b, __ATOMIC_RELAXED);
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   t = __atomic_load_n(&d->top, __ATOMIC_RELAXED);
+   if(t <= b)
+   {
+      x = __atomic_load_n(&d->buffer[b & (PARALLEL_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+      if(t == b)
+      {
+         /* the last one, a thief may be taking it too */
+         if(!__atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+         {
+            x = NULL;
+         }
+         __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+      }
+   }
+   else
+   {
+      __atomic_store_n(&d->bottom, b + 1, __ATOMIC_RELAXED);
+   }
+   return x;
+}
+
+/*@null@*/
+static task *deque_steal(deque *d)
+{
+   long t = __atomic_load_n(&d->top, __ATOMIC_ACQUIRE);
+   long b;
+   task *x;
+
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   b = __atomic_load_n(&d->bottom, __ATOMIC_ACQUIRE);
+   if(t >= b)
+   {
+      return NULL;
+   }
+   x = __atomic_load_n(&d->buffer[t & (PARALLEL_DEQUE_SIZE - 1)], __ATOMIC_RELAXED);
+   if(!__atomic_compare_exchange_n(&d->top, &t, t + 1, false,
+                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+   {
+      return NULL;
+   }
+   return x;
+}
+
+
+/* workers */
+/*@null@*/
+static task *new_task(job *j, int begin, int end)
+{
+   int k = __atomic_fetch_add(&j->tasks_used, 1, __ATOMIC_RELAXED);
+   if(k >= j->tasks_size)
+   {
+      return NULL;
+   }
+   j->tasks[k].begin = begin;
+   j->tasks[k].end = end;
+   return &j->tasks[k];
+}
+
+/*@null@*/
+static task *steal(worker *w)
+{
+   int start;
+   int k;
+
+   w->seed = w->seed * 1103515245 + 12345;
+   start = (w->seed >> 16) % pool.size;
+   for(k = 0; k < pool.size; ++k)
+   {
+      worker *victim = &pool.workers[(start + k) % pool.size];
+      task *t;
+      if(victim != w && (t = deque_steal(&victim->tasks)) != NULL)
+      {
+         return t;
+      }
+   }
+   return NULL;
+}
+
+static lispobj *apply_one(lispobj *item, environment *env)
+{
+   return apply_procedure(pool.job->proc, cons(item, NULL));
+}
+
+static void run_task(worker *w, job *j, task *t)
+{
+   eval_limits no_limits = {0, 0, 0};
+   int begin = t->begin;
+   int end = t->end;
+   int i;
+
+   while(end - begin > j->grain)
+   {
+      int middle = begin + (end - begin) / 2;
+      task *rest = new_task(j, middle, end);
+      if(rest == NULL || !deque_push(&w->tasks, rest))
+      {
+         break;
+      }
+      end = middle;
+   }
+
+   for(i = begin; i < end && !__atomic_load_n(&j->failed, __ATOMIC_RELAXED); ++i)
+   {
+      j->results[i] = run_limited(apply_one, j->items[i], NULL, &no_limits);
+      if(is_error(j->results[i]))
+      {
+         __atomic_store_n(&j->failed, true, __ATOMIC_RELAXED);
+      }
+   }
+   __atomic_sub_fetch(&j->remaining, end - begin, __ATOMIC_ACQ_REL);
+}
+
+static void run_job(worker *w, job *j)
+{
+   interp *outer = set_current_interp(j->children[w->id]);
+   int spins = 0;
+
+   while(__atomic_load_n(&j->remaining, __ATOMIC_ACQUIRE) > 0)
+   {
+      task *t = deque_pop(&w->tasks);
+      if(t == NULL)
+      {
+         t = __atomic_exchange_n(&j->root, NULL, __ATOMIC_ACQ_REL);
+      }
+      if(t == NULL)
+      {
+         t = steal(w);
+      }
+      if(t == NULL)
+      {
+         if(++spins >= PARALLEL_SPINS)
+         {
+            sched_yield();
+            spins = 0;
+         }
+         continue;
+      }
+      spins = 0;
+      run_task(w, j, t);
+   }
+   set_current_interp(outer);
+}
+
+static void *work(void *arg)
+{
+   worker *w = (worker *)arg;
+   long seen = 0;
+
+   self = w;
+   for(;;)
+   {
+      job *j;
+
+      pthread_mutex_lock(&pool.lock);
+      while(pool.epoch == seen)
+      {
+         pthread_cond_wait(&pool.wake, &pool.lock);
+      }
+      seen = pool.epoch;
+      j = pool.job;
+      pthread_mutex_unlock(&pool.lock);
+
+      run_job(w, j);
+
+      pthread_mutex_lock(&pool.lock);
+      if(++j->left == pool.size)
+      {
+         pthread_cond_signal(&pool.done);
+      }
+      pthread_mutex_unlock(&pool.lock);
+   }
+   return NULL;
+}
+
+static void start_pool()
+{
+   char *threads = getenv("SCHEME_THREADS");
+   int i;
+
+   pool.size = threads != NULL ? atoi(threads) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+   if(pool.size < 1)
+   {
+      pool.size = 1;
+   }
+   if(pool.size > PARALLEL_MAX_THREADS)
+   {
+      pool.size = PARALLEL_MAX_THREADS;
+   }
+   if(pool.size == 1)
+   {
+      return;
+   }
+
+   pool.workers = (worker *)calloc(pool.size, sizeof(worker));
+   if(pool.workers == NULL)
+   {
+      fprintf(stderr, "parallel error: out of memory\n");
+      abort();
+   }
+   for(i = 0; i < pool.size; ++i)
+   {
+      pool.workers[i].id = i;
+      pool.workers[i].seed = i + 1;
+      if(pthread_create(&pool.workers[i].thread, NULL, work, &pool.workers[i]) != 0)
+      {
+         fprintf(stderr, "parallel error: can not start a thread\n");
+         abort();
+      }
+      pthread_detach(pool.workers[i].thread);
+   }
+}
+
+int parallel_threads()
+{
+   pthread_once(&pool_once, start_pool);
+   return pool.size;
+}
+
+
+/* jobs */
+static void sequential(lispobj *proc, lispobj **items, lispobj **results, int n)
+{
+   int i;
+
+   for(i = 0; i < n; ++i)
+   {
+      results[i] = apply_procedure(proc, cons(items[i], NULL));
+   }
+}
+
+/* the results of applying proc to every item, in order */
+static void apply_all(lispobj *proc, lispobj **items, lispobj **results, int n)
+{
+   interp *it = current_interp();
+   job j;
+   int i;
+
+   if(n < 2 || self != NULL || parallel_threads() < 2)
+   {
+      sequential(proc, items, results, n);
+      return;
+   }
+
+   memset(&j, 0, sizeof(j));
+   j.proc = proc;
+   j.items = items;
+   j.results = results;
+   j.grain = n / (pool.size * PARALLEL_TASKS_PER_THREAD);
+   if(j.grain < 1)
+   {
+      j.grain = 1;
+   }
+   /* halves are never shorter than grain / 2, so this is enough */
+   j.tasks_size = 2 * (n / j.grain) + 2;
+   j.tasks = (task *)malloc(j.tasks_size * sizeof(task));
+   j.children = (interp **)malloc(pool.size * sizeof(interp *));
+   if(j.tasks == NULL || j.children == NULL)
+   {
+      fprintf(stderr, "parallel error: out of memory\n");
+      abort();
+   }
+   j.tasks[0].begin = 0;
+   j.tasks[0].end = n;
+   j.tasks_used = 1;
+   j.root = &j.tasks[0];
+   j.remaining = n;
+
+   pthread_mutex_lock(&pool.submit);
+   for(i = 0; i < pool.size; ++i)
+   {
+      j.children[i] = new_child_interp(it);
+   }
+   pthread_mutex_lock(&pool.lock);
+   pool.job = &j;
+   pool.epoch++;
+   pthread_cond_broadcast(&pool.wake);
+   while(j.left < pool.size)
+   {
+      pthread_cond_wait(&pool.done, &pool.lock);
+   }
+   pool.job = NULL;
+   pthread_mutex_unlock(&pool.lock);
+   pthread_mutex_unlock(&pool.submit);
+
+   for(i = 0; i < pool.size; ++i)
+   {
+      merge_interp(it, j.children[i]);
+   }
+   free(j.tasks);
+   free(j.children);
+
+   if(j.failed)
+   {
+      for(i = 0; !is_error(results[i]); ++i);
+      lisp_raise(error_message(results[i]));
+   }
+}
+
+static lispobj **to_array(list *items, int n)
+{
+   lispobj **a = (lispobj **)lisp_alloc(CELL, n * sizeof(lispobj *));
+   int i;
+
+   for(i = 0; i < n; ++i, items = cdr(items))
+   {
+      a[i] = car(items);
+   }
+   return a;
+}
+
+/*@null@*/
+list *parallel_map(lispobj *proc, list *items)
+{
+   int n = list_length(items);
+   lispobj **a = to_array(items, n);
+   lispobj **results = (lispobj **)lisp_alloc(CELL, n * sizeof(lispobj *));
+   list *result = NULL;
+   int i;
+
+   memset(results, 0, n * sizeof(lispobj *));
+   apply_all(proc, a, results, n);
+   for(i = n - 1; i >= 0; --i)
+   {
+      result = cons(results[i], result);
+   }
+   return result;
+}
+
+void parallel_for_each(lispobj *proc, list *items)
+{
+   parallel_map(proc, items);
+}
+
+
+/* primitive procedures */
+static void check_operands(int argc, lispobj **argv, char *name)
+{
+   lispobj *proc = argv[0];
+
+   if(proc == NULL || !(is_lambda(proc) || is_prim_proc(proc)))
+   {
+      lisp_error("%s error: not a procedure", name);
+   }
+   if(!is_list(argv[1]))
+   {
+      lisp_error("%s error: not a list", name);
+   }
+}
+
+/*@null@*/
+lispobj *prim_parallel_map(int argc, lispobj **argv)
+{
+   check_operands(argc, argv, "parallel-map");
+   return parallel_map(argv[0], argv[1]);
+}
+
+/*@null@*/
+lispobj *prim_parallel_for_each(int argc, lispobj **argv)
+{
+   check_operands(argc, argv, "parallel-for-each");
+   parallel_for_each(argv[0], argv[1]);
+   return NULL;
+}
+
+static const prim_spec parallel_prims[] =
+{
+   {"parallel-map", prim_parallel_map, 2, 2, {NULL}, false},
+   {"parallel-for-each", prim_parallel_for_each, 2, 2, {NULL}, false},
+   {NULL}
+};
+
+environment *define_parallel_procs(environment *env)
+{
+   return define_prims(env, parallel_prims);
+}
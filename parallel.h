@@ -0,0 +1,37 @@
+#ifndef _PARALLEL_H_
+#define _PARALLEL_H_
+
+#include "lispobj.h"
+
+enum parallel_define
+{
+   PARALLEL_MAX_THREADS = 64,
+   PARALLEL_DEQUE_SIZE = 256,        /* power of two */
+   PARALLEL_TASKS_PER_THREAD = 8,    /* chunks a list is cut into, per worker */
+   PARALLEL_SPINS = 64               /* failed steals before yielding */
+};
+
+/*
+ * A fixed pool of worker threads, one per processor or SCHEME_THREADS,
+ * started on first use.  Each worker owns a Chase-Lev deque of index
+ * ranges: it splits its range in halves, pushing the upper ones, until
+ * a range is small enough to apply the procedure to, and takes more from
+ * the bottom of its deque; idle workers steal from the top of others'.
+ *
+ * A worker evaluates in a child interpreter of the caller's, see
+ * new_child_interp, so allocation takes no lock.  The results are put
+ * back in the order of the list.  If any application fails the rest are
+ * skipped and the error of the first failed element is raised.
+ *
+ * Called from a worker, the procedures run sequentially.
+ */
+int parallel_threads();
+list *parallel_map(lispobj *proc, list *items);
+void parallel_for_each(lispobj *proc, list *items);
+
+/* primitive procedures */
+lispobj *prim_parallel_map(int argc, lispobj **argv);
+lispobj *prim_parallel_for_each(int argc, lispobj **argv);
+environment *define_parallel_procs(environment *env);
+
+#endif
@@ -0,0 +1,755 @@
+#include "place.h"
+#include "interp.h"
+#include "lispstring.h"
+#include "bytevector.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <pthread.h>
+
+/* a deep copy, outside of any heap */
+typedef struct message
+{
+   int length;
+   char data[];
+} message;
+
+typedef struct slot
+{
+   long sequence;
+   /*@null@*/ message *msg;
+} slot;
+
+/*
+ * Bounded MPMC ring after Vyukov: a slot is free for the put at
+ * position pos when its sequence is pos, and full for the get at pos
+ * when it is pos + 1.  head and tail sit on cache lines of their own.
+ */
+typedef struct queue
+{
+   long head;                 /* next position to get */
+   char head_pad[64 - sizeof(long)];
+   long tail;                 /* next position to put */
+   char tail_pad[64 - sizeof(long)];
+   long mask;
+   int refs;                  /* channel ends and messages holding it */
+   int waiters;
+   pthread_mutex_t lock;      /* only to sleep on */
+   pthread_cond_t changed;
+   slot slots[];
+} queue;
+
+typedef struct place_data
+{
+   int refs;                  /* the place object and the thread */
+   pthread_t thread;
+   bool joined;
+   queue *in;                 /* the place's end */
+   queue *out;
+   /*@null@*/ message *body;  /* (ch body ...) until the place starts */
+   /*@null@*/ message *result;
+   bool failed;               /* result is the error message */
+   bool finished;             /* set once result is, wakes the waiters */
+} place_data;
+
+typedef struct endpoint
+{
+   queue *in;
+   queue *out;
+   /*@null@*/ place_data *place;   /* set in the place object only */
+} endpoint;
+
+static __thread place_data *running = NULL;
+
+static void release_message(message *m);
+
+
+/* queue */
+static queue *new_queue(int capacity)
+{
+   long size = 1;
+   queue *q;
+   long i;
+
+   while(size < capacity)
+   {
+      size *= 2;
+   }
+   q = (queue *)calloc(1, sizeof(queue) + size * sizeof(slot));
+   if(q == NULL)
+   {
+      fprintf(stderr, "channel error: out of memory\n");
+      abort();
+   }
+   for(i = 0; i < size; ++i)
+   {
+      q->slots[i].sequence = i;
+   }
+   q->mask = size - 1;
+   q->refs = 1;
+   pthread_mutex_init(&q->lock, NULL);
+   pthread_cond_init(&q->changed, NULL);
+   return q;
+}
+
+static queue *retain_queue(queue *q)
+{
+   __atomic_add_fetch(&q->refs, 1, __ATOMIC_RELAXED);
+   return q;
+}
+
+static bool try_put(queue *q, message **m)
+{
+   long pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+
+   for(;;)
+   {
+      slot *s = &q->slots[pos & q->mask];
+      long dif = __atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE) - pos;
+      if(dif == 0)
+      {
+         if(__atomic_compare_exchange_n(&q->tail, &pos, pos + 1, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+         {
+            s->msg = *m;
+            __atomic_store_n(&s->sequence, pos + 1, __ATOMIC_RELEASE);
+            return true;
+         }
+      }
+      else if(dif < 0)
+      {
+         return false;
+      }
+      else
+      {
+         pos = __atomic_load_n(&q->tail, __ATOMIC_RELAXED);
+      }
+   }
+}
+
+static bool try_get(queue *q, message **m)
+{
+   long pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+
+   for(;;)
+   {
+      slot *s = &q->slots[pos & q->mask];
+      long dif = __atomic_load_n(&s->sequence, __ATOMIC_ACQUIRE) - (pos + 1);
+      if(dif == 0)
+      {
+         if(__atomic_compare_exchange_n(&q->head, &pos, pos + 1, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+         {
+            *m = s->msg;
+            __atomic_store_n(&s->sequence, pos + q->mask + 1, __ATOMIC_RELEASE);
+            return true;
+         }
+      }
+      else if(dif < 0)
+      {
+         return false;
+      }
+      else
+      {
+         pos = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+      }
+   }
+}
+
+static void release_queue(queue *q)
+{
+   message *m;
+
+   if(__atomic_sub_fetch(&q->refs, 1, __ATOMIC_ACQ_REL) > 0)
+   {
+      return;
+   }
+   while(try_get(q, &m))
+   {
+      release_message(m);
+   }
+   pthread_mutex_destroy(&q->lock);
+   pthread_cond_destroy(&q->changed);
+   free(q);
+}
+
+/* spins a while, then sleeps until the other side has put or got;
+ * false when it has finished instead, if finished is given */
+static bool wait_for(queue *q, bool (*op)(queue *, message **), message **m,
+                     /*@null@*/ bool *finished)
+{
+   int spins;
+   bool done = false;
+   bool over;
+
+   for(spins = 0; !done; ++spins)
+   {
+      /* read before the last try, so what was sent before is seen */
+      over = finished != NULL && __atomic_load_n(finished, __ATOMIC_ACQUIRE);
+      if((done = op(q, m)) || over)
+      {
+         break;
+      }
+      if(spins < CHANNEL_SPINS)
+      {
+         sched_yield();
+         continue;
+      }
+      pthread_mutex_lock(&q->lock);
+      __atomic_add_fetch(&q->waiters, 1, __ATOMIC_SEQ_CST);
+      if(!(done = op(q, m)) &&
+         !(finished != NULL && __atomic_load_n(finished, __ATOMIC_ACQUIRE)))
+      {
+         pthread_cond_wait(&q->changed, &q->lock);
+      }
+      __atomic_sub_fetch(&q->waiters, 1, __ATOMIC_SEQ_CST);
+      pthread_mutex_unlock(&q->lock);
+   }
+
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   if(__atomic_load_n(&q->waiters, __ATOMIC_RELAXED) > 0)
+   {
+      pthread_mutex_lock(&q->lock);
+      pthread_cond_broadcast(&q->changed);
+      pthread_mutex_unlock(&q->lock);
+   }
+   return done;
+}
+
+static void wake_all(queue *q)
+{
+   pthread_mutex_lock(&q->lock);
+   pthread_cond_broadcast(&q->changed);
+   pthread_mutex_unlock(&q->lock);
+}
+
+/* messages */
+/* tags: n () i integer c character t f booleans p pair, then car and
+ * cdr; s string, y symbol, e error and v bytevector are followed by a
+ * length and the bytes; h channel by its two queues */
+static void encode_bytes(strbuf *b, char tag, const char *data, int length)
+{
+   strbuf_putc(b, tag);
+   strbuf_append(b, (const char *)&length, sizeof(length));
+   strbuf_append(b, data, length);
+}
+
+static bool encode(strbuf *b, lispobj *obj)
+{
+   while(is_cell(obj))
+   {
+      strbuf_putc(b, 'p');
+      if(!encode(b, car(obj)))
+      {
+         return false;
+      }
+      obj = cdr(obj);
+   }
+
+   if(obj == NULL)
+   {
+      strbuf_putc(b, 'n');
+   }
+   else if(is_integer(obj))
+   {
+      long v = integer_to_long(obj);
+      strbuf_putc(b, 'i');
+      strbuf_append(b, (const char *)&v, sizeof(v));
+   }
+   else if(is_character(obj))
+   {
+      strbuf_putc(b, 'c');
+      strbuf_putc(b, character_to_char(obj));
+   }
+   else if(is_boolean(obj))
+   {
+      strbuf_putc(b, is_true(obj) ? 't' : 'f');
+   }
+   else if(is_string(obj))
+   {
+      encode_bytes(b, 's', string_to_char(obj), string_length(obj));
+   }
+   else if(is_symbol(obj))
+   {
+      encode_bytes(b, 'y', sym_to_string(obj), strlen(sym_to_string(obj)) + 1);
+   }
+   else if(is_error(obj))
+   {
+      encode_bytes(b, 'e', error_message(obj), strlen(error_message(obj)) + 1);
+   }
+   else if(is_bytevector(obj))
+   {
+      encode_bytes(b, 'v', (char *)bytevector_bytes(obj), bytevector_length(obj));
+   }
+   else if(is_channel(obj))
+   {
+      endpoint *e = car(obj);
+      queue *in = retain_queue(e->in);
+      queue *out = retain_queue(e->out);
+      strbuf_putc(b, 'h');
+      strbuf_append(b, (const char *)&in, sizeof(in));
+      strbuf_append(b, (const char *)&out, sizeof(out));
+   }
+   else
+   {
+      return false;
+   }
+   return true;
+}
+
+static message *new_message(strbuf *b)
+{
+   message *m = (message *)malloc(sizeof(message) + b->length);
+   if(m == NULL)
+   {
+      fprintf(stderr, "channel error: out of memory\n");
+      abort();
+   }
+   m->length = b->length;
+   memcpy(m->data, b->data, b->length);
+   return m;
+}
+
+/* dropping a message lets go of the channels in it */
+static void release_message(message *m)
+{
+   int pos = 0;
+   int length;
+   queue *q;
+
+   while(pos < m->length)
+   {
+      switch(m->data[pos++])
+      {
+      case 'i':
+         pos += sizeof(long);
+         break;
+      case 'c':
+         pos++;
+         break;
+      case 's': case 'y': case 'e': case 'v':
+         memcpy(&length, m->data + pos, sizeof(length));
+         pos += sizeof(length) + length;
+         break;
+      case 'h':
+         memcpy(&q, m->data + pos, sizeof(q));
+         release_queue(q);
+         memcpy(&q, m->data + pos + sizeof(q), sizeof(q));
+         release_queue(q);
+         pos += 2 * sizeof(q);
+         break;
+      }
+   }
+   free(m);
+}
+
+/* lisp_error after encode would leak the buffer and the channels */
+static message *to_message(lispobj *obj, char *name)
+{
+   strbuf b;
+   message *m;
+   bool ok;
+
+   strbuf_init(&b);
+   ok = encode(&b, obj);
+   m = new_message(&b);
+   strbuf_free(&b);
+   if(!ok)
+   {
+      release_message(m);
+      lisp_error("%s error: can not be sent to a place", name);
+   }
+   return m;
+}
+
+static channel *new_endpoint(queue *in, queue *out, place_data *place);
+
+static lispobj *decode_atom(message *m, int *pos)
+{
+   char tag = m->data[(*pos)++];
+   int length = 0;
+   lispobj *obj = NULL;
+
+   if(tag == 's' || tag == 'y' || tag == 'e' || tag == 'v')
+   {
+      memcpy(&length, m->data + *pos, sizeof(length));
+      *pos += sizeof(length);
+   }
+
+   if(tag == 'i')
+   {
+      long v;
+      memcpy(&v, m->data + *pos, sizeof(v));
+      *pos += sizeof(v);
+      obj = new_integer_long(v);
+   }
+   else if(tag == 'c')
+   {
+      obj = new_character(m->data[(*pos)++]);
+   }
+   else if(tag == 't' || tag == 'f')
+   {
+      obj = new_boolean(tag == 't');
+   }
+   else if(tag == 's')
+   {
+      char *s = (char *)lisp_alloc(STRING, length + 1);
+      memcpy(s, m->data + *pos, length);
+      s[length] = '\0';
+      obj = new_string_length(s, length);
+   }
+   else if(tag == 'y')
+   {
+      obj = new_symbol(m->data + *pos);
+   }
+   else if(tag == 'e')
+   {
+      obj = new_error(m->data + *pos);
+   }
+   else if(tag == 'v')
+   {
+      obj = new_bytevector(length, 0);
+      memcpy(bytevector_bytes(obj), m->data + *pos, length);
+   }
+   else if(tag == 'h')
+   {
+      queue *in;
+      queue *out;
+      memcpy(&in, m->data + *pos, sizeof(in));
+      memcpy(&out, m->data + *pos + sizeof(in), sizeof(out));
+      *pos += sizeof(in) + sizeof(out);
+      obj = new_endpoint(in, out, NULL);
+   }
+   *pos += length;
+   return obj;
+}
+
+/*@null@*/
+static lispobj *decode(message *m, int *pos)
+{
+   lispobj *head = NULL;
+   cell *last = NULL;
+   lispobj *obj;
+
+   while(m->data[*pos] == 'p')
+   {
+      cell *c;
+      (*pos)++;
+      c = cons(decode(m, pos), NULL);
+      if(last == NULL)
+      {
+         head = c;
+      }
+      else
+      {
+         set_cdr(last, c);
+      }
+      last = c;
+   }
+   obj = decode_atom(m, pos);
+   if(last == NULL)
+   {
+      return obj;
+   }
+   set_cdr(last, obj);
+   return head;
+}
+
+/* the copy in the current heap; the message is used up */
+/*@null@*/
+static lispobj *from_message(message *m)
+{
+   int pos = 0;
+   lispobj *obj = decode(m, &pos);
+   free(m);
+   return obj;
+}
+
+
+/* channel */
+static void release_place(place_data *pl)
+{
+   if(__atomic_sub_fetch(&pl->refs, 1, __ATOMIC_ACQ_REL) > 0)
+   {
+      return;
+   }
+   if(pl->body != NULL)
+   {
+      release_message(pl->body);
+   }
+   if(pl->result != NULL)
+   {
+      release_message(pl->result);
+   }
+   free(pl);
+}
+
+static void finalize_endpoint(lispobj *obj)
+{
+   endpoint *e = car(obj);
+
+   release_queue(e->in);
+   release_queue(e->out);
+   if(e->place != NULL)
+   {
+      /* a place nobody waits for cleans up after itself */
+      if(!e->place->joined)
+      {
+         pthread_detach(e->place->thread);
+      }
+      release_place(e->place);
+   }
+}
+
+/* takes over a reference to each queue */
+static channel *new_endpoint(queue *in, queue *out, place_data *place)
+{
+   channel *ch = alloc_object(CHANNEL);
+   endpoint *e = (endpoint *)lisp_alloc(CHANNEL, sizeof(endpoint));
+
+   e->in = in;
+   e->out = out;
+   e->place = place;
+   set_car(ch, e);
+   add_finalizer(ch, finalize_endpoint);
+   return ch;
+}
+
+channel *new_channel(int capacity)
+{
+   queue *q = new_queue(capacity);
+   return new_endpoint(q, retain_queue(q), NULL);
+}
+
+bool is_channel(lispobj *obj)
+{
+   return obj == NULL ? false : obj->tid == CHANNEL;
+}
+
+bool is_place(lispobj *obj)
+{
+   return is_channel(obj) && ((endpoint *)car(obj))->place != NULL;
+}
+
+/*@null@*/
+static bool *peer_finished(endpoint *e)
+{
+   return e->place == NULL ? NULL : &e->place->finished;
+}
+
+static void place_exited(place_data *pl, char *name);
+
+void channel_put(channel *ch, lispobj *obj)
+{
+   endpoint *e = car(ch);
+   message *m = to_message(obj, "place-channel-put");
+
+   if(!wait_for(e->out, try_put, &m, peer_finished(e)))
+   {
+      release_message(m);
+      place_exited(e->place, "place-channel-put");
+   }
+}
+
+/*@null@*/
+lispobj *channel_get(channel *ch)
+{
+   endpoint *e = car(ch);
+   message *m = NULL;
+
+   if(!wait_for(e->in, try_get, &m, peer_finished(e)))
+   {
+      place_exited(e->place, "place-channel-get");
+   }
+   return from_message(m);
+}
+
+/* place */
+static lispobj *place_main(lispobj *body, environment *env)
+{
+   lispobj *result = NULL;
+
+   for(; body != NULL; body = cdr(body))
+   {
+      result = eval(car(body), env);
+   }
+   running->result = to_message(result, "place");
+   return NULL;
+}
+
+static void *run_place(void *arg)
+{
+   place_data *pl = (place_data *)arg;
+   interp *it = new_interp();
+   eval_limits no_limits = {0, 0, 0};
+   lispobj *exp;
+   lispobj *result;
+
+   running = pl;
+   set_current_interp(it);
+   it->global_env = new_env();
+   exp = from_message(pl->body);
+   pl->body = NULL;
+   define_var_val(car(exp), new_endpoint(pl->in, pl->out, NULL), it->global_env);
+
+   result = run_limited(place_main, cdr(exp), it->global_env, &no_limits);
+   if(is_error(result))
+   {
+      strbuf b;
+      strbuf_init(&b);
+      encode(&b, result);
+      pl->result = new_message(&b);
+      pl->failed = true;
+      strbuf_free(&b);
+   }
+   __atomic_store_n(&pl->finished, true, __ATOMIC_RELEASE);
+   wake_all(pl->in);
+   wake_all(pl->out);
+
+   delete_interp(it);
+   release_place(pl);
+   return NULL;
+}
+
+/* (place ch body ...) */
+lispobj *syntax_place(list *exp, environment *env)
+{
+   place_data *pl;
+   queue *in;
+   queue *out;
+
+   if(exp == NULL || !is_symbol(car(exp)))
+   {
+      lisp_error("place error: arg error");
+   }
+
+   pl = (place_data *)calloc(1, sizeof(place_data));
+   if(pl == NULL)
+   {
+      fprintf(stderr, "place error: out of memory\n");
+      abort();
+   }
+   pl->body = to_message(exp, "place");
+   in = new_queue(CHANNEL_SIZE);
+   out = new_queue(CHANNEL_SIZE);
+   pl->in = retain_queue(in);
+   pl->out = retain_queue(out);
+   pl->refs = 2;
+   if(pthread_create(&pl->thread, NULL, run_place, pl) != 0)
+   {
+      fprintf(stderr, "place error: can not start a thread\n");
+      abort();
+   }
+   return new_endpoint(out, in, pl);
+}
+
+/* the value of the place's last expression, copied; raises its error */
+/*@null@*/
+static lispobj *place_result(place_data *pl)
+{
+   message *copy = (message *)malloc(sizeof(message) + pl->result->length);
+
+   if(copy == NULL)
+   {
+      fprintf(stderr, "place error: out of memory\n");
+      abort();
+   }
+   memcpy(copy, pl->result, sizeof(message) + pl->result->length);
+   if(pl->failed)
+   {
+      lispobj *e = from_message(copy);
+      lisp_raise(error_message(e));
+   }
+   return from_message(copy);
+}
+
+/* raises the error the place ended with, if it did */
+static void place_exited(place_data *pl, char *name)
+{
+   if(pl->failed)
+   {
+      place_result(pl);
+   }
+   lisp_error("%s error: place has exited", name);
+}
+
+/*@null@*/
+static lispobj *place_wait(channel *p)
+{
+   place_data *pl = ((endpoint *)car(p))->place;
+
+   if(!pl->joined)
+   {
+      pthread_join(pl->thread, NULL);
+      pl->joined = true;
+   }
+   return place_result(pl);
+}
+
+/* primitive procedures */
+/* registered in place_prims, which the arguments are checked against */
+lispobj *prim_make_place_channel(int argc, lispobj **argv)
+{
+   int capacity = CHANNEL_SIZE;
+
+   if(argc > 0)
+   {
+      if(!is_integer(argv[0]) || integer_to_long(argv[0]) < 1)
+      {
+         lisp_error("make-place-channel error: arg error");
+      }
+      capacity = integer_to_int(argv[0]);
+   }
+   return new_channel(capacity);
+}
+
+/*@null@*/
+lispobj *prim_place_channel_put(int argc, lispobj **argv)
+{
+   channel_put(argv[0], argv[1]);
+   return NULL;
+}
+
+/*@null@*/
+lispobj *prim_place_channel_get(int argc, lispobj **argv)
+{
+   return channel_get(argv[0]);
+}
+
+/*@null@*/
+lispobj *prim_place_wait(int argc, lispobj **argv)
+{
+   if(!is_place(argv[0]))
+   {
+      lisp_error("place-wait error: not a place");
+   }
+   return place_wait(argv[0]);
+}
+
+lispobj *prim_is_place(int argc, lispobj **argv)
+{
+   return new_boolean(is_place(argv[0]));
+}
+
+lispobj *prim_is_place_channel(int argc, lispobj **argv)
+{
+   return new_boolean(is_channel(argv[0]));
+}
+
+static const prim_spec place_prims[] =
+{
+   {"make-place-channel", prim_make_place_channel, 0, 1, {NULL}, false},
+   {"place-channel-put", prim_place_channel_put, 2, 2, {is_channel, NULL}, false},
+   {"place-channel-get", prim_place_channel_get, 1, 1, {is_channel}, false},
+   {"place-wait", prim_place_wait, 1, 1, {is_channel}, false},
+   {"place?", prim_is_place, 1, 1, {NULL}, true},
+   {"place-channel?", prim_is_place_channel, 1, 1, {NULL}, true},
+   {NULL}
+};
+
+environment *define_place_procs(environment *env)
+{
+   define_var_val(new_symbol("place"), new_syntax(syntax_place), env);
+   return define_prims(env, place_prims);
+}
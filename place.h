@@ -0,0 +1,50 @@
+#ifndef _PLACE_H_
+#define _PLACE_H_
+
+#include <stdbool.h>
+#include "lispobj.h"
+
+enum place_define
+{
+   CHANNEL_SIZE = 64,      /* default capacity, rounded up to a power of two */
+   CHANNEL_SPINS = 256     /* failed tries before sleeping */
+};
+
+/*
+ * A place is an interpreter of its own, with its own heap, symbols and
+ * global environment from new_env, running on its own thread:
+ *
+ *   (place ch body ...)
+ *
+ * copies the body into the new place and evaluates it there with ch
+ * bound to the place's end of a channel; the place object is the other
+ * end.  Nothing is shared, so neither side takes a lock to allocate.
+ *
+ * A channel end puts into one bounded queue and gets from another,
+ * both lock free multi-producer multi-consumer rings; a put blocks
+ * while the queue is full and a get while it is empty.  Messages are
+ * deep copies: lists, numbers, characters, booleans, strings, symbols,
+ * bytevectors, errors and channels can be sent, procedures and ports
+ * can not.  (make-place-channel) makes an end whose puts and gets use
+ * the same queue, to be sent to places.
+ */
+typedef lispobj channel;
+channel *new_channel(int capacity);
+bool is_channel(lispobj *obj);
+bool is_place(lispobj *obj);
+void channel_put(channel *ch, lispobj *obj);
+lispobj *channel_get(channel *ch);
+
+/* syntax */
+lispobj *syntax_place(list *exp, environment *env);
+
+/* primitive procedures */
+lispobj *prim_make_place_channel(int argc, lispobj **argv);
+lispobj *prim_place_channel_put(int argc, lispobj **argv);
+lispobj *prim_place_channel_get(int argc, lispobj **argv);
+lispobj *prim_place_wait(int argc, lispobj **argv);
+lispobj *prim_is_place(int argc, lispobj **argv);
+lispobj *prim_is_place_channel(int argc, lispobj **argv);
+environment *define_place_procs(environment *env);
+
+#endif
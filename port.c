@@ -0,0 +1,891 @@
+
+#include "port.h"
+#include "interp.h"
+#include "hashtable.h"
+#include "hamt.h"
+#include "bytevector.h"
+#include "place.h"
+#include "green.h"
+#include "cont.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/*
+ * A port owns one buffer.  An input port refills it with a single
+ * read(2); an output port appends to it and hands it to write(2) once
+ * PORT_BUFFER_SIZE bytes are pending.  String ports use the same buffer
+ * and never touch a file descriptor.
+ *
+ * Each interpreter has its own standard ports.  The output ports of
+ * every interpreter are flushed at exit, and closed when their
+ * interpreter is deleted.
+ */
+
+typedef struct port_data
+{
+   int fd;           /* -1 for a string port */
+   bool input;
+   bool closed;
+   strbuf buf;
+   int pos;          /* next unread byte of an input port */
+   struct port_data *next_output;
+} port_data;
+
+static port_data *output_ports = NULL;
+static pthread_mutex_t output_ports_lock = PTHREAD_MUTEX_INITIALIZER;
+static lispobj eof = {EOF_OBJECT, {NULL, NULL}};
+
+
+/* port */
+static void finalize_port(lispobj *p)
+{
+   port_close(p);
+   strbuf_free(&((port_data *)car(p))->buf);
+}
+
+static port *wrap_port(int fd, bool input)
+{
+   port *p = alloc_object(PORT);
+   port_data *d = (port_data *)lisp_alloc(PORT, sizeof(port_data));
+   static bool registered = false;
+
+   d->fd = fd;
+   d->input = input;
+   d->closed = false;
+   strbuf_init(&d->buf);
+   d->pos = 0;
+   d->next_output = NULL;
+
+   if(!input && fd >= 0)
+   {
+      pthread_mutex_lock(&output_ports_lock);
+      if(!registered)
+      {
+         atexit(port_flush_all);
+         registered = true;
+      }
+      d->next_output = output_ports;
+      output_ports = d;
+      pthread_mutex_unlock(&output_ports_lock);
+   }
+
+   set_car(p, d);
+   set_cdr(p, NULL);
+   add_finalizer(p, finalize_port);
+   return p;
+}
+
+/*@null@*/
+port *new_fd_port(int fd, bool input)
+{
+   return wrap_port(fd, input);
+}
+
+/*@null@*/
+port *open_input_file(char *filepath)
+{
+   int fd = open(filepath, O_RDONLY);
+   if(fd < 0)
+   {
+      lisp_error("open-input-file error: can not open %s", filepath);
+   }
+   return wrap_port(fd, true);
+}
+
+/*@null@*/
+port *open_output_file(char *filepath)
+{
+   int fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+   if(fd < 0)
+   {
+      lisp_error("open-output-file error: can not open %s", filepath);
+   }
+   return wrap_port(fd, false);
+}
+
+/*@null@*/
+port *open_input_string(char *s, int length)
+{
+   port *p = wrap_port(-1, true);
+   strbuf_append(&((port_data *)car(p))->buf, s, length);
+   return p;
+}
+
+/*@null@*/
+port *open_output_string()
+{
+   return wrap_port(-1, false);
+}
+
+bool is_port(lispobj *obj)
+{
+   return obj == NULL ? false : obj->tid == PORT;
+}
+
+bool is_input_port(lispobj *obj)
+{
+   return is_port(obj) && ((port_data *)car(obj))->input;
+}
+
+bool is_output_port(lispobj *obj)
+{
+   return is_port(obj) && !((port_data *)car(obj))->input;
+}
+
+bool is_string_port(lispobj *obj)
+{
+   return is_port(obj) && ((port_data *)car(obj))->fd < 0;
+}
+
+port *current_input_port()
+{
+   interp *it = current_interp();
+   if(it->stdin_port == NULL)
+   {
+      it->stdin_port = wrap_port(0, true);
+   }
+   return it->stdin_port;
+}
+
+port *current_output_port()
+{
+   interp *it = current_interp();
+   if(it->stdout_port == NULL)
+   {
+      it->stdout_port = wrap_port(1, false);
+   }
+   return it->stdout_port;
+}
+
+bool port_close(port *p)
+{
+   port_data *d = car(p);
+   port_data **q;
+
+   if(d->closed)
+   {
+      return false;
+   }
+
+   if(!d->input)
+   {
+      port_flush(p);
+      pthread_mutex_lock(&output_ports_lock);
+      for(q = &output_ports; *q != NULL; q = &(*q)->next_output)
+      {
+         if(*q == d)
+         {
+            *q = d->next_output;
+            break;
+         }
+      }
+      pthread_mutex_unlock(&output_ports_lock);
+   }
+
+   if(d->fd > 2)
+   {
+      close(d->fd);
+   }
+   d->closed = true;
+   return true;
+}
+
+static port_data *open_data(port *p, bool input, char *name)
+{
+   port_data *d = car(p);
+   if(d->input != input || d->closed)
+   {
+      lisp_error("%s error: not an open %s port",
+         name, input ? "input" : "output");
+   }
+   return d;
+}
+
+
+/* input */
+static bool refill(port_data *d)
+{
+   int n;
+
+   if(d->pos < d->buf.length)
+   {
+      return true;
+   }
+   else if(d->fd < 0 || d->closed)
+   {
+      return false;
+   }
+
+   /* like a line buffered stdout, pending output is shown before
+    * waiting for the terminal */
+   if(d->fd == 0 && current_interp()->stdout_port != NULL)
+   {
+      port_flush(current_interp()->stdout_port);
+   }
+
+   strbuf_clear(&d->buf);
+   strbuf_reserve(&d->buf, PORT_BUFFER_SIZE - 1);
+   d->pos = 0;
+
+   do
+   {
+      n = read(d->fd, d->buf.data, d->buf.capacity - 1);
+   } while(n < 0 && errno == EINTR);
+
+   if(n <= 0)
+   {
+      return false;
+   }
+   d->buf.length = n;
+   d->buf.data[n] = '\0';
+   return true;
+}
+
+int port_read_char(port *p)
+{
+   port_data *d = open_data(p, true, "read-char");
+   if(!refill(d))
+   {
+      return PORT_EOF;
+   }
+   return (unsigned char)d->buf.data[d->pos++];
+}
+
+int port_peek_char(port *p)
+{
+   port_data *d = open_data(p, true, "peek-char");
+   if(!refill(d))
+   {
+      return PORT_EOF;
+   }
+   return (unsigned char)d->buf.data[d->pos];
+}
+
+/* line gets the characters without the newline */
+bool port_read_line(port *p, strbuf *line)
+{
+   port_data *d = open_data(p, true, "read-line");
+   bool read_any = false;
+
+   strbuf_clear(line);
+   while(refill(d))
+   {
+      char *start = d->buf.data + d->pos;
+      int avail = d->buf.length - d->pos;
+      char *nl = memchr(start, '\n', avail);
+
+      read_any = true;
+      if(nl != NULL)
+      {
+         strbuf_append(line, start, nl - start);
+         d->pos += nl - start + 1;
+         return true;
+      }
+      strbuf_append(line, start, avail);
+      d->pos += avail;
+   }
+   return read_any;
+}
+
+static bool is_delimiter(int c)
+{
+   return c == PORT_EOF || c == ' ' || c == '\t' || c == '\n' || c == '\r' ||
+      c == '(' || c == ')' || c == '"' || c == ';';
+}
+
+static int skip_space(port *p)
+{
+   int c;
+   for(;;)
+   {
+      c = port_peek_char(p);
+      if(c == ';')
+      {
+         while(c != PORT_EOF && c != '\n')
+         {
+            c = port_read_char(p);
+         }
+      }
+      else if(c == ' ' || c == '\t' || c == '\n' || c == '\r')
+      {
+         port_read_char(p);
+      }
+      else
+      {
+         return c;
+      }
+   }
+}
+
+/* copies the characters of the next datum to b without comments */
+static bool scan_datum(port *p, strbuf *b)
+{
+   int depth = 0;
+   int c;
+
+   for(;;)
+   {
+      c = skip_space(p);
+      if(c == PORT_EOF)
+      {
+         return false;
+      }
+
+      port_read_char(p);
+      if(c == '\'' || c == '`')
+      {
+         strbuf_putc(b, c);
+         continue;
+      }
+      else if(c == ',')
+      {
+         strbuf_putc(b, c);
+         if(port_peek_char(p) == '@')
+         {
+            strbuf_putc(b, port_read_char(p));
+         }
+         continue;
+      }
+      else if(c == '(')
+      {
+         strbuf_putc(b, c);
+         depth++;
+         continue;
+      }
+      else if(c == ')')
+      {
+         if(depth == 0)
+         {
+            fprintf(stderr, "read error: unexpected ')'\n");
+            continue;
+         }
+         strbuf_putc(b, c);
+         depth--;
+      }
+      else if(c == '"')
+      {
+         strbuf_putc(b, c);
+         while((c = port_read_char(p)) != PORT_EOF && c != '"')
+         {
+            strbuf_putc(b, c);
+            if(c == '\\' && port_peek_char(p) != PORT_EOF)
+            {
+               strbuf_putc(b, port_read_char(p));
+            }
+         }
+         strbuf_putc(b, '"');
+      }
+      else
+      {
+         strbuf_putc(b, c);
+         while(!is_delimiter(port_peek_char(p)))
+         {
+            strbuf_putc(b, port_read_char(p));
+         }
+      }
+
+      if(depth == 0)
+      {
+         return true;
+      }
+      strbuf_putc(b, ' ');
+   }
+}
+
+bool port_read_datum(port *p, lispobj **datum)
+{
+   strbuf b;
+   list *tokens;
+
+   strbuf_init(&b);
+   if(!scan_datum(p, &b))
+   {
+      bool truncated = b.length > 0;
+
+      strbuf_free(&b);
+      if(truncated)
+      {
+         lisp_error("read error: unexpected end of file");
+      }
+      return false;
+   }
+
+   tokens = expand_readmacro(tokenize(b.data));
+   *datum = read_tokens(tokens);
+   strbuf_free(&b);
+   return true;
+}
+
+
+/* output */
+void port_write(port *p, const char *s, int length)
+{
+   port_data *d = open_data(p, false, "write");
+   strbuf_append(&d->buf, s, length);
+   if(d->fd >= 0 && d->buf.length >= PORT_BUFFER_SIZE)
+   {
+      port_flush(p);
+   }
+}
+
+void port_putc(port *p, char c)
+{
+   port_write(p, &c, 1);
+}
+
+void port_printf(port *p, const char *format, ...)
+{
+   char small[256];
+   char *s = small;
+   va_list ap;
+   int n;
+
+   va_start(ap, format);
+   n = vsnprintf(small, sizeof(small), format, ap);
+   va_end(ap);
+
+   if(n >= (int)sizeof(small))
+   {
+      s = (char *)malloc(n + 1);
+      va_start(ap, format);
+      vsnprintf(s, n + 1, format, ap);
+      va_end(ap);
+   }
+
+   port_write(p, s, n);
+   if(s != small)
+   {
+      free(s);
+   }
+}
+
+static void write_string_literal(port *p, string *s)
+{
+   char *c = string_to_char(s);
+   int n = string_length(s);
+   int i;
+
+   port_putc(p, '"');
+   for(i = 0; i < n; ++i)
+   {
+      switch(c[i])
+      {
+         case '"':  port_write(p, "\\\"", 2); break;
+         case '\\': port_write(p, "\\\\", 2); break;
+         case '\n': port_write(p, "\\n", 2); break;
+         case '\t': port_write(p, "\\t", 2); break;
+         case '\0': port_write(p, "\\0", 2); break;
+         default:   port_putc(p, c[i]); break;
+      }
+   }
+   port_putc(p, '"');
+}
+
+static void write_character(port *p, char c)
+{
+   switch(c)
+   {
+      case ' ':  port_write(p, "#\\space", 7); break;
+      case '\n': port_write(p, "#\\newline", 9); break;
+      case '\t': port_write(p, "#\\tab", 5); break;
+      default:   port_printf(p, "#\\%c", c); break;
+   }
+}
+
+void port_write_obj(port *p, lispobj *obj, bool display)
+{
+   if(obj == NULL)
+   {
+      port_write(p, "()", 2);
+   }
+   else if(is_cell(obj))
+   {
+      port_putc(p, '(');
+      for(;;)
+      {
+         port_write_obj(p, car(obj), display);
+         obj = cdr(obj);
+         if(obj == NULL)
+         {
+            break;
+         }
+         else if(!is_cell(obj))
+         {
+            port_write(p, " . ", 3);
+            port_write_obj(p, obj, display);
+            break;
+         }
+         port_putc(p, ' ');
+      }
+      port_putc(p, ')');
+   }
+   else if(is_symbol(obj))
+   {
+      port_write(p, sym_to_string(obj), strlen(sym_to_string(obj)));
+   }
+   else if(is_integer(obj))
+   {
+      port_printf(p, "%ld", integer_to_long(obj));
+   }
+   else if(is_string(obj))
+   {
+      if(display)
+      {
+         port_write(p, string_to_char(obj), string_length(obj));
+      }
+      else
+      {
+         write_string_literal(p, obj);
+      }
+   }
+   else if(is_character(obj))
+   {
+      if(display)
+      {
+         port_putc(p, character_to_char(obj));
+      }
+      else
+      {
+         write_character(p, character_to_char(obj));
+      }
+   }
+   else if(is_boolean(obj))
+   {
+      port_write(p, is_true(obj) ? "#t" : "#f", 2);
+   }
+   else if(is_hash_table(obj))
+   {
+      port_printf(p, "#<hash-table %d>", hash_table_count(obj));
+   }
+   else if(is_hamt(obj))
+   {
+      port_write(p, "#<hamt ", 7);
+      port_write_obj(p, hamt_to_alist(obj), display);
+      port_putc(p, '>');
+   }
+   else if(is_bytevector(obj))
+   {
+      port_printf(p, "#<bytevector %ld>", bytevector_length(obj));
+   }
+   else if(is_port(obj))
+   {
+      port_printf(p, "#<%s-port>", is_input_port(obj) ? "input" : "output");
+   }
+   else if(is_channel(obj))
+   {
+      port_printf(p, "#<%s>", is_place(obj) ? "place" : "channel");
+   }
+   else if(is_task(obj))
+   {
+      port_write(p, "#<task>", 7);
+   }
+   else if(is_continuation(obj))
+   {
+      port_write(p, "#<continuation>", 15);
+   }
+   else if(is_eof_object(obj))
+   {
+      port_write(p, "#<eof>", 6);
+   }
+   else if(is_error(obj))
+   {
+      port_printf(p, "#<error %s>", error_message(obj));
+   }
+   else if(is_lambda(obj))
+   {
+      port_write(p, "#<procedure>", 12);
+   }
+   else if(is_prim_proc(obj))
+   {
+      port_write(p, "#<primitive>", 12);
+   }
+   else
+   {
+      port_printf(p, "#<typeid=%d>", obj->tid);
+   }
+}
+
+static bool flush_data(port_data *d)
+{
+   int done = 0;
+
+   if(d->input || d->fd < 0 || d->closed)
+   {
+      return false;
+   }
+
+   while(done < d->buf.length)
+   {
+      int n = write(d->fd, d->buf.data + done, d->buf.length - done);
+      if(n < 0 && errno == EINTR)
+      {
+         continue;
+      }
+      else if(n < 0)
+      {
+         fprintf(stderr, "port error: write failed\n");
+         strbuf_clear(&d->buf);
+         return false;
+      }
+      done += n;
+   }
+   strbuf_clear(&d->buf);
+   return true;
+}
+
+bool port_flush(port *p)
+{
+   return flush_data(car(p));
+}
+
+void port_flush_all()
+{
+   port_data *d;
+   pthread_mutex_lock(&output_ports_lock);
+   for(d = output_ports; d != NULL; d = d->next_output)
+   {
+      flush_data(d);
+   }
+   pthread_mutex_unlock(&output_ports_lock);
+}
+
+/*@null@*/
+string *port_output_string(port *p)
+{
+   port_data *d = open_data(p, false, "get-output-string");
+   char *chars = (char *)lisp_alloc(STRING, d->buf.length + 1);
+   memcpy(chars, d->buf.length == 0 ? "" : d->buf.data, d->buf.length);
+   chars[d->buf.length] = '\0';
+   return new_string_length(chars, d->buf.length);
+}
+
+int port_output_length(port *p)
+{
+   return ((port_data *)car(p))->buf.length;
+}
+
+/* moves what a string port collected to dst without allocating */
+void port_take_output(port *p, strbuf *dst)
+{
+   port_data *d = open_data(p, false, "port_take_output");
+   if(d->buf.length > 0)
+   {
+      strbuf_append(dst, d->buf.data, d->buf.length);
+   }
+   strbuf_clear(&d->buf);
+}
+
+
+/* eof object */
+lispobj *eof_object()
+{
+   return &eof;
+}
+
+bool is_eof_object(lispobj *obj)
+{
+   return obj == &eof;
+}
+
+
+/* primitive procedures */
+/* registered in port_prims, which the arguments are checked against */
+/* the optional port argument at position i */
+static port *port_operand(int argc, lispobj **argv, int i, bool input, char *name)
+{
+   port *p;
+
+   if(argc == i)
+   {
+      return input ? current_input_port() : current_output_port();
+   }
+
+   p = argv[i];
+   if(input ? !is_input_port(p) : !is_output_port(p))
+   {
+      lisp_error("%s error: not an %s port", name, input ? "input" : "output");
+   }
+   return p;
+}
+
+lispobj *prim_open_input_file(int argc, lispobj **argv)
+{
+   return open_input_file(string_to_char(argv[0]));
+}
+
+lispobj *prim_open_output_file(int argc, lispobj **argv)
+{
+   return open_output_file(string_to_char(argv[0]));
+}
+
+lispobj *prim_open_input_string(int argc, lispobj **argv)
+{
+   return open_input_string(string_to_char(argv[0]), string_length(argv[0]));
+}
+
+lispobj *prim_open_output_string(int argc, lispobj **argv)
+{
+   return open_output_string();
+}
+
+lispobj *prim_get_output_string(int argc, lispobj **argv)
+{
+   if(!is_output_port(argv[0]) || !is_string_port(argv[0]))
+   {
+      lisp_error("get-output-string error: not a string port");
+   }
+   return port_output_string(argv[0]);
+}
+
+lispobj *prim_close_port(int argc, lispobj **argv)
+{
+   return new_boolean(port_close(argv[0]));
+}
+
+lispobj *prim_is_input_port(int argc, lispobj **argv)
+{
+   return new_boolean(is_input_port(argv[0]));
+}
+
+lispobj *prim_is_output_port(int argc, lispobj **argv)
+{
+   return new_boolean(is_output_port(argv[0]));
+}
+
+lispobj *prim_current_input_port(int argc, lispobj **argv)
+{
+   return current_input_port();
+}
+
+lispobj *prim_current_output_port(int argc, lispobj **argv)
+{
+   return current_output_port();
+}
+
+lispobj *prim_read_char(int argc, lispobj **argv)
+{
+   int c = port_read_char(port_operand(argc, argv, 0, true, "read-char"));
+   return c == PORT_EOF ? eof_object() : new_character(c);
+}
+
+lispobj *prim_peek_char(int argc, lispobj **argv)
+{
+   int c = port_peek_char(port_operand(argc, argv, 0, true, "peek-char"));
+   return c == PORT_EOF ? eof_object() : new_character(c);
+}
+
+lispobj *prim_read_line(int argc, lispobj **argv)
+{
+   port *p = port_operand(argc, argv, 0, true, "read-line");
+   strbuf line;
+   lispobj *result = eof_object();
+
+   strbuf_init(&line);
+   if(port_read_line(p, &line))
+   {
+      char *chars = (char *)lisp_alloc(STRING, line.length + 1);
+      memcpy(chars, line.length == 0 ? "" : line.data, line.length + 1);
+      result = new_string_length(chars, line.length);
+   }
+   strbuf_free(&line);
+   return result;
+}
+
+lispobj *prim_read(int argc, lispobj **argv)
+{
+   lispobj *datum;
+   if(port_read_datum(port_operand(argc, argv, 0, true, "read"), &datum))
+   {
+      return datum;
+   }
+   return eof_object();
+}
+
+lispobj *prim_write(int argc, lispobj **argv)
+{
+   port *p = port_operand(argc, argv, 1, false, "write");
+   port_write_obj(p, argv[0], false);
+   return NULL;
+}
+
+lispobj *prim_display(int argc, lispobj **argv)
+{
+   port *p = port_operand(argc, argv, 1, false, "display");
+   port_write_obj(p, argv[0], true);
+   return NULL;
+}
+
+lispobj *prim_newline(int argc, lispobj **argv)
+{
+   port_putc(port_operand(argc, argv, 0, false, "newline"), '\n');
+   return NULL;
+}
+
+lispobj *prim_write_char(int argc, lispobj **argv)
+{
+   port *p = port_operand(argc, argv, 1, false, "write-char");
+   port_putc(p, character_to_char(argv[0]));
+   return NULL;
+}
+
+lispobj *prim_write_string(int argc, lispobj **argv)
+{
+   port *p = port_operand(argc, argv, 1, false, "write-string");
+   port_write(p, string_to_char(argv[0]), string_length(argv[0]));
+   return NULL;
+}
+
+lispobj *prim_flush_output_port(int argc, lispobj **argv)
+{
+   return new_boolean(port_flush(port_operand(argc, argv, 0, false, "flush-output-port")));
+}
+
+lispobj *prim_eof_object(int argc, lispobj **argv)
+{
+   return eof_object();
+}
+
+lispobj *prim_is_eof_object(int argc, lispobj **argv)
+{
+   return new_boolean(is_eof_object(argv[0]));
+}
+
+static const prim_spec port_prims[] =
+{
+   {"open-input-file", prim_open_input_file, 1, 1, {is_string}, false},
+   {"open-output-file", prim_open_output_file, 1, 1, {is_string}, false},
+   {"open-input-string", prim_open_input_string, 1, 1, {is_string}, false},
+   {"open-output-string", prim_open_output_string, 0, 0, {NULL}, false},
+   {"get-output-string", prim_get_output_string, 1, 1, {NULL}, false},
+   {"close-port", prim_close_port, 1, 1, {is_port}, false},
+   {"close-input-port", prim_close_port, 1, 1, {is_port}, false},
+   {"close-output-port", prim_close_port, 1, 1, {is_port}, false},
+   {"input-port?", prim_is_input_port, 1, 1, {NULL}, true},
+   {"output-port?", prim_is_output_port, 1, 1, {NULL}, true},
+   {"current-input-port", prim_current_input_port, 0, 0, {NULL}, false},
+   {"current-output-port", prim_current_output_port, 0, 0, {NULL}, false},
+   {"read-char", prim_read_char, 0, 1, {NULL}, false},
+   {"peek-char", prim_peek_char, 0, 1, {NULL}, false},
+   {"read-line", prim_read_line, 0, 1, {NULL}, false},
+   {"read", prim_read, 0, 1, {NULL}, false},
+   {"write", prim_write, 1, 2, {NULL}, false},
+   {"display", prim_display, 1, 2, {NULL}, false},
+   {"newline", prim_newline, 0, 1, {NULL}, false},
+   {"write-char", prim_write_char, 1, 2, {is_character, NULL}, false},
+   {"write-string", prim_write_string, 1, 2, {is_string, NULL}, false},
+   {"flush-output-port", prim_flush_output_port, 0, 1, {NULL}, false},
+   {"eof-object", prim_eof_object, 0, 0, {NULL}, true},
+   {"eof-object?", prim_is_eof_object, 1, 1, {NULL}, true},
+   {NULL}
+};
+
+environment *define_port_procs(environment *env)
+{
+   return define_prims(env, port_prims);
+}
@@ -0,0 +1,76 @@
+#ifndef _PORT_H_
+#define _PORT_H_
+
+#include <stdbool.h>
+#include "lispobj.h"
+#include "lispstring.h"
+
+enum port_define
+{
+   PORT_BUFFER_SIZE = 65536,
+   PORT_EOF = -1
+};
+
+/* port */
+typedef lispobj port;
+port *new_fd_port(int fd, bool input);
+port *open_input_file(char *filepath);
+port *open_output_file(char *filepath);
+port *open_input_string(char *s, int length);
+port *open_output_string();
+bool is_port(lispobj *obj);
+bool is_input_port(lispobj *obj);
+bool is_output_port(lispobj *obj);
+bool is_string_port(lispobj *obj);
+port *current_input_port();
+port *current_output_port();
+bool port_close(port *p);
+
+/* input */
+int port_read_char(port *p);
+int port_peek_char(port *p);
+bool port_read_line(port *p, strbuf *line);
+/* false at the end of the input, raises at its end inside a datum */
+bool port_read_datum(port *p, lispobj **datum);
+
+/* output */
+void port_write(port *p, const char *s, int length);
+void port_putc(port *p, char c);
+void port_printf(port *p, const char *format, ...);
+void port_write_obj(port *p, lispobj *obj, bool display);
+bool port_flush(port *p);
+void port_flush_all();
+string *port_output_string(port *p);
+int port_output_length(port *p);
+void port_take_output(port *p, strbuf *dst);
+
+/* eof object */
+lispobj *eof_object();
+bool is_eof_object(lispobj *obj);
+
+/* primitive procedures */
+lispobj *prim_open_input_file(int argc, lispobj **argv);
+lispobj *prim_open_output_file(int argc, lispobj **argv);
+lispobj *prim_open_input_string(int argc, lispobj **argv);
+lispobj *prim_open_output_string(int argc, lispobj **argv);
+lispobj *prim_get_output_string(int argc, lispobj **argv);
+lispobj *prim_close_port(int argc, lispobj **argv);
+lispobj *prim_is_input_port(int argc, lispobj **argv);
+lispobj *prim_is_output_port(int argc, lispobj **argv);
+lispobj *prim_current_input_port(int argc, lispobj **argv);
+lispobj *prim_current_output_port(int argc, lispobj **argv);
+lispobj *prim_read_char(int argc, lispobj **argv);
+lispobj *prim_peek_char(int argc, lispobj **argv);
+lispobj *prim_read_line(int argc, lispobj **argv);
+lispobj *prim_read(int argc, lispobj **argv);
+lispobj *prim_write(int argc, lispobj **argv);
+lispobj *prim_display(int argc, lispobj **argv);
+lispobj *prim_newline(int argc, lispobj **argv);
+lispobj *prim_write_char(int argc, lispobj **argv);
+lispobj *prim_write_string(int argc, lispobj **argv);
+lispobj *prim_flush_output_port(int argc, lispobj **argv);
+lispobj *prim_eof_object(int argc, lispobj **argv);
+lispobj *prim_is_eof_object(int argc, lispobj **argv);
+environment *define_port_procs(environment *env);
+
+#endif
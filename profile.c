@@ -0,0 +1,523 @@
+
+#include "profile.h"
+#include "interp.h"
+#include "hashtable.h"
+#include "analyze.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/time.h>
+
+/*
+ * The evaluator pushes every lambda and primitive it applies on the
+ * shadow stack of its interpreter.  The stack is a ring, so a deep
+ * recursion keeps its innermost PROFILE_STACK_SIZE frames.
+ *
+ * On SIGPROF the handler copies the innermost frames of the interpreter
+ * current on the interrupted thread and counts them in
+ * a table of distinct stacks.  It does not allocate: the table and the
+ * pool of frames are reserved by profile_start, and a sample that does
+ * not fit is dropped.  Names are looked up only when the profile is
+ * written.
+ */
+
+void profile_enter(lispobj *proc)
+{
+   interp *it = current_interp();
+   it->shadow_stack[it->shadow_depth & (PROFILE_STACK_SIZE - 1)] = proc;
+   __atomic_signal_fence(__ATOMIC_SEQ_CST);
+   it->shadow_depth++;
+}
+
+void profile_leave()
+{
+   current_interp()->shadow_depth--;
+}
+
+/* after a non local exit */
+void profile_unwind(int depth)
+{
+   current_interp()->shadow_depth = depth;
+}
+
+int profile_depth()
+{
+   return current_interp()->shadow_depth;
+}
+
+/*@null@*/
+lispobj *profile_current()
+{
+   interp *it = current_interp();
+   return it->shadow_depth > 0 ?
+      it->shadow_stack[(it->shadow_depth - 1) & (PROFILE_STACK_SIZE - 1)] : NULL;
+}
+
+
+/* procedure names */
+/* closures made by one lambda expression share its code, so lambdas
+ * are named by their code and the table stays as small as the program.
+ * Names are kept only once a profile is started, so define costs
+ * nothing more otherwise */
+
+static bool naming = false;
+
+void profile_names_start()
+{
+   naming = true;
+}
+
+static lispobj *name_key(lispobj *proc)
+{
+   list *arg_body;
+
+   if(!is_lambda(proc))
+   {
+      return proc;
+   }
+   /* an analyzed lambda is named by its source */
+   arg_body = car(proc);
+   if(arg_body != NULL && cdr(arg_body) != NULL && is_code(cdr(arg_body)))
+   {
+      return code_source(cdr(arg_body));
+   }
+   return arg_body;
+}
+
+void profile_name(lispobj *proc, symbol *name)
+{
+   interp *it = current_interp();
+   lispobj *old;
+
+   /* a child's names would be lost with it */
+   if(!naming || proc == NULL || !(is_lambda(proc) || is_prim_proc(proc)) || it->owner != NULL)
+   {
+      return;
+   }
+   if(it->names == NULL)
+   {
+      it->names = new_hash_table(HASH_EQV);
+   }
+   if(!hash_table_lookup(it->names, name_key(proc), &old))
+   {
+      hash_table_set(it->names, name_key(proc), name);
+   }
+}
+
+char *profile_proc_name(lispobj *proc)
+{
+   lispobj *names = current_interp()->names;
+   lispobj *name;
+
+   if(proc == NULL)
+   {
+      return "...";
+   }
+   if(names != NULL && hash_table_lookup(names, name_key(proc), &name))
+   {
+      return sym_to_string(name);
+   }
+   return is_lambda(proc) ? "(lambda)" : "(primitive)";
+}
+
+
+/* sampling */
+typedef struct profile_entry
+{
+   unsigned int hash;
+   int start;     /* index in the frame pool */
+   int length;
+   long count;
+} profile_entry;
+
+static profile_entry *entries = NULL;
+static lispobj **pool = NULL;
+static int pool_used = 0;
+static int num_of_entries = 0;
+static long num_of_samples = 0;
+static int sampling = 0;
+static long num_of_dropped = 0;
+static FILE *output = NULL;
+
+static bool same_frames(profile_entry *e, lispobj **frames, int length)
+{
+   return e->length == length &&
+      memcmp(pool + e->start, frames, length * sizeof(lispobj *)) == 0;
+}
+
+static void record(lispobj **frames, int length)
+{
+   unsigned int hash = 2166136261u;
+   unsigned int i;
+   int k;
+
+   for(k = 0; k < length; ++k)
+   {
+      hash = (hash ^ (unsigned int)((uintptr_t)frames[k] >> 4)) * 16777619u;
+   }
+
+   for(i = hash & (PROFILE_TABLE_SIZE - 1); ; i = (i + 1) & (PROFILE_TABLE_SIZE - 1))
+   {
+      profile_entry *e = &entries[i];
+      if(e->count == 0)
+      {
+         if(pool_used + length > PROFILE_POOL_SIZE ||
+            num_of_entries >= PROFILE_TABLE_SIZE / 2)
+         {
+            num_of_dropped++;
+            return;
+         }
+         memcpy(pool + pool_used, frames, length * sizeof(lispobj *));
+         e->hash = hash;
+         e->start = pool_used;
+         e->length = length;
+         e->count = 1;
+         pool_used += length;
+         num_of_entries++;
+         return;
+      }
+      if(e->hash == hash && same_frames(e, frames, length))
+      {
+         e->count++;
+         return;
+      }
+   }
+}
+
+static void on_sigprof(int sig)
+{
+   lispobj *frames[PROFILE_MAX_FRAMES + 1];
+   interp *it = peek_current_interp();
+   int depth = it == NULL ? 0 : it->shadow_depth;
+   int limit = depth < PROFILE_STACK_SIZE ? depth : PROFILE_STACK_SIZE;
+   int n = limit < PROFILE_MAX_FRAMES ? limit : PROFILE_MAX_FRAMES;
+   int length = 0;
+   int k;
+
+   /* the signal may hit several threads at once; one of them samples */
+   if(__atomic_exchange_n(&sampling, 1, __ATOMIC_ACQUIRE))
+   {
+      return;
+   }
+   num_of_samples++;
+   if(n < depth)
+   {
+      frames[length++] = NULL;   /* printed as "..." */
+   }
+   for(k = depth - n; k < depth; ++k)
+   {
+      frames[length++] = it->shadow_stack[k & (PROFILE_STACK_SIZE - 1)];
+   }
+   record(frames, length);
+   __atomic_store_n(&sampling, 0, __ATOMIC_RELEASE);
+}
+
+/* filepath NULL writes the profile to stderr */
+bool profile_start(char *filepath)
+{
+   struct sigaction sa;
+   struct itimerval timer;
+
+   output = filepath == NULL ? stderr : fopen(filepath, "w");
+   entries = (profile_entry *)calloc(PROFILE_TABLE_SIZE, sizeof(profile_entry));
+   pool = (lispobj **)malloc(PROFILE_POOL_SIZE * sizeof(lispobj *));
+   if(output == NULL || entries == NULL || pool == NULL)
+   {
+      fprintf(stderr, "profile error: can not start profiling\n");
+      return false;
+   }
+   profile_names_start();
+
+   memset(&sa, 0, sizeof(sa));
+   sa.sa_handler = on_sigprof;
+   sa.sa_flags = SA_RESTART;
+   sigemptyset(&sa.sa_mask);
+   sigaction(SIGPROF, &sa, NULL);
+
+   timer.it_interval.tv_sec = 0;
+   timer.it_interval.tv_usec = PROFILE_INTERVAL_USEC;
+   timer.it_value = timer.it_interval;
+   setitimer(ITIMER_PROF, &timer, NULL);
+   return true;
+}
+
+/* folded stacks, one line per distinct stack: scheme;outer;inner count */
+void profile_stop()
+{
+   struct itimerval timer;
+   int i;
+   int k;
+
+   if(entries == NULL)
+   {
+      return;
+   }
+
+   memset(&timer, 0, sizeof(timer));
+   setitimer(ITIMER_PROF, &timer, NULL);
+   signal(SIGPROF, SIG_IGN);
+
+   for(i = 0; i < PROFILE_TABLE_SIZE; ++i)
+   {
+      profile_entry *e = &entries[i];
+      if(e->count == 0)
+      {
+         continue;
+      }
+      fputs("scheme", output);
+      for(k = 0; k < e->length; ++k)
+      {
+         fprintf(output, ";%s", profile_proc_name(pool[e->start + k]));
+      }
+      fprintf(output, " %ld\n", e->count);
+   }
+   if(num_of_dropped > 0)
+   {
+      fprintf(stderr, "profile: %ld of %ld samples dropped\n",
+         num_of_dropped, num_of_samples);
+   }
+
+   if(output != stderr)
+   {
+      fclose(output);
+   }
+   free(entries);
+   free(pool);
+   entries = NULL;
+   pool = NULL;
+}
+
+
+/* heap profile */
+/* allocation sites are keyed like names, by lambda code or primitive */
+typedef struct heap_site
+{
+   lispobj *key;     /* NULL for the top level */
+   lispobj *proc;    /* to name the site */
+   long objects;
+   long bytes;
+} heap_site;
+
+static char *type_names[NUM_OF_TYPES] =
+{
+   "symbol", "cell", "integer", "character", "boolean", "string",
+   "syntax", "macro", "primitive", "lambda", "hash-table", "hamt",
+   "bytevector", "port", "eof-object", "error", "channel", "task",
+   "continuation", "code"
+};
+
+static int heap_period = 0;     /* 0 while procedures are not tracked */
+static int heap_countdown = 0;
+static heap_site *sites = NULL;
+static int sites_size = 0;
+static int sites_used = 0;
+
+static unsigned int site_slot(lispobj *key, int size)
+{
+   return ((uintptr_t)key >> 4) * 2654435761u & (size - 1);
+}
+
+static void grow_sites()
+{
+   heap_site *old = sites;
+   int old_size = sites_size;
+   int i;
+   unsigned int k;
+
+   sites_size = old_size == 0 ? HEAP_PROFILE_SITES : old_size * 2;
+   sites = (heap_site *)calloc(sites_size, sizeof(heap_site));
+   if(sites == NULL)
+   {
+      fprintf(stderr, "heap profile error: out of memory\n");
+      abort();
+   }
+   for(i = 0; i < old_size; ++i)
+   {
+      if(old[i].bytes == 0)
+      {
+         continue;
+      }
+      for(k = site_slot(old[i].key, sites_size); sites[k].bytes != 0;
+          k = (k + 1) & (sites_size - 1));
+      sites[k] = old[i];
+   }
+   free(old);
+}
+
+/* a site is in use once it has counted bytes, every allocation has some */
+static heap_site *find_site(lispobj *proc)
+{
+   lispobj *key = proc == NULL ? NULL : name_key(proc);
+   unsigned int k;
+
+   if(sites_used * 2 >= sites_size)
+   {
+      grow_sites();
+   }
+   for(k = site_slot(key, sites_size); sites[k].bytes != 0;
+       k = (k + 1) & (sites_size - 1))
+   {
+      if(sites[k].key == key)
+      {
+         return &sites[k];
+      }
+   }
+   sites[k].key = key;
+   sites[k].proc = proc;
+   sites_used++;
+   return &sites[k];
+}
+
+void heap_profile_record(int tid, size_t size, bool object)
+{
+   heap_site *site;
+
+   /* the counts by type are kept by the interpreter */
+   if(heap_period > 0 && --heap_countdown <= 0)
+   {
+      heap_countdown = heap_period;
+      site = find_site(profile_current());
+      site->objects += object ? heap_period : 0;
+      site->bytes += size * heap_period;
+   }
+}
+
+void heap_profile_start(int period)
+{
+   heap_period = period;
+   heap_countdown = period;
+   profile_names_start();
+}
+
+static char *site_name(heap_site *site)
+{
+   return site->proc == NULL ? "(toplevel)" : profile_proc_name(site->proc);
+}
+
+static int compare_site_bytes(const void *l, const void *r)
+{
+   long a = (*(heap_site **)l)->bytes;
+   long b = (*(heap_site **)r)->bytes;
+   return (a < b) - (a > b);
+}
+
+/* the used sites, largest first; the array is malloc'd */
+static heap_site **sorted_sites(int *n)
+{
+   heap_site **sorted = (heap_site **)malloc((sites_used + 1) * sizeof(heap_site *));
+   int i;
+
+   *n = 0;
+   for(i = 0; i < sites_size; ++i)
+   {
+      if(sites[i].bytes != 0)
+      {
+         sorted[(*n)++] = &sites[i];
+      }
+   }
+   qsort(sorted, *n, sizeof(heap_site *), compare_site_bytes);
+   return sorted;
+}
+
+void heap_profile_report(FILE *out)
+{
+   interp *it = current_interp();
+   heap_site **sorted;
+   int n;
+   int i;
+
+   fprintf(out, "heap profile: %ld allocations, %ld bytes\n",
+      alloc_count(), alloc_bytes());
+   fprintf(out, "%-24s %12s %14s\n", "type", "objects", "bytes");
+   for(i = 0; i < NUM_OF_TYPES; ++i)
+   {
+      if(it->type_bytes[i] != 0)
+      {
+         fprintf(out, "%-24s %12ld %14ld\n",
+            type_names[i], it->type_objects[i], it->type_bytes[i]);
+      }
+   }
+
+   if(heap_period == 0)
+   {
+      return;
+   }
+   fprintf(out, "%-24s %12s %14s  (every %d allocations)\n",
+      "procedure", "objects", "bytes", heap_period);
+   sorted = sorted_sites(&n);
+   for(i = 0; i < n; ++i)
+   {
+      fprintf(out, "%-24s %12ld %14ld\n",
+         site_name(sorted[i]), sorted[i]->objects, sorted[i]->bytes);
+   }
+   free(sorted);
+}
+
+
+/* primitive procedures */
+static lispobj *stats_entry(lispobj *name, long objects, long bytes)
+{
+   return cons(name, cons(new_integer_long(objects), cons(new_integer_long(bytes), NULL)));
+}
+
+/*
+ * ((objects . n) (bytes . n) (types (cell objects bytes) ...)
+ *  (procedures (name objects bytes) ...))
+ * procedures is empty unless the heap profile was started
+ */
+lispobj *prim_heap_stats(int argc, lispobj **argv)
+{
+   long objects[NUM_OF_TYPES];
+   long bytes[NUM_OF_TYPES];
+   long total_objects = 0;
+   long total_bytes = alloc_bytes();
+   list *types = NULL;
+   list *procs = NULL;
+   heap_site **sorted = NULL;
+   int n = 0;
+   int i;
+
+   /* the result is allocated too, so take the counts first */
+   memcpy(objects, current_interp()->type_objects, sizeof(objects));
+   memcpy(bytes, current_interp()->type_bytes, sizeof(bytes));
+   for(i = 0; i < NUM_OF_TYPES; ++i)
+   {
+      total_objects += objects[i];
+   }
+   if(heap_period > 0)
+   {
+      sorted = sorted_sites(&n);
+   }
+
+   for(i = NUM_OF_TYPES - 1; i >= 0; --i)
+   {
+      if(bytes[i] != 0)
+      {
+         types = cons(stats_entry(new_symbol(type_names[i]), objects[i], bytes[i]), types);
+      }
+   }
+   for(i = n - 1; i >= 0; --i)
+   {
+      procs = cons(stats_entry(new_symbol(site_name(sorted[i])),
+         sorted[i]->objects, sorted[i]->bytes), procs);
+   }
+   free(sorted);
+
+   return cons(cons(new_symbol("objects"), new_integer_long(total_objects)),
+      cons(cons(new_symbol("bytes"), new_integer_long(total_bytes)),
+      cons(cons(new_symbol("types"), types),
+      cons(cons(new_symbol("procedures"), procs), NULL))));
+}
+
+static const prim_spec profile_prims[] =
+{
+   {"heap-stats", prim_heap_stats, 0, 0, {NULL}, false},
+   {NULL}
+};
+
+environment *define_profile_procs(environment *env)
+{
+   return define_prims(env, profile_prims);
+}
@@ -0,0 +1,44 @@
+#ifndef _PROFILE_H_
+#define _PROFILE_H_
+
+#include <stdbool.h>
+#include <stdio.h>
+#include "lispobj.h"
+
+enum profile_define
+{
+   PROFILE_STACK_SIZE = 4096,       /* power of two */
+   PROFILE_MAX_FRAMES = 256,
+   PROFILE_TABLE_SIZE = 65536,      /* power of two */
+   PROFILE_POOL_SIZE = 1 << 20,
+   PROFILE_INTERVAL_USEC = 1000,
+   HEAP_PROFILE_SITES = 256         /* initial size, power of two */
+};
+
+/* shadow stack of the lambdas and primitives being applied */
+void profile_enter(lispobj *proc);
+void profile_leave();
+void profile_unwind(int depth);
+int profile_depth();
+lispobj *profile_current();
+
+/* procedure names, kept once a profile is started */
+void profile_names_start();
+void profile_name(lispobj *proc, symbol *name);
+char *profile_proc_name(lispobj *proc);
+
+/* sampling profiler */
+bool profile_start(char *filepath);
+void profile_stop();
+
+/* heap profile: objects and bytes by type, and by procedure when
+ * started, counting every period-th allocation */
+void heap_profile_record(int tid, size_t size, bool object);
+void heap_profile_start(int period);
+void heap_profile_report(FILE *out);
+
+/* primitive procedures */
+lispobj *prim_heap_stats(int argc, lispobj **argv);
+environment *define_profile_procs(environment *env);
+
+#endif
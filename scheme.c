@@ -0,0 +1,153 @@
+#include "scheme.h"
+#include "interp.h"
+#include "port.h"
+#include <stdio.h>
+#include <string.h>
+
+/* every entry point runs with its scheme current and restores the
+ * caller's afterwards, so schemes can call each other's code */
+scheme *scheme_open()
+{
+   scheme *sc = new_interp();
+   interp *outer = set_current_interp(sc);
+   sc->global_env = new_env();
+   set_current_interp(outer);
+   return sc;
+}
+
+void scheme_close(scheme *sc)
+{
+   delete_interp(sc);
+}
+
+scheme *scheme_use(scheme *sc)
+{
+   return set_current_interp(sc);
+}
+
+
+/* evaluation */
+static lispobj *eval_port(lispobj *in, environment *env)
+{
+   lispobj *obj = NULL;
+   lispobj *result = NULL;
+
+   while(port_read_datum(in, &obj))
+   {
+      result = eval(obj, env);
+   }
+   return result;
+}
+
+static lispobj *apply_call(lispobj *call, environment *env)
+{
+   return apply_procedure(car(call), cdr(call));
+}
+
+/*@null@*/
+lispobj *scheme_eval_string(scheme *sc, const char *source)
+{
+   return scheme_eval_source(sc, source, strlen(source));
+}
+
+/*@null@*/
+lispobj *scheme_eval_source(scheme *sc, const char *source, int length)
+{
+   interp *outer = set_current_interp(sc);
+   lispobj *result = run_limited(eval_port,
+      open_input_string((char *)source, length),
+      sc->global_env, &sc->toplevel_limits);
+   set_current_interp(outer);
+   return result;
+}
+
+/*@null@*/
+lispobj *scheme_eval(scheme *sc, lispobj *exp)
+{
+   interp *outer = set_current_interp(sc);
+   lispobj *result = eval_limited(exp, sc->global_env, &sc->toplevel_limits);
+   set_current_interp(outer);
+   return result;
+}
+
+/*@null@*/
+lispobj *scheme_apply(scheme *sc, lispobj *proc, list *args)
+{
+   interp *outer = set_current_interp(sc);
+   lispobj *result = run_limited(apply_call,
+      cons(proc, args), sc->global_env, &sc->toplevel_limits);
+   set_current_interp(outer);
+   return result;
+}
+
+/*@null@*/
+lispobj *scheme_call(scheme *sc, const char *name, list *args)
+{
+   lispobj *proc;
+   interp *outer;
+   lispobj *result;
+   char message[ERROR_MESSAGE_SIZE];
+
+   if(scheme_lookup(sc, name, &proc))
+   {
+      return scheme_apply(sc, proc, args);
+   }
+   outer = set_current_interp(sc);
+   snprintf(message, ERROR_MESSAGE_SIZE, "%s: unbound variable", name);
+   result = new_error(message);
+   set_current_interp(outer);
+   return result;
+}
+
+
+/* global environment */
+void scheme_define(scheme *sc, const char *name, lispobj *val)
+{
+   interp *outer = set_current_interp(sc);
+   define_var_val(new_symbol((char *)name), val, sc->global_env);
+   set_current_interp(outer);
+}
+
+void scheme_define_primitive(scheme *sc, const char *name, lispobj *(*p)(int, lispobj **))
+{
+   interp *outer = set_current_interp(sc);
+   define_var_val(new_symbol((char *)name), new_prim_proc(p), sc->global_env);
+   set_current_interp(outer);
+}
+
+void scheme_define_primitives(scheme *sc, const prim_spec *specs)
+{
+   interp *outer = set_current_interp(sc);
+   define_prims(sc->global_env, specs);
+   set_current_interp(outer);
+}
+
+bool scheme_lookup(scheme *sc, const char *name, lispobj **val)
+{
+   interp *outer = set_current_interp(sc);
+   cell *c = lookup_var_val(new_symbol((char *)name), sc->global_env);
+   set_current_interp(outer);
+   if(c == NULL)
+   {
+      return false;
+   }
+   *val = cdr(c);
+   return true;
+}
+
+void scheme_set_limits(scheme *sc, eval_limits *limits)
+{
+   sc->toplevel_limits = *limits;
+}
+
+char *scheme_to_string(scheme *sc, lispobj *obj)
+{
+   interp *outer = set_current_interp(sc);
+   port *out = open_output_string();
+   char *s;
+
+   port_write_obj(out, obj, false);
+   s = string_to_char(port_output_string(out));
+   set_current_interp(outer);
+   return s;
+}
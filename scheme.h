@@ -0,0 +1,59 @@
+#ifndef _SCHEME_H_
+#define _SCHEME_H_
+
+/*
+ * Embedding API, in libscheme.a and libscheme.so.
+ *
+ * A scheme is an independent interpreter with its own heap, symbols and
+ * global environment; closing it frees everything it allocated.  Any
+ * number of them can live in a process, each used by one thread at a
+ * time.  The functions below make their scheme current on the calling
+ * thread while they run.  Objects made with the constructors of
+ * lispobj.h belong to the current scheme, see scheme_use.
+ *
+ * Errors and exceeded limits come back as error objects (is_error,
+ * error_message) instead of aborting the process.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "lispobj.h"
+
+typedef struct interp scheme;
+
+scheme *scheme_open();
+void scheme_close(scheme *sc);
+
+/* makes sc current on this thread and returns the previous one */
+scheme *scheme_use(scheme *sc);
+
+/* evaluates every datum of source, the value of the last one */
+lispobj *scheme_eval_string(scheme *sc, const char *source);
+lispobj *scheme_eval_source(scheme *sc, const char *source, int length);
+lispobj *scheme_eval(scheme *sc, lispobj *exp);
+
+void scheme_define(scheme *sc, const char *name, lispobj *val);
+void scheme_define_primitive(scheme *sc, const char *name, lispobj *(*p)(int, lispobj **));
+
+/* defines the primitives of specs, see prim_spec; the table must outlive
+ * sc */
+void scheme_define_primitives(scheme *sc, const prim_spec *specs);
+bool scheme_lookup(scheme *sc, const char *name, lispobj **val);
+
+/* applies the procedure bound to name to a list of arguments */
+lispobj *scheme_call(scheme *sc, const char *name, list *args);
+lispobj *scheme_apply(scheme *sc, lispobj *proc, list *args);
+
+/* the limits of every evaluation started by the functions above */
+void scheme_set_limits(scheme *sc, eval_limits *limits);
+
+/* written representation, owned by sc */
+char *scheme_to_string(scheme *sc, lispobj *obj);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,492 @@
+#include "server.h"
+#include "interp.h"
+#include "port.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+ * One thread, one warm interpreter.  Connections are multiplexed with
+ * poll(2): whatever complete frames a read brings in are evaluated in
+ * order and their replies queued, then written as far as the socket
+ * takes them without blocking.
+ */
+
+typedef struct connection
+{
+   int fd;
+   strbuf in;
+   int in_pos;    /* start of the first frame not evaluated yet */
+   strbuf out;
+   int out_pos;   /* first byte not sent yet */
+   bool eof;
+   bool broken;
+} connection;
+
+static volatile sig_atomic_t stopping = 0;
+
+
+/* frames */
+static unsigned int get_length(const char *p)
+{
+   const unsigned char *u = (const unsigned char *)p;
+   return (unsigned int)u[0] << 24 | u[1] << 16 | u[2] << 8 | u[3];
+}
+
+static void put_length(char *p, unsigned int length)
+{
+   p[0] = (char)(length >> 24);
+   p[1] = (char)(length >> 16);
+   p[2] = (char)(length >> 8);
+   p[3] = (char)length;
+}
+
+void frame_append(strbuf *b, const char *data, int length)
+{
+   char header[FRAME_HEADER_SIZE];
+
+   put_length(header, length);
+   strbuf_append(b, header, FRAME_HEADER_SIZE);
+   if(length > 0)
+   {
+      strbuf_append(b, data, length);
+   }
+}
+
+static bool write_all(int fd, const char *data, int length)
+{
+   int done = 0;
+
+   while(done < length)
+   {
+      int n = write(fd, data + done, length - done);
+      if(n < 0 && errno == EINTR)
+      {
+         continue;
+      }
+      else if(n < 0)
+      {
+         return false;
+      }
+      done += n;
+   }
+   return true;
+}
+
+static bool read_all(int fd, char *data, int length)
+{
+   int done = 0;
+
+   while(done < length)
+   {
+      int n = read(fd, data + done, length - done);
+      if(n < 0 && errno == EINTR)
+      {
+         continue;
+      }
+      else if(n <= 0)
+      {
+         return false;
+      }
+      done += n;
+   }
+   return true;
+}
+
+bool frame_write(int fd, const char *data, int length)
+{
+   strbuf b;
+   bool ok;
+
+   strbuf_init(&b);
+   frame_append(&b, data, length);
+   ok = write_all(fd, b.data, b.length);
+   strbuf_free(&b);
+   return ok;
+}
+
+/* the frame replaces the contents of frame */
+bool frame_read(int fd, strbuf *frame)
+{
+   char header[FRAME_HEADER_SIZE];
+   unsigned int length;
+
+   strbuf_clear(frame);
+   if(!read_all(fd, header, FRAME_HEADER_SIZE))
+   {
+      return false;
+   }
+   length = get_length(header);
+   if(length > FRAME_MAX_SIZE)
+   {
+      return false;
+   }
+   strbuf_reserve(frame, length);
+   if(!read_all(fd, frame->data, length))
+   {
+      return false;
+   }
+   frame->length = length;
+   frame->data[length] = '\0';
+   return true;
+}
+
+
+/* requests */
+/* the reply goes to out as a frame; what the request displays is
+ * collected by capture, the current output port meanwhile */
+static void evaluate(scheme *sc, port *capture, const char *source, int length, strbuf *out)
+{
+   lispobj *saved = sc->stdout_port;
+   int start = out->length;
+   char header[FRAME_HEADER_SIZE + 1];
+   lispobj *result;
+
+   sc->stdout_port = capture;
+   result = scheme_eval_source(sc, source, length);
+   sc->stdout_port = saved;
+
+   if(is_error(result))
+   {
+      port_write(capture, error_message(result), strlen(error_message(result)));
+   }
+   else
+   {
+      port_write_obj(capture, result, false);
+   }
+
+   header[FRAME_HEADER_SIZE] = is_error(result) ? REPLY_ERROR : REPLY_VALUE;
+   strbuf_append(out, header, FRAME_HEADER_SIZE + 1);
+   port_take_output(capture, out);
+   put_length(out->data + start, out->length - start - FRAME_HEADER_SIZE);
+}
+
+static void evaluate_frames(scheme *sc, port *capture, connection *c)
+{
+   int rest;
+
+   while(c->in.length - c->in_pos >= FRAME_HEADER_SIZE)
+   {
+      unsigned int length = get_length(c->in.data + c->in_pos);
+      if(length > FRAME_MAX_SIZE)
+      {
+         c->broken = true;
+         return;
+      }
+      if(c->in.length - c->in_pos - FRAME_HEADER_SIZE < length)
+      {
+         break;
+      }
+      evaluate(sc, capture, c->in.data + c->in_pos + FRAME_HEADER_SIZE, length, &c->out);
+      c->in_pos += FRAME_HEADER_SIZE + length;
+   }
+
+   rest = c->in.length - c->in_pos;
+   memmove(c->in.data, c->in.data + c->in_pos, rest);
+   c->in.length = rest;
+   c->in.data[rest] = '\0';
+   c->in_pos = 0;
+}
+
+
+/* connections */
+static connection *new_connection(int fd)
+{
+   connection *c = (connection *)malloc(sizeof(connection));
+   if(c == NULL)
+   {
+      fprintf(stderr, "serve error: out of memory\n");
+      abort();
+   }
+   fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+   c->fd = fd;
+   strbuf_init(&c->in);
+   c->in_pos = 0;
+   strbuf_init(&c->out);
+   c->out_pos = 0;
+   c->eof = false;
+   c->broken = false;
+   return c;
+}
+
+static void delete_connection(connection *c)
+{
+   close(c->fd);
+   strbuf_free(&c->in);
+   strbuf_free(&c->out);
+   free(c);
+}
+
+static void receive(connection *c)
+{
+   int n;
+
+   strbuf_reserve(&c->in, c->in.length + SERVER_READ_SIZE);
+   n = read(c->fd, c->in.data + c->in.length, SERVER_READ_SIZE);
+   if(n > 0)
+   {
+      c->in.length += n;
+      c->in.data[c->in.length] = '\0';
+   }
+   else if(n == 0)
+   {
+      c->eof = true;
+   }
+   else if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+   {
+      c->broken = true;
+   }
+}
+
+static void send_pending(connection *c)
+{
+   while(c->out_pos < c->out.length)
+   {
+      int n = write(c->fd, c->out.data + c->out_pos, c->out.length - c->out_pos);
+      if(n < 0)
+      {
+         if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+         {
+            c->broken = true;
+         }
+         return;
+      }
+      c->out_pos += n;
+   }
+   strbuf_clear(&c->out);
+   c->out_pos = 0;
+}
+
+static bool finished(connection *c)
+{
+   return c->broken || (c->eof && c->out_pos == c->out.length);
+}
+
+
+/* server */
+static void on_stop(int sig)
+{
+   stopping = 1;
+}
+
+static bool socket_address(char *path, struct sockaddr_un *addr)
+{
+   if(strlen(path) >= sizeof(addr->sun_path))
+   {
+      fprintf(stderr, "serve error: socket path too long\n");
+      return false;
+   }
+   memset(addr, 0, sizeof(*addr));
+   addr->sun_family = AF_UNIX;
+   strcpy(addr->sun_path, path);
+   return true;
+}
+
+static int listen_on(char *path)
+{
+   struct sockaddr_un addr;
+   int fd;
+
+   if(!socket_address(path, &addr))
+   {
+      return -1;
+   }
+   fd = socket(AF_UNIX, SOCK_STREAM, 0);
+   unlink(path);
+   if(fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fd, SERVER_BACKLOG) != 0)
+   {
+      fprintf(stderr, "serve error: can not listen on %s\n", path);
+      return -1;
+   }
+   fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+   return fd;
+}
+
+static void accept_connections(int listener, connection **conns, int *n)
+{
+   int fd;
+
+   while((fd = accept(listener, NULL, NULL)) >= 0)
+   {
+      if(*n >= SERVER_MAX_CONNECTIONS)
+      {
+         close(fd);
+         continue;
+      }
+      conns[(*n)++] = new_connection(fd);
+   }
+}
+
+int scheme_serve(scheme *sc, char *path)
+{
+   struct pollfd fds[SERVER_MAX_CONNECTIONS + 1];
+   connection *conns[SERVER_MAX_CONNECTIONS];
+   struct sigaction sa;
+   int listener = listen_on(path);
+   port *capture;
+   int n = 0;
+   int i;
+
+   if(listener < 0)
+   {
+      return 1;
+   }
+
+   memset(&sa, 0, sizeof(sa));
+   sa.sa_handler = on_stop;
+   sigemptyset(&sa.sa_mask);
+   sigaction(SIGINT, &sa, NULL);
+   sigaction(SIGTERM, &sa, NULL);
+   signal(SIGPIPE, SIG_IGN);
+
+   scheme_use(sc);
+   capture = open_output_string();
+
+   while(!stopping)
+   {
+      fds[0].fd = listener;
+      fds[0].events = POLLIN;
+      for(i = 0; i < n; ++i)
+      {
+         fds[i + 1].fd = conns[i]->fd;
+         fds[i + 1].events = (conns[i]->eof ? 0 : POLLIN) |
+            (conns[i]->out_pos < conns[i]->out.length ? POLLOUT : 0);
+      }
+      if(poll(fds, n + 1, -1) < 0)
+      {
+         if(errno == EINTR)
+         {
+            continue;
+         }
+         fprintf(stderr, "serve error: poll failed\n");
+         break;
+      }
+
+      for(i = n - 1; i >= 0; --i)
+      {
+         connection *c = conns[i];
+         if(fds[i + 1].revents & (POLLIN | POLLHUP | POLLERR))
+         {
+            receive(c);
+            evaluate_frames(sc, capture, c);
+         }
+         send_pending(c);
+         if(finished(c))
+         {
+            delete_connection(c);
+            conns[i] = conns[--n];
+         }
+      }
+      if(fds[0].revents & POLLIN)
+      {
+         accept_connections(listener, conns, &n);
+      }
+   }
+
+   for(i = 0; i < n; ++i)
+   {
+      delete_connection(conns[i]);
+   }
+   close(listener);
+   unlink(path);
+   return 0;
+}
+
+
+/* client */
+static int connect_to(char *path)
+{
+   struct sockaddr_un addr;
+   int fd;
+
+   if(!socket_address(path, &addr))
+   {
+      return -1;
+   }
+   fd = socket(AF_UNIX, SOCK_STREAM, 0);
+   if(fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0)
+   {
+      fprintf(stderr, "client error: can not connect to %s\n", path);
+      if(fd >= 0)
+      {
+         close(fd);
+      }
+      return -1;
+   }
+   return fd;
+}
+
+/* without requests, all of stdin is one request */
+int scheme_client(char *path, char **requests, int num_of_requests)
+{
+   int fd = connect_to(path);
+   strbuf out;
+   strbuf reply;
+   int status = 0;
+   int i;
+
+   if(fd < 0)
+   {
+      return 1;
+   }
+
+   strbuf_init(&out);
+   if(num_of_requests == 0)
+   {
+      char chunk[SERVER_READ_SIZE];
+      int length;
+      strbuf source;
+
+      strbuf_init(&source);
+      while((length = read(0, chunk, sizeof(chunk))) > 0)
+      {
+         strbuf_append(&source, chunk, length);
+      }
+      frame_append(&out, source.length == 0 ? "" : source.data, source.length);
+      strbuf_free(&source);
+      num_of_requests = 1;
+   }
+   else
+   {
+      for(i = 0; i < num_of_requests; ++i)
+      {
+         frame_append(&out, requests[i], strlen(requests[i]));
+      }
+   }
+   if(!write_all(fd, out.data, out.length))
+   {
+      fprintf(stderr, "client error: write failed\n");
+      status = 1;
+      num_of_requests = 0;
+   }
+   shutdown(fd, SHUT_WR);
+   strbuf_free(&out);
+
+   strbuf_init(&reply);
+   for(i = 0; i < num_of_requests; ++i)
+   {
+      if(!frame_read(fd, &reply) || reply.length < 1)
+      {
+         fprintf(stderr, "client error: connection closed\n");
+         status = 1;
+         break;
+      }
+      if(reply.data[0] == REPLY_ERROR)
+      {
+         status = 1;
+      }
+      fwrite(reply.data + 1, 1, reply.length - 1, reply.data[0] == REPLY_ERROR ? stderr : stdout);
+      fputc('\n', reply.data[0] == REPLY_ERROR ? stderr : stdout);
+   }
+   strbuf_free(&reply);
+   close(fd);
+   return status;
+}
@@ -0,0 +1,48 @@
+#ifndef _SERVER_H_
+#define _SERVER_H_
+
+#include <stdbool.h>
+#include "scheme.h"
+#include "lispstring.h"
+
+enum server_define
+{
+   FRAME_HEADER_SIZE = 4,
+   FRAME_MAX_SIZE = 64 * 1024 * 1024,
+   SERVER_READ_SIZE = 64 * 1024,
+   SERVER_MAX_CONNECTIONS = 256,
+   SERVER_BACKLOG = 64
+};
+
+/*
+ * Protocol over a Unix domain stream socket.  Every message is a frame:
+ * a 4 byte big endian length and that many bytes.
+ *
+ *   request   scheme source, every datum is evaluated in order
+ *   reply     one status byte, REPLY_VALUE or REPLY_ERROR, then what
+ *             the request wrote to the current output port followed
+ *             by the written representation of the last value
+ *
+ * A client may send any number of requests without waiting; replies
+ * come back in the same order.
+ */
+typedef enum reply_status
+{
+   REPLY_VALUE = '=',
+   REPLY_ERROR = '!'
+} reply_status;
+
+/* frames */
+void frame_append(strbuf *b, const char *data, int length);
+bool frame_write(int fd, const char *data, int length);
+bool frame_read(int fd, strbuf *frame);
+
+/* serves sc until SIGINT or SIGTERM; returns 0, or 1 if the socket
+ * could not be set up */
+int scheme_serve(scheme *sc, char *path);
+
+/* sends every request pipelined and prints the replies; returns 1 if
+ * any of them was an error */
+int scheme_client(char *path, char **requests, int num_of_requests);
+
+#endif
@@ -0,0 +1,241 @@
+#include "stack.h"
+#include "cont.h"
+#include "interp.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+struct stack_segment
+{
+   /*@null@*/ stack_segment *outer;   /* NULL for the first one */
+   char *low;                         /* of the mapping, a guard page first */
+   unsigned long serial;
+
+   /* the evaluation on it */
+   lispobj *exp;
+   environment *env;
+   /*@null@*/ lispobj *result;
+
+   /* given back when it is left */
+   char *outer_stack_limit;
+   /*@null@*/ char *outer_stack_base;
+};
+
+
+/* calls fn on a stack of its own */
+#if defined(__x86_64__)
+/* keeps the caller's stack pointer in rbp, which fn saves */
+void call_on_stack(void (*fn)(void *), void *arg, char *low, size_t size);
+__asm__(
+   ".text\n"
+   ".globl call_on_stack\n"
+   ".type call_on_stack, @function\n"
+   "call_on_stack:\n"
+   "   pushq %rbp\n"
+   "   movq %rsp, %rbp\n"
+   "   leaq (%rdx,%rcx), %rsp\n"
+   "   movq %rdi, %rax\n"
+   "   movq %rsi, %rdi\n"
+   "   callq *%rax\n"
+   "   movq %rbp, %rsp\n"
+   "   popq %rbp\n"
+   "   ret\n"
+   ".size call_on_stack, .-call_on_stack\n");
+#else
+static __thread void (*started_fn)(void *);
+static __thread void *started_arg;
+
+static void start_on_stack()
+{
+   started_fn(started_arg);
+}
+
+static void call_on_stack(void (*fn)(void *), void *arg, char *low, size_t size)
+{
+   ucontext_t caller;
+   ucontext_t callee;
+
+   getcontext(&callee);
+   callee.uc_stack.ss_sp = low;
+   callee.uc_stack.ss_size = size;
+   callee.uc_link = &caller;
+   makecontext(&callee, start_on_stack, 0);
+   started_fn = fn;
+   started_arg = arg;
+   swapcontext(&caller, &callee);
+}
+#endif
+
+
+/* segments */
+static size_t max_segment_bytes()
+{
+   static size_t max = 0;
+
+   if(max == 0)
+   {
+      long pages = sysconf(_SC_PHYS_PAGES);
+      max = pages > 0 ? (size_t)pages * sysconf(_SC_PAGESIZE) : (size_t)1 << 32;
+   }
+   return max;
+}
+
+static stack_segment *take_segment(interp *it)
+{
+   stack_segment *seg;
+   char *low;
+
+   /* the cache is trimmed here, never on the way out of a segment,
+    * which may still be running on the one it leaves */
+   while(it->num_free_segments > STACK_SEGMENT_CACHE)
+   {
+      seg = it->free_segments;
+      it->free_segments = seg->outer;
+      it->num_free_segments--;
+      it->segment_bytes -= STACK_SEGMENT_SIZE;
+      munmap(seg->low, STACK_SEGMENT_SIZE);
+      free(seg);
+   }
+   if(it->free_segments != NULL)
+   {
+      seg = it->free_segments;
+      it->free_segments = seg->outer;
+      it->num_free_segments--;
+      return seg;
+   }
+
+   if(it->segment_bytes + STACK_SEGMENT_SIZE > max_segment_bytes())
+   {
+      lisp_raise("stack exhausted");
+   }
+   low = mmap(NULL, STACK_SEGMENT_SIZE, PROT_READ | PROT_WRITE,
+      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+   if(low == MAP_FAILED)
+   {
+      lisp_raise("stack exhausted");
+   }
+   seg = (stack_segment *)malloc(sizeof(stack_segment));
+   if(seg == NULL)
+   {
+      munmap(low, STACK_SEGMENT_SIZE);
+      lisp_raise("stack exhausted");
+   }
+   mprotect(low, sysconf(_SC_PAGESIZE), PROT_NONE);
+   seg->low = low;
+   it->segment_bytes += STACK_SEGMENT_SIZE;
+   return seg;
+}
+
+static void leave_segment(interp *it, stack_segment *seg)
+{
+   it->segments = seg->outer;
+   set_stack_limit(seg->outer_stack_limit);
+   it->stack_base = seg->outer_stack_base;
+   seg->outer = it->free_segments;
+   it->free_segments = seg;
+   it->num_free_segments++;
+}
+
+static void run_segment(void *arg)
+{
+   stack_segment *seg = arg;
+   seg->result = eval_at_stack_base(eval, seg->exp, seg->env);
+}
+
+/*@null@*/
+lispobj *eval_on_segment(lispobj *exp, environment *env)
+{
+   interp *it = current_interp();
+   stack_segment *seg = take_segment(it);
+   lispobj *result;
+
+   seg->outer = it->segments;
+   seg->serial = ++it->segment_serial;
+   seg->exp = exp;
+   seg->env = env;
+   seg->result = NULL;
+   seg->outer_stack_limit = set_stack_limit(seg->low + STACK_MARGIN);
+   seg->outer_stack_base = it->stack_base;
+   it->segments = seg;
+
+   call_on_stack(run_segment, seg, seg->low, STACK_SEGMENT_SIZE);
+
+   result = seg->result;
+   leave_segment(it, seg);
+   return result;
+}
+
+void unwind_segments(stack_segment *to)
+{
+   interp *it = current_interp();
+
+   while(it->segments != NULL && it->segments != to)
+   {
+      leave_segment(it, it->segments);
+   }
+}
+
+char *bottom_stack_base()
+{
+   interp *it = current_interp();
+   stack_segment *seg = it->segments;
+
+   if(seg == NULL)
+   {
+      return it->stack_base;
+   }
+   while(seg->outer != NULL)
+   {
+      seg = seg->outer;
+   }
+   return seg->outer_stack_base;
+}
+
+unsigned long segment_serial(stack_segment *seg)
+{
+   return seg == NULL ? 0 : seg->serial;
+}
+
+static void free_chain(stack_segment *seg)
+{
+   while(seg != NULL)
+   {
+      stack_segment *outer = seg->outer;
+      munmap(seg->low, STACK_SEGMENT_SIZE);
+      free(seg);
+      seg = outer;
+   }
+}
+
+bool on_segment(stack_segment *seg, unsigned long serial)
+{
+   stack_segment *s;
+
+   if(seg == NULL)
+   {
+      return true;
+   }
+   for(s = current_interp()->segments; s != NULL; s = s->outer)
+   {
+      if(s == seg)
+      {
+         return s->serial == serial;
+      }
+   }
+   return false;
+}
+
+/* for an interpreter being deleted, which runs on none of them */
+void free_stack_segments(interp *it)
+{
+   free_chain(it->segments);
+   free_chain(it->free_segments);
+   it->segments = NULL;
+   it->free_segments = NULL;
+   it->num_free_segments = 0;
+   it->segment_bytes = 0;
+}
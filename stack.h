@@ -0,0 +1,39 @@
+#ifndef _STACK_H_
+#define _STACK_H_
+
+#include "lispobj.h"
+
+struct interp;
+
+enum stack_define
+{
+   STACK_SEGMENT_SIZE = 4 << 20,   /* reserved; pages are committed on use */
+   STACK_SEGMENT_CACHE = 4         /* left segments kept for the next overflow */
+};
+
+/*
+ * The evaluator recurses in C, once per nested evaluation.  When eval
+ * finds its frame below the stack limit, it carries on in a segment:
+ * stack mapped from memory, which the evaluation switches to and
+ * switches back from when it returns.  Segments are chained, so the
+ * depth of a recursion is bounded by memory, up to the physical memory
+ * of the machine, rather than by the stack of the thread; beyond that
+ * eval raises "stack exhausted".
+ *
+ * Errors and escapes jump across segments, and unwind_segments puts the
+ * ones they left back.  Each green thread has a chain of its own.
+ */
+typedef struct stack_segment stack_segment;
+
+/*@null@*/ lispobj *eval_on_segment(lispobj *exp, environment *env);
+void unwind_segments(/*@null@*/ stack_segment *to);
+
+/* the base of the evaluation on the thread's or task's own stack */
+char *bottom_stack_base();
+/* distinct for each time a segment is entered, 0 off segments */
+unsigned long segment_serial(/*@null@*/ stack_segment *seg);
+/* whether the evaluation is still on seg, entered at serial */
+bool on_segment(/*@null@*/ stack_segment *seg, unsigned long serial);
+void free_stack_segments(struct interp *it);
+
+#endif
@@ -1,7 +1,23 @@
 #include "lispobj.h"
+#include "hashtable.h"
+#include "hamt.h"
+#include "lispstring.h"
+#include "bytevector.h"
+#include "port.h"
+#include "profile.h"
+#include "scheme.h"
+#include "server.h"
+#include "analyze.h"
 #include <assert.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 
 int test_symbol()
 {
@@ -204,10 +220,10 @@ int test_plus_integer()
    integer *i20 = new_integer(20);
    integer *i30 = new_integer(30);
    integer *i60 = new_integer(60);
-   list *val10 = cons(i10, cons(i20, cons(i30, NULL)));
+   lispobj *val10[] = {i10, i20, i30};
 
-   assert(generic_equal(proc_plus_integer(cons(i10,NULL)), i10));
-   assert(generic_equal(proc_plus_integer(val10), i60));
+   assert(generic_equal(proc_plus_integer(1, val10), i10));
+   assert(generic_equal(proc_plus_integer(3, val10), i60));
 
    return 1;
 }
@@ -245,8 +261,37 @@ int test_quote()
 int test_string()
 {
    string *s = new_string("hello!");
+   string *r = s;
+   string_builder *sb = new_string_builder();
+   environment *env = new_env();
+   lispobj *obj;
+   int i;
+
    assert(is_string(s));
    assert(strcmp(car(s), "hello!") == 0);
+   assert(string_length(s) == 6);
+
+   for(i = 0; i < 1000; ++i)
+   {
+      r = string_append(r, s);
+      string_builder_append(sb, s);
+   }
+   assert(string_length(r) == 6006);
+   assert(car(r) == NULL);
+   assert(strncmp(string_to_char(r) + 6000, "hello!", 6) == 0);
+   assert(car(r) != NULL);
+   assert(string_hash(r) == string_hash(string_append(s, string_builder_to_string(sb))));
+   assert(generic_equal(r, string_append(s, string_builder_to_string(sb))));
+   assert(!generic_equal(r, string_builder_to_string(sb)));
+
+   obj = read_tokens(expand_readmacro(tokenize(
+      "(begin (define sb (make-string-builder))"
+      " (string-builder-append! sb \"n=\" 42 '(a b))"
+      " (string-builder->string sb))")));
+   obj = eval(obj, env);
+   assert(strcmp(string_to_char(obj), "n=42(a b)") == 0);
+   assert(string_length(obj) == 9);
+
    return 1;
 }
 
@@ -562,6 +607,931 @@ bool test_cond()
    return true;
 }
 
+bool test_hashtable()
+{
+   hash_table *h = new_hash_table(HASH_EQUAL);
+   hash_table *e = new_hash_table(HASH_EQV);
+   environment *env = new_env();
+   lispobj *val;
+   list *l;
+   int i;
+
+   for(i = 0; i < 10000; ++i)
+   {
+      hash_table_set(h, new_integer(i), new_integer(i * 2));
+   }
+   assert(hash_table_count(h) == 10000);
+   for(i = 0; i < 10000; i += 2)
+   {
+      assert(hash_table_delete(h, new_integer(i)));
+   }
+   assert(hash_table_count(h) == 5000);
+   for(i = 0; i < 10000; ++i)
+   {
+      bool found = hash_table_lookup(h, new_integer(i), &val);
+      assert(found == (i % 2 == 1));
+      if(found)
+      {
+         assert(integer_to_int(val) == i * 2);
+      }
+   }
+   assert(list_length(hash_table_to_alist(h)) == 5000);
+
+   l = cons(new_symbol("a"), cons(new_integer(1), NULL));
+   hash_table_set(h, l, new_integer(1));
+   assert(hash_table_lookup(
+      h, cons(new_symbol("a"), cons(new_integer(1), NULL)), NULL));
+   hash_table_set(e, l, new_integer(1));
+   assert(hash_table_lookup(e, l, NULL));
+   assert(!hash_table_lookup(
+      e, cons(new_symbol("a"), cons(new_integer(1), NULL)), NULL));
+   hash_table_set(e, new_symbol("a"), new_integer(2));
+   assert(hash_table_lookup(e, new_symbol("a"), &val));
+   assert(integer_to_int(val) == 2);
+
+   l = read_tokens(expand_readmacro(tokenize(
+      "(begin (define h (make-hash-table))"
+      " (hash-table-set! h '(1 2) 10)"
+      " (hash-table-set! h 'x 20)"
+      " (hash-table-set! h 'x 30)"
+      " (hash-table-delete! h '(1 2))"
+      " (+ (hash-table-count h) (hash-table-ref h 'x) (hash-table-ref h 'y 5)))")));
+   val = eval(l, env);
+   assert(integer_to_int(val) == 36);
+
+   return true;
+}
+
+bool test_hamt()
+{
+   hamt *m = new_hamt();
+   hamt *snapshot;
+   hamt *t;
+   environment *env = new_env();
+   lispobj *val;
+   list *l;
+   list *r;
+   int i;
+
+   for(i = 0; i < 2000; ++i)
+   {
+      m = hamt_set(m, new_integer(i), new_integer(i));
+   }
+   snapshot = m;
+   assert(hamt_count(m) == 2000);
+
+   for(i = 0; i < 2000; i += 2)
+   {
+      m = hamt_delete(m, new_integer(i));
+   }
+   assert(hamt_count(m) == 1000);
+   assert(hamt_count(snapshot) == 2000);
+   for(i = 0; i < 2000; ++i)
+   {
+      assert(hamt_lookup(m, new_integer(i), &val) == (i % 2 == 1));
+      assert(hamt_lookup(snapshot, new_integer(i), &val));
+      assert(integer_to_int(val) == i);
+   }
+
+   /* same contents, same iteration order */
+   t = hamt_transient(new_hamt());
+   for(i = 1999; i >= 0; i -= 2)
+   {
+      hamt_set_transient(t, new_integer(i), new_integer(i));
+   }
+   hamt_persistent(t);
+   assert(hamt_count(t) == 1000);
+   l = hamt_to_alist(m);
+   r = hamt_to_alist(t);
+   assert(generic_equal(l, r));
+
+   l = read_tokens(expand_readmacro(tokenize(
+      "(begin (define a (hamt-set (make-hamt) 'x 1))"
+      " (define b (hamt-set a 'x 2))"
+      " (define c (hamt-set b '(1 2) 3))"
+      " (+ (hamt-ref a 'x) (hamt-ref b 'x) (hamt-ref c '(1 2)) (hamt-count c)))")));
+   val = eval(l, env);
+   assert(integer_to_int(val) == 8);
+
+   return true;
+}
+
+bool test_bytevector()
+{
+   char path[] = "/tmp/test_bytevectorXXXXXX";
+   unsigned char data[] = {1, 2, 3, 4, 0xff, 0xfe, 0xfd, 0xfc};
+   environment *env = new_env();
+   bytevector *bv;
+   lispobj *obj;
+   FILE *fp;
+   int fd = mkstemp(path);
+
+   assert(fd >= 0);
+   fp = fdopen(fd, "wb");
+   fwrite(data, 1, sizeof(data), fp);
+   fclose(fp);
+
+   bv = mmap_bytevector(path);
+   assert(is_bytevector(bv));
+   assert(bytevector_is_readonly(bv));
+   assert(bytevector_length(bv) == 8);
+   define_var_val(new_symbol("bv"), bv, env);
+
+   obj = read_tokens(expand_readmacro(tokenize("(bytevector-u8-ref bv 4)")));
+   assert(integer_to_long(eval(obj, env)) == 0xff);
+   assert(eval(obj, env) == eval(obj, env));
+
+   obj = read_tokens(expand_readmacro(tokenize("(bytevector-u16-ref bv 0 'big)")));
+   assert(integer_to_long(eval(obj, env)) == 0x0102);
+
+   obj = read_tokens(expand_readmacro(tokenize("(bytevector-u32-ref bv 4)")));
+   assert(integer_to_long(eval(obj, env)) == 0xfcfdfeffL);
+
+   obj = read_tokens(expand_readmacro(tokenize(
+      "(begin (define b (make-bytevector 3 7)) (bytevector-u8-set! b 1 9)"
+      " (+ (bytevector-u8-ref b 0) (bytevector-u8-ref b 1) (bytevector-length b)))")));
+   assert(integer_to_long(eval(obj, env)) == 19);
+
+   unlink(path);
+   return true;
+}
+
+bool test_port()
+{
+   char *text = "(a (b . c)) ; comment\n 'x \"s\\\"t\"\nrest of line\n";
+   environment *env = new_env();
+   port *in;
+   port *out;
+   lispobj *obj;
+   strbuf line;
+
+   in = open_input_string(text, strlen(text));
+
+   assert(port_read_datum(in, &obj));
+   assert(generic_equal(obj, cons(new_symbol("a"),
+      cons(cons(new_symbol("b"), new_symbol("c")), NULL))));
+   assert(port_read_datum(in, &obj));
+   assert(generic_equal(obj, cons(new_symbol("quote"), cons(new_symbol("x"), NULL))));
+   assert(port_read_datum(in, &obj));
+   assert(strcmp(string_to_char(obj), "s\"t") == 0);
+   assert(port_read_char(in) == '\n');
+   strbuf_init(&line);
+   assert(port_read_line(in, &line));
+   assert(strcmp(line.data, "rest of line") == 0);
+   assert(!port_read_datum(in, &obj));
+   assert(port_peek_char(in) == PORT_EOF);
+
+   out = open_output_string();
+   port_write_obj(out, read_tokens(expand_readmacro(tokenize("(1 \"a\" (b . 2))"))), false);
+   assert(strcmp(string_to_char(port_output_string(out)), "(1 \"a\" (b . 2))") == 0);
+
+   obj = read_tokens(expand_readmacro(tokenize("(open-output-file \"/tmp/test_port_out\")")));
+   out = eval(obj, env);
+   define_var_val(new_symbol("out"), out, env);
+   obj = read_tokens(expand_readmacro(tokenize(
+      "(begin (write '(1 \"two\" three) out) (newline out) (display \"end\" out) (close-port out))")));
+   eval(obj, env);
+   in = open_input_file("/tmp/test_port_out");
+   assert(port_read_datum(in, &obj));
+   assert(integer_to_int(car(obj)) == 1);
+   assert(strcmp(string_to_char(car(cdr(obj))), "two") == 0);
+   assert(port_read_datum(in, &obj));
+   assert(equal_symbol(obj, new_symbol("end")));
+   port_close(in);
+
+   unlink("/tmp/test_port_out");
+   return true;
+}
+
+bool test_core_procs()
+{
+   environment *env = new_env();
+   lispobj *obj;
+   long allocs;
+
+   obj = read_tokens(expand_readmacro(tokenize(
+      "(define f (lambda (n) (if (< n 2) n (+ (f (- n 1)) (f (- n 2))))))")));
+   eval(obj, env);
+   obj = read_tokens(expand_readmacro(tokenize("(f 10)")));
+   assert(integer_to_long(eval(obj, env)) == 55);
+
+   obj = read_tokens(expand_readmacro(tokenize("(begin (define x 6) (set! x (* x 7)) x)")));
+   assert(integer_to_long(eval(obj, env)) == 42);
+
+   obj = read_tokens(expand_readmacro(tokenize(
+      "(list (quotient 17 5) (remainder 17 5) (- 3) (= 2 2 2) (<= 1 1 2) (> 2 1 1))")));
+   assert(generic_equal(eval(obj, env),
+      read_tokens(expand_readmacro(tokenize("(3 2 -3 #t #t #f)")))));
+
+   obj = read_tokens(expand_readmacro(tokenize(
+      "(list (eq? 'a 'a) (null? '()) (pair? '()) (not #f) (if #f 1))")));
+   assert(generic_equal(eval(obj, env),
+      read_tokens(expand_readmacro(tokenize("(#t #t #f #t #f)")))));
+
+   obj = read_tokens(expand_readmacro(tokenize(
+      "(begin (define p (cons 1 2)) (set-car! p 3) (set-cdr! p '()) p)")));
+   assert(generic_equal(eval(obj, env), cons(new_integer(3), NULL)));
+
+   allocs = alloc_count();
+   cons(NULL, NULL);
+   assert(alloc_count() == allocs + 1);
+
+   obj = read_tokens(expand_readmacro(tokenize("(time (define y 1) (f 5))")));
+   assert(integer_to_long(eval(obj, env)) == 5);
+   obj = eval(read_tokens(expand_readmacro(tokenize("(runtime-stats)"))), env);
+   assert(integer_to_long(cdr(assoc(new_symbol("max-depth"), obj))) > 5);
+   assert(integer_to_long(cdr(assoc(new_symbol("lookups"), obj))) > 0);
+   assert(get_runtime_stats()->eval_depth == 0);
+
+   return true;
+}
+
+bool test_profile()
+{
+   environment *env;
+   lispobj *f;
+   lispobj *stats;
+   long objects;
+
+   /* no names are kept before a profile is started */
+   env = new_env();
+   eval(read_tokens(expand_readmacro(tokenize(
+      "(define f (lambda (x) (car x)))"))), env);
+   assert(strcmp(profile_proc_name(eval(new_symbol("f"), env)), "(lambda)") == 0);
+
+   profile_names_start();
+   env = new_env();
+
+   eval(read_tokens(expand_readmacro(tokenize(
+      "(define f (lambda (x) (car x)))"))), env);
+   f = eval(new_symbol("f"), env);
+   assert(strcmp(profile_proc_name(f), "f") == 0);
+   assert(strcmp(profile_proc_name(eval(new_symbol("car"), env)), "car") == 0);
+   assert(strcmp(profile_proc_name(new_lambda(car(f), env)), "f") == 0);
+   assert(strcmp(profile_proc_name(new_lambda(NULL, env)), "(lambda)") == 0);
+
+   eval(read_tokens(expand_readmacro(tokenize("(f '(1 2))"))), env);
+   assert(profile_depth() == 0);
+   assert(is_code(cdr(car(f))));
+   assert(strcmp(profile_proc_name(f), "f") == 0);
+   profile_enter(f);
+   assert(profile_current() == f);
+   profile_leave();
+   assert(profile_current() == NULL);
+
+   stats = eval(read_tokens(expand_readmacro(tokenize("(heap-stats)"))), env);
+   objects = integer_to_long(cdr(assoc(new_symbol("objects"), stats)));
+   cons(NULL, NULL);
+   stats = eval(read_tokens(expand_readmacro(tokenize("(heap-stats)"))), env);
+   assert(integer_to_long(cdr(assoc(new_symbol("objects"), stats))) > objects);
+   assert(assoc(new_symbol("cell"), cdr(assoc(new_symbol("types"), stats))) != NULL);
+
+   return true;
+}
+
+bool test_limits()
+{
+   environment *env = new_env();
+   eval_limits limits = {1000, 0, 0};
+   lispobj *obj;
+
+   eval(read_tokens(expand_readmacro(tokenize(
+      "(define loop (lambda (n) (loop (+ n 1))))"))), env);
+   obj = eval_limited(read_tokens(expand_readmacro(tokenize("(loop 0)"))), env, &limits);
+   assert(is_error(obj));
+   assert(strcmp(error_message(obj), "fuel exhausted") == 0);
+   assert(get_runtime_stats()->eval_depth == 0);
+   assert(profile_depth() == 0);
+
+   limits.fuel = 0;
+   limits.max_depth = 50;
+   obj = eval_limited(read_tokens(expand_readmacro(tokenize("(loop 0)"))), env, &limits);
+   assert(strcmp(error_message(obj), "recursion too deep") == 0);
+
+   limits.max_depth = 0;
+   limits.max_heap_bytes = 4096;
+   obj = eval_limited(read_tokens(expand_readmacro(tokenize("(loop 0)"))), env, &limits);
+   assert(strcmp(error_message(obj), "heap limit exceeded") == 0);
+
+   limits.max_heap_bytes = 0;
+   obj = eval_limited(read_tokens(expand_readmacro(tokenize("(+ 1 2)"))), env, &limits);
+   assert(integer_to_long(obj) == 3);
+
+   obj = eval(read_tokens(expand_readmacro(tokenize(
+      "(with-limits (0 0 0) (error \"bad\" 1))"))), env);
+   assert(strcmp(error_message(obj), "bad 1") == 0);
+
+   return true;
+}
+
+bool test_analyze()
+{
+   environment *env = new_env();
+   lispobj *f;
+   lispobj *obj;
+   long allocs;
+
+   eval(read_tokens(expand_readmacro(tokenize(
+      "(define counter (lambda (n) (define step 1)"
+      "  (lambda () (set! n (+ n step)) (cond ((< n 3) 'low) (else n)))))"))), env);
+   eval(read_tokens(expand_readmacro(tokenize("(define c (counter 0))"))), env);
+   f = eval(new_symbol("c"), env);
+   assert(is_code(cdr(car(f))));
+   assert(equal_symbol(eval(read_tokens(expand_readmacro(tokenize("(c)"))), env),
+                       new_symbol("low")));
+   eval(read_tokens(expand_readmacro(tokenize("(c)"))), env);
+   obj = eval(read_tokens(expand_readmacro(tokenize("(c)"))), env);
+   assert(integer_to_long(obj) == 3);
+
+   /* macros and syntax known when the body is first run */
+   eval(read_tokens(expand_readmacro(tokenize(
+      "(defmacro twice (x) `(+ ,x ,x))"))), env);
+   eval(read_tokens(expand_readmacro(tokenize(
+      "(define g (lambda (x) (define y (twice x)) (if (> y 4) y (quote small))))"))), env);
+   obj = eval(read_tokens(expand_readmacro(tokenize("(g 3)"))), env);
+   assert(integer_to_long(obj) == 6);
+   obj = eval(read_tokens(expand_readmacro(tokenize("(g 1)"))), env);
+   assert(equal_symbol(obj, new_symbol("small")));
+
+   /* free variables are looked up when run */
+   eval(read_tokens(expand_readmacro(tokenize("(define h (lambda () later))"))), env);
+   eval(read_tokens(expand_readmacro(tokenize("(define later 7)"))), env);
+   obj = eval(read_tokens(expand_readmacro(tokenize("(h)"))), env);
+   assert(integer_to_long(obj) == 7);
+
+   /* and cached until defined again */
+   eval(read_tokens(expand_readmacro(tokenize("(define later 8)"))), env);
+   obj = eval(read_tokens(expand_readmacro(tokenize("(h)"))), env);
+   assert(integer_to_long(obj) == 8);
+   eval(read_tokens(expand_readmacro(tokenize("(set! later 9)"))), env);
+   obj = eval(read_tokens(expand_readmacro(tokenize("(h)"))), env);
+   assert(integer_to_long(obj) == 9);
+
+   /* arguments to primitives are passed without consing: a call to
+    * car costs no more than returning the argument */
+   eval(read_tokens(expand_readmacro(tokenize(
+      "(define pair (quote (1 2)))"))), env);
+   eval(read_tokens(expand_readmacro(tokenize(
+      "(define first (lambda (x) (car x)))"))), env);
+   eval(read_tokens(expand_readmacro(tokenize(
+      "(define same (lambda (x) x))"))), env);
+   obj = read_tokens(expand_readmacro(tokenize("(first pair)")));
+   f = read_tokens(expand_readmacro(tokenize("(same pair)")));
+   eval(obj, env);
+   eval(f, env);
+   allocs = alloc_count();
+   eval(f, env);
+   allocs = alloc_count() - allocs;
+   allocs += alloc_count();
+   eval(obj, env);
+   assert(alloc_count() == allocs);
+
+   obj = eval(read_tokens(expand_readmacro(tokenize(
+      "(with-limits (0 0 0) ((lambda () (set! unbound 1))))"))), env);
+   assert(strcmp(error_message(obj), "set! error: unbound variable unbound") == 0);
+   return true;
+}
+
+static long evals_of(char *source, environment *env)
+{
+   lispobj *exp = read_tokens(expand_readmacro(tokenize(source)));
+   long evals;
+
+   eval(exp, env);
+   evals = get_runtime_stats()->evals;
+   eval(exp, env);
+   return get_runtime_stats()->evals - evals;
+}
+
+bool test_fold()
+{
+   environment *env = new_env();
+   lispobj *obj;
+
+   /* calls of pure primitives on constants and constant tests cost
+    * what their values do */
+   eval(read_tokens(expand_readmacro(tokenize("(define seven (lambda () 7))"))), env);
+   eval(read_tokens(expand_readmacro(tokenize(
+      "(define folded (lambda () (+ 1 (* 2 3))))"))), env);
+   eval(read_tokens(expand_readmacro(tokenize(
+      "(define pruned (lambda () (cond (#f 1) ((quote t) (if #f 2 7)) (else 3))))"))), env);
+   assert(evals_of("(folded)", env) == evals_of("(seven)", env));
+   assert(evals_of("(pruned)", env) == evals_of("(seven)", env));
+   assert(integer_to_long(eval(read_tokens(expand_readmacro(tokenize("(folded)"))), env)) == 7);
+   assert(integer_to_long(eval(read_tokens(expand_readmacro(tokenize("(pruned)"))), env)) == 7);
+
+   /* errors are left to the call */
+   eval(read_tokens(expand_readmacro(tokenize("(define q (lambda () (quotient 1 0)))"))), env);
+   obj = eval(read_tokens(expand_readmacro(tokenize("(with-limits (0 0 0) (q))"))), env);
+   assert(strcmp(error_message(obj), "quotient error: division by zero") == 0);
+
+   /* small procedures are inlined: no frame is allocated */
+   eval(read_tokens(expand_readmacro(tokenize("(define inc (lambda (x) (+ x 1)))"))), env);
+   eval(read_tokens(expand_readmacro(tokenize("(define g (lambda (y) (inc y)))"))), env);
+   eval(read_tokens(expand_readmacro(tokenize("(define h (lambda (y) (+ y 1)))"))), env);
+   assert(evals_of("(g 1)", env) < evals_of("(h 1)", env) + 2);
+   assert(integer_to_long(eval(read_tokens(expand_readmacro(tokenize("(g 1)"))), env)) == 2);
+
+   /* and called again once defined again */
+   eval(read_tokens(expand_readmacro(tokenize("(define inc (lambda (x) (- x 1)))"))), env);
+   assert(integer_to_long(eval(read_tokens(expand_readmacro(tokenize("(g 1)"))), env)) == 0);
+   eval(read_tokens(expand_readmacro(tokenize("(define * +)"))), env);
+   assert(integer_to_long(eval(read_tokens(expand_readmacro(tokenize("(folded)"))), env)) == 6);
+   return true;
+}
+
+bool test_closure()
+{
+   environment *env = new_env();
+   lispobj *f;
+   lispobj *obj;
+
+   /* a closure keeps the bindings it refers to, not the frames */
+   eval(read_tokens(expand_readmacro(tokenize(
+      "(define keep (lambda (big x) (lambda () x)))"))), env);
+   f = eval(read_tokens(expand_readmacro(tokenize("(keep (quote (1 2 3)) 5)"))), env);
+   assert(list_length(frame_bindings(car(cdr(f)))) == 1);
+   assert(cdr(cdr(f)) == env);
+   obj = apply_lambda(f, 0, NULL);
+   assert(integer_to_long(obj) == 5);
+
+   /* or only the environment the outermost body was made in */
+   eval(read_tokens(expand_readmacro(tokenize(
+      "(define none (lambda (big) (lambda (y) (+ y 1))))"))), env);
+   f = eval(read_tokens(expand_readmacro(tokenize("(none 1)"))), env);
+   assert(cdr(f) == env);
+
+   /* set! on a kept binding is seen by every closure keeping it */
+   eval(read_tokens(expand_readmacro(tokenize(
+      "(define pair-of (lambda (x) (cons (lambda () x) (lambda (v) (set! x v)))))"))), env);
+   eval(read_tokens(expand_readmacro(tokenize("(define p (pair-of 1))"))), env);
+   eval(read_tokens(expand_readmacro(tokenize("((cdr p) 42)"))), env);
+   obj = eval(read_tokens(expand_readmacro(tokenize("((car p))"))), env);
+   assert(integer_to_long(obj) == 42);
+
+   /* through closures made by closures */
+   eval(read_tokens(expand_readmacro(tokenize(
+      "(define deep (lambda (a) (lambda (b) (lambda () (set! a (+ a b)) a))))"))), env);
+   eval(read_tokens(expand_readmacro(tokenize("(define d ((deep 1) 2))"))), env);
+   eval(read_tokens(expand_readmacro(tokenize("(d)"))), env);
+   obj = eval(read_tokens(expand_readmacro(tokenize("(d)"))), env);
+   assert(integer_to_long(obj) == 5);
+
+   /* a variable defined in the body may not be bound yet */
+   eval(read_tokens(expand_readmacro(tokenize(
+      "(define f (lambda (x) (define g (lambda () (h x))) (define h (lambda (y) (* y 2))) (g)))"))), env);
+   obj = eval(read_tokens(expand_readmacro(tokenize("(f 21)"))), env);
+   assert(integer_to_long(obj) == 42);
+
+   /* a parameter left without an argument is looked up outside */
+   eval(read_tokens(expand_readmacro(tokenize(
+      "(define opt (lambda (a b) (lambda () b)))"))), env);
+   eval(read_tokens(expand_readmacro(tokenize("(define b 99)"))), env);
+   obj = eval(read_tokens(expand_readmacro(tokenize("((opt 1))"))), env);
+   assert(integer_to_long(obj) == 99);
+   return true;
+}
+
+bool test_prim_spec()
+{
+   environment *env = new_env();
+   lispobj *car_proc = eval(new_symbol("car"), env);
+   lispobj *obj;
+
+   assert(prim_takes(car_proc, 1));
+   assert(!prim_takes(car_proc, 2));
+   assert(strcmp(prim_proc_spec(car_proc)->name, "car") == 0);
+   assert(is_pure_prim(car_proc));
+   assert(!is_pure_prim(eval(new_symbol("print"), env)));
+
+   /* checked by apply_prim_proc, not by the primitives */
+   obj = eval(read_tokens(expand_readmacro(tokenize(
+      "(with-limits (0 0 0) (+ 1 (quote a)))"))), env);
+   assert(strcmp(error_message(obj), "+ error: not an integer") == 0);
+   obj = eval(read_tokens(expand_readmacro(tokenize(
+      "(with-limits (0 0 0) ((lambda () (car 1 2))))"))), env);
+   assert(strcmp(error_message(obj), "car error: arg error") == 0);
+
+   /* a call checked for one primitive is checked again for another */
+   eval(read_tokens(expand_readmacro(tokenize("(define op car)"))), env);
+   eval(read_tokens(expand_readmacro(tokenize(
+      "(define first (lambda (x) (op x)))"))), env);
+   obj = eval(read_tokens(expand_readmacro(tokenize("(first (quote (1 2)))"))), env);
+   assert(integer_to_long(obj) == 1);
+   eval(read_tokens(expand_readmacro(tokenize("(define op cons)"))), env);
+   obj = eval(read_tokens(expand_readmacro(tokenize(
+      "(with-limits (0 0 0) (first 1))"))), env);
+   assert(strcmp(error_message(obj), "cons error: arg error") == 0);
+   return true;
+}
+
+static lispobj *prim_twice(int argc, lispobj **argv)
+{
+   return new_integer(integer_to_int(argv[0]) * 2);
+}
+
+static const prim_spec twice_prims[] =
+{
+   {"checked-twice", prim_twice, 1, 1, {is_integer}, true},
+   {NULL}
+};
+
+bool test_scheme()
+{
+   scheme *a = scheme_open();
+   scheme *b = scheme_open();
+   scheme *outer;
+   eval_limits limits = {1000, 0, 0};
+   lispobj *obj;
+   list *args;
+
+   assert(integer_to_long(scheme_eval_string(a, "(define x 1) (+ x 1)")) == 2);
+   assert(integer_to_long(scheme_eval_string(b, "(define x 10) x")) == 10);
+   assert(integer_to_long(scheme_eval_string(a, "x")) == 1);
+   assert(!scheme_lookup(b, "car-of-a", &obj));
+
+   scheme_define_primitive(a, "twice", prim_twice);
+   assert(integer_to_long(scheme_eval_string(a, "(twice 21)")) == 42);
+   assert(is_error(scheme_eval_string(b, "(twice 21)")));
+   scheme_define_primitives(b, twice_prims);
+   assert(integer_to_long(scheme_eval_string(b, "(checked-twice 21)")) == 42);
+   obj = scheme_eval_string(b, "(checked-twice \"21\")");
+   assert(strcmp(error_message(obj), "checked-twice error: not an integer") == 0);
+
+   outer = scheme_use(a);
+   args = cons(new_integer(4), NULL);
+   scheme_use(outer);
+   assert(integer_to_long(scheme_call(a, "twice", args)) == 8);
+   assert(is_error(scheme_call(a, "no-such-procedure", NULL)));
+   assert(strcmp(scheme_to_string(a, scheme_eval_string(a, "'(1 \"s\" #\\c)")),
+      "(1 \"s\" #\\c)") == 0);
+
+   obj = scheme_eval_string(a, "(quotient 1 0)");
+   assert(strcmp(error_message(obj), "quotient error: division by zero") == 0);
+   scheme_set_limits(a, &limits);
+   scheme_eval_string(a, "(define loop (lambda () (loop)))");
+   assert(strcmp(error_message(scheme_eval_string(a, "(loop)")), "fuel exhausted") == 0);
+   assert(integer_to_long(scheme_eval_string(a, "x")) == 1);
+
+   scheme_close(a);
+   assert(integer_to_long(scheme_eval_string(b, "(+ x 1)")) == 11);
+   scheme_close(b);
+   return true;
+}
+
+bool test_parallel()
+{
+   scheme *sc = scheme_open();
+   lispobj *obj;
+   int same;
+
+   setenv("SCHEME_THREADS", "4", 0);
+   scheme_eval_string(sc,
+      "(define iota (lambda (n) (if (= n 0) '() (cons n (iota (- n 1))))))"
+      "(define fib (lambda (n) (if (< n 2) n (+ (fib (- n 1)) (fib (- n 2))))))");
+   obj = scheme_eval_string(sc, "(parallel-map fib (iota 12))");
+   assert(strcmp(scheme_to_string(sc, obj), "(144 89 55 34 21 13 8 5 3 2 1 1)") == 0);
+   obj = scheme_eval_string(sc,
+      "(parallel-map (lambda (x) (parallel-map (lambda (y) (* x y)) '(1 2))) '(1 2 3))");
+   assert(strcmp(scheme_to_string(sc, obj), "((1 2) (2 4) (3 6))") == 0);
+   assert(scheme_eval_string(sc, "(parallel-map fib '())") == NULL);
+
+   /* symbols made by workers are interned with the caller's */
+   obj = scheme_eval_string(sc,
+      "(parallel-map (lambda (n) (eq? (string->symbol (string-append \"s\" (number->string (remainder n 5))))"
+      "                              (string->symbol \"s1\")))"
+      "              (iota 100))");
+   for(same = 0; obj != NULL; obj = cdr(obj))
+   {
+      same += is_true(car(obj)) ? 1 : 0;
+   }
+   assert(same == 20);
+   assert(is_true(scheme_eval_string(sc, "(eq? 's3 (string->symbol \"s3\"))")));
+
+   /* lookups leave a table that is still resizing as it is: the 97th
+    * insert starts a resize the last three do not finish */
+   obj = scheme_eval_string(sc,
+      "(define table (make-hash-table))"
+      "(define fill (lambda (n) (if (> n 0) (begin (hash-table-set! table n (* n n)) (fill (- n 1))))))"
+      "(fill 100)"
+      "(parallel-map (lambda (n) (define k (+ (remainder n 100) 1)) (= (hash-table-ref table k) (* k k)))"
+      "              (iota 400))");
+   for(same = 0; obj != NULL; obj = cdr(obj))
+   {
+      same += is_true(car(obj)) ? 1 : 0;
+   }
+   assert(same == 400);
+   assert(integer_to_long(scheme_eval_string(sc, "(hash-table-count table)")) == 100);
+
+   /* so does flattening ropes shared by the workers */
+   obj = scheme_eval_string(sc,
+      "(define long (lambda (n s) (if (= n 0) s (long (- n 1) (string-append s \"abcdefghij\")))))"
+      "(define ropes (lambda (n) (if (= n 0) '() (cons (long 30 (number->string n)) (ropes (- n 1))))))"
+      "(define nth (lambda (l i) (if (= i 0) (car l) (nth (cdr l) (- i 1)))))"
+      "(define shared (ropes 10))"
+      "(parallel-map (lambda (n) (define i (remainder n 10))"
+      "                (string=? (nth shared i) (long 30 (number->string (- 10 i)))))"
+      "              (iota 100))");
+   for(same = 0; obj != NULL; obj = cdr(obj))
+   {
+      same += is_true(car(obj)) ? 1 : 0;
+   }
+   assert(same == 100);
+
+   obj = scheme_eval_string(sc, "(parallel-for-each (lambda (n) (quotient 1 (- n 50))) (iota 100))");
+   assert(strcmp(error_message(obj), "quotient error: division by zero") == 0);
+   assert(integer_to_long(scheme_eval_string(sc, "(fib 10)")) == 55);
+   scheme_close(sc);
+   return true;
+}
+
+bool test_place()
+{
+   scheme *sc = scheme_open();
+   lispobj *obj;
+
+   scheme_eval_string(sc,
+      "(define p (place ch"
+      "  (define loop (lambda (acc)"
+      "    (define v (place-channel-get ch))"
+      "    (if (eq? v 'done) acc"
+      "        (begin (place-channel-put ch (cons v (* v v))) (loop (+ acc v))))))"
+      "  (loop 0)))");
+   assert(is_true(scheme_eval_string(sc, "(place? p)")));
+   obj = scheme_eval_string(sc, "(place-channel-put p 3) (place-channel-get p)");
+   assert(strcmp(scheme_to_string(sc, obj), "(3 . 9)") == 0);
+   obj = scheme_eval_string(sc, "(place-channel-put p 4) (place-channel-put p 'done) (place-wait p)");
+   assert(integer_to_long(obj) == 7);
+
+   /* channels travel in messages; the copy is deep */
+   obj = scheme_eval_string(sc,
+      "(define c (make-place-channel 1))"
+      "(define q (place ch (place-channel-put (place-channel-get ch) '(\"s\" #t (x) . 5)) 'ok))"
+      "(place-channel-put q c)"
+      "(place-channel-get c)");
+   assert(strcmp(scheme_to_string(sc, obj), "(\"s\" #t (x) . 5)") == 0);
+   assert(is_symbol(scheme_eval_string(sc, "(place-wait q)")));
+
+   obj = scheme_eval_string(sc, "(place-wait (place ch (quotient 1 0)))");
+   assert(strcmp(error_message(obj), "quotient error: division by zero") == 0);
+   assert(is_error(scheme_eval_string(sc, "(place-channel-put c car)")));
+   assert(is_error(scheme_eval_string(sc, "(place-wait c)")));
+
+   /* a get from a place that has ended raises instead of waiting */
+   obj = scheme_eval_string(sc,
+      "(define dead (place ch (quotient 1 0) (place-channel-put ch 1)))"
+      "(place-channel-get dead)");
+   assert(strcmp(error_message(obj), "quotient error: division by zero") == 0);
+   obj = scheme_eval_string(sc, "(define done (place ch (place-channel-put ch 1) 'end))"
+                            "(place-channel-get done)");
+   assert(integer_to_long(obj) == 1);
+   obj = scheme_eval_string(sc, "(place-channel-get done)");
+   assert(strcmp(error_message(obj), "place-channel-get error: place has exited") == 0);
+   scheme_close(sc);
+   return true;
+}
+
+bool test_green()
+{
+   scheme *sc = scheme_open();
+   lispobj *obj;
+
+   scheme_eval_string(sc,
+      "(define log '())"
+      "(define note (lambda (x) (set! log (cons x log))))"
+      "(define worker (lambda (name)"
+      "  (lambda () (note name) (yield) (note name) (yield) name)))");
+   obj = scheme_eval_string(sc,
+      "(define a (spawn (worker 'a)))"
+      "(define b (spawn (worker 'b)))"
+      "(cons (join a) (join b))");
+   assert(strcmp(scheme_to_string(sc, obj), "(a . b)") == 0);
+   assert(strcmp(scheme_to_string(sc, scheme_eval_string(sc, "log")), "(b a b a)") == 0);
+
+   obj = scheme_eval_string(sc,
+      "(set! log '())"
+      "(define s (spawn (lambda () (sleep 20) (note 'slept))))"
+      "(define f (spawn (lambda () (note 'fast))))"
+      "(join s) log");
+   assert(strcmp(scheme_to_string(sc, obj), "(slept fast)") == 0);
+
+   /* thousands of them */
+   obj = scheme_eval_string(sc,
+      "(define spawn-all (lambda (n) (if (= n 0) '() (cons (spawn (lambda () (yield) n)) (spawn-all (- n 1))))))"
+      "(define join-all (lambda (ts) (if (null? ts) 0 (+ (join (car ts)) (join-all (cdr ts))))))"
+      "(join-all (spawn-all 2000))");
+   assert(integer_to_long(obj) == 2001000);
+
+   obj = scheme_eval_string(sc, "(join (spawn (lambda () (quotient 1 0))))");
+   assert(strcmp(error_message(obj), "quotient error: division by zero") == 0);
+   obj = scheme_eval_string(sc, "(define t (spawn (lambda () (join t)))) (join t)");
+   assert(strcmp(error_message(obj), "join error: a task can not join itself") == 0);
+   scheme_close(sc);
+   return true;
+}
+
+bool test_async()
+{
+   scheme *sc = scheme_open();
+   lispobj *obj;
+
+   /* an echo server and its clients, all tasks on one thread */
+   scheme_eval_string(sc,
+      "(define listener (async-listen \"/tmp/test_async.sock\"))"
+      "(define echo (lambda (fd)"
+      "  (define data (async-read fd))"
+      "  (if (eof-object? data) (close-fd fd)"
+      "      (begin (async-write fd (string-append data \"!\")) (echo fd)))))"
+      "(define serve (lambda (n)"
+      "  (if (= n 0) (close-fd listener)"
+      "      (begin (define fd (async-accept listener))"
+      "             (spawn (lambda () (echo fd)))"
+      "             (serve (- n 1))))))"
+      "(define client (lambda (message)"
+      "  (define fd (async-connect \"/tmp/test_async.sock\"))"
+      "  (async-write fd message)"
+      "  (define reply (async-read fd))"
+      "  (close-fd fd)"
+      "  reply))");
+   obj = scheme_eval_string(sc,
+      "(define server (spawn (lambda () (serve 3))))"
+      "(define a (spawn (lambda () (client \"a\"))))"
+      "(define b (spawn (lambda () (client \"b\"))))"
+      "(define c (spawn (lambda () (sleep 10) (client \"c\"))))"
+      "(cons (join a) (cons (join b) (cons (join c) (join server))))");
+   assert(strcmp(scheme_to_string(sc, obj), "(\"a!\" \"b!\" \"c!\")") == 0);
+
+   obj = scheme_eval_string(sc, "(async-read -1)");
+   assert(strcmp(error_message(obj), "async-read error: arg error") == 0);
+   scheme_close(sc);
+   unlink("/tmp/test_async.sock");
+   return true;
+}
+
+bool test_cont()
+{
+   scheme *sc = scheme_open();
+   lispobj *obj;
+
+   /* early exits */
+   scheme_eval_string(sc,
+      "(define search (lambda (n return)"
+      "  (if (= n 0) (return 'found) (+ 1 (search (- n 1) return)))))");
+   obj = scheme_eval_string(sc, "(call/cc (lambda (k) (search 300 k)))");
+   assert(strcmp(scheme_to_string(sc, obj), "found") == 0);
+   obj = scheme_eval_string(sc, "(call/ec (lambda (k) (search 300 k)))");
+   assert(strcmp(scheme_to_string(sc, obj), "found") == 0);
+   obj = scheme_eval_string(sc, "(+ 1 (call/ec (lambda (k) 41)))");
+   assert(integer_to_long(obj) == 42);
+
+   /* resumed after call/cc has returned */
+   obj = scheme_eval_string(sc,
+      "(define count 0)"
+      "(define again #f)"
+      "(begin (define v (call/cc (lambda (k) (set! again k) 0)))"
+      "       (set! count (+ count 1))"
+      "       (if (< v 5) (again (+ v 1)) count))");
+   assert(integer_to_long(obj) == 6);
+
+   /* a generator, resumed from later evaluations */
+   scheme_eval_string(sc,
+      "(define resume #f)"
+      "(define return #f)"
+      "(define produce (lambda (n)"
+      "  (if (< n 3)"
+      "      (begin (call/cc (lambda (k) (set! resume k) (return n))) (produce (+ n 1)))"
+      "      (return 'done))))"
+      "(define next (lambda ()"
+      "  (call/cc (lambda (k) (set! return k) (if resume (resume #f) (produce 0))))))");
+   assert(integer_to_long(scheme_eval_string(sc, "(next)")) == 0);
+   assert(integer_to_long(scheme_eval_string(sc, "(next)")) == 1);
+   assert(integer_to_long(scheme_eval_string(sc, "(next)")) == 2);
+   obj = scheme_eval_string(sc, "(next)");
+   assert(strcmp(scheme_to_string(sc, obj), "done") == 0);
+
+   /* errors and limits inside are left behind */
+   obj = scheme_eval_string(sc,
+      "(call/ec (lambda (k) (with-limits (100 0 0) (k 1))))"
+      "(search 300 (lambda (x) 0))");
+   assert(integer_to_long(obj) == 300);
+   obj = scheme_eval_string(sc, "(with-limits (100 0 0) (call/cc (lambda (k) (search 300 k))))");
+   assert(strcmp(error_message(obj), "fuel exhausted") == 0);
+   obj = scheme_eval_string(sc, "(call/ec (lambda (k) (search 300 k)))");
+   assert(strcmp(scheme_to_string(sc, obj), "found") == 0);
+
+   obj = scheme_eval_string(sc,
+      "(define escape #f) (call/ec (lambda (k) (set! escape k))) (escape 1)");
+   assert(strcmp(error_message(obj), "continuation error: call/ec has returned") == 0);
+   obj = scheme_eval_string(sc, "(join (spawn (lambda () (again 1))))");
+   assert(strcmp(error_message(obj), "continuation error: captured on another stack") == 0);
+   scheme_close(sc);
+   return true;
+}
+
+bool test_deep()
+{
+   scheme *sc = scheme_open();
+   scheme *outer = scheme_use(sc);
+   list *big = NULL;
+   list *same = NULL;
+   list *deep = NULL;
+   lispobj *obj;
+   int i;
+
+   /* list utilities loop instead of recursing */
+   for(i = 0; i < 100000; ++i)
+   {
+      big = cons(new_integer(i), big);
+      same = cons(new_integer(i), same);
+   }
+   assert(list_length(big) == 100000);
+   assert(is_list(big));
+   assert(integer_to_long(car(last_cell(big))) == 0);
+   assert(generic_equal(big, same));
+   set_car(last_cell(same), new_integer(1));
+   assert(!generic_equal(big, same));
+   for(i = 0; i < 30000; ++i)
+   {
+      deep = cons(new_integer(i), deep);
+   }
+   scheme_use(outer);
+
+   scheme_define(sc, "big", big);
+   scheme_define(sc, "deep", deep);
+   obj = scheme_eval_string(sc, "(car (cdr (quasiquote (x (unquote-splicing big)))))");
+   assert(integer_to_long(obj) == 99999);
+
+   /* recursion deeper than the C stack of the thread, which ran out at
+    * 20000 */
+   scheme_eval_string(sc,
+      "(define len (lambda (l) (if (null? l) 0 (+ 1 (len (cdr l))))))"
+      "(define search (lambda (l return) (if (null? l) (return 'found) (+ 1 (search (cdr l) return)))))");
+   assert(integer_to_long(scheme_eval_string(sc, "(len deep)")) == 30000);
+   obj = scheme_eval_string(sc, "(call/ec (lambda (k) (search deep k)))");
+   assert(strcmp(scheme_to_string(sc, obj), "found") == 0);
+   obj = scheme_eval_string(sc, "(search deep (lambda (x) (quotient 1 0)))");
+   assert(strcmp(error_message(obj), "quotient error: division by zero") == 0);
+   assert(integer_to_long(scheme_eval_string(sc, "(len deep)")) == 30000);
+   scheme_close(sc);
+   return true;
+}
+
+bool test_serve()
+{
+   char *path = "/tmp/test_serve.sock";
+   struct sockaddr_un addr;
+   strbuf requests;
+   strbuf reply;
+   pid_t pid;
+   int fd;
+   int tries;
+
+   pid = fork();
+   if(pid == 0)
+   {
+      scheme *sc = scheme_open();
+      prctl(PR_SET_PDEATHSIG, SIGTERM);
+      scheme_eval_string(sc, "(define x 41)");
+      _exit(scheme_serve(sc, path));
+   }
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strcpy(addr.sun_path, path);
+   fd = socket(AF_UNIX, SOCK_STREAM, 0);
+   for(tries = 0; connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0; ++tries)
+   {
+      assert(tries < 500);
+      usleep(10000);
+   }
+
+   /* pipelined: every request is sent before the first reply is read */
+   strbuf_init(&requests);
+   frame_append(&requests, "(set! x (+ x 1)) x", 18);
+   frame_append(&requests, "(display \"x=\") x", 16);
+   frame_append(&requests, "(car '())", 9);
+   frame_append(&requests, "(car", 4);
+   assert(frame_write(fd, requests.data, 0));
+   assert(write(fd, requests.data, requests.length) == requests.length);
+
+   strbuf_init(&reply);
+   assert(frame_read(fd, &reply) && strcmp(reply.data, "=()") == 0);
+   assert(frame_read(fd, &reply) && strcmp(reply.data, "=42") == 0);
+   assert(frame_read(fd, &reply) && strcmp(reply.data, "=x=42") == 0);
+   assert(frame_read(fd, &reply) && reply.data[0] == REPLY_ERROR);
+   /* a truncated datum is an error for the client */
+   assert(frame_read(fd, &reply) &&
+          strcmp(reply.data, "!read error: unexpected end of file") == 0);
+
+   close(fd);
+   kill(pid, SIGTERM);
+   waitpid(pid, NULL, 0);
+   assert(access(path, F_OK) != 0);
+   strbuf_free(&requests);
+   strbuf_free(&reply);
+   return true;
+}
+
 int main()
 {
    test_symbol();
@@ -580,6 +1550,25 @@ int main()
    test_macro();
    test_equal();
    test_cond();
+   test_core_procs();
+   test_profile();
+   test_limits();
+   test_analyze();
+   test_prim_spec();
+   test_fold();
+   test_closure();
+   test_scheme();
+   test_serve();
+   test_parallel();
+   test_place();
+   test_green();
+   test_async();
+   test_cont();
+   test_deep();
+   test_hashtable();
+   test_hamt();
+   test_bytevector();
+   test_port();
 
    return 0;
 }